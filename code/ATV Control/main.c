@@ -6,18 +6,23 @@
  * for a horn on my ATV.
  *
  * The main output is the Horn which supports up to 20A. A pushbutton switch is used to honk the Horn but 
- * only when the ATV is on (Ignition input 12V). The other LED Outputs (V1 and V2) are turned off just 
- * before the Horn is activated. This keeps the total board maximum current to 20A. The other LED outputs 
- * will return to their previous state once the Horn pushbutton is released. The LED indicator on the Horn.
+ * only when the ATV is on (Ignition input 12V). The other LED Outputs (V1 and V2) are dimmed (or turned off
+ * when there is no current left for them) just before the Horn is activated. This keeps the total board
+ * maximum current to 20A. The other LED outputs will return to their previous state once the Horn
+ * pushbutton is released. The LED indicator on the Horn.
  * switch is RGB. When the ATV is turned on (Ignition input 12V) the Horn indicator LED will cycle through
  * the color spectrum. When the Horn is engaged the indicator LED will flash red.
  *
+ * A double press of the Horn pushbutton plays an SOS panic pattern until the pushbutton is pressed again or
+ * the ATV is turned off. With the chirp feature flag set (CONFIG_FLAG_CHIRP) the Horn chirps once when the ATV
+ * is turned on and twice when it is turned off. Patterns are limited to a HORN_PATTERN_DUTY duty cycle.
+ *
  * The other two 12V outputs (V1 and V2) support 7.5A each and are controlled by pushbutton switches 
  * (Switch 1 and Switch 2). These pushbutton switches will turn off/on the outputs at any time. If the ATV
  * is off (Ignition input 0V) and an Output is turned on it will remain on for a user configurable amount 
  * of time before automatically turning off. When the ATV is turned off (Ignition input 0V) all Outputs are 
- * automatically turned off. These outputs are connected to TCD5 which would allow dimming of LEDs connected
- * to them but this is currently not part of the code below.
+ * automatically turned off. These outputs are connected to TCD5 PWM outputs and soft start and stop so a
+ * cold LED bar does not see the full inrush current at once.
  *
  * In addition to pushbutton control the outputs are automatically enabled by other control inputs. 
  * V1 Output is turned on when the High beam input is turned on (HB input 12V).
@@ -37,27 +42,79 @@
  *  7. When the 10 seconds has elapsed the LEDS will slow flash the newly configured number of minutes
  *     as confirmation.
  *
+ * To enter dimming program mode do the following:
+ *  1. Press and Hold both Switch 1 and Switch 2 for 20 seconds (LEDs start flashing after 10 seconds).
+ *  2. Switch LEDs stop flashing and remain lit. Release both Switch 1 and Switch 2.
+ *  3. Outputs V1 and V2 turn on at their current brightness.
+ *  4. Each time you press and release Switch 1 the brightness of V1 steps down to the next level, after the
+ *     lowest level it returns to full brightness. Switch 2 does the same for V2.
+ *     While a switch is pressed its LED turns off.
+ *  5. Once you have configured the desired brightness wait for 5 seconds. Both brightness levels are saved
+ *     and used every time the outputs turn on.
+ *
  * Created: 10/25/2020
  * Author : Mike Lawrence
  */
 
 /*
  * System Clock is kept at the power on default of Internal 2MHz. Internal 32.768 kHz clock is also enabled.
+ * With OUT_PWM_PROFILE 3 the Internal 32MHz clock is used only while output V1 or V2 is on.
  *
- * RTC clock is set to Internal 32.768kHz. RTC is configured for a 1ms overflow. The overflow rate is 0.708%
- * longer than 1ms but precision timing is not the goal here. The RTC Overflow Interrupt is used to keep track 
- * of millisecond counters (tick_ms, delay_ms, prog_ms and led_ms).
+ * RTC clock is set to Internal 32.768kHz. RTC is configured for a tick of RTC_TICK_COUNTS clocks, about 3.8%
+ * longer than 1ms. The RTC Overflow Interrupt adds the length of each tick (tick_len, 16.16 fixed point
+ * milliseconds) to a single millisecond uptime counter (uptime_ms) and carries the fraction over so the long
+ * term rate is exact, it also debounces all inputs. The RTC clock frequency measured in production can be
+ * stored in the configuration record (rtc_clock_hz) to correct for the RC oscillator tolerance. All delays and timeouts are
+ * deadlines on the uptime counter (deadline_start, deadline_expired and deadline_remaining).
+ *
+ * When Outputs are on with Ignition off (SM_POWER_ON_SW) nothing changes until the delay expires or an input
+ * changes. Instead of spinning the main loop the processor sleeps and the RTC period is stretched so the next
+ * overflow lands on the delay deadline (tickless). The same holds in any state while no output is ramping and
+ * no LED effect is stepped in software (EDMA breathing needs no ticks). Any input change shortens the stretched tick back to the
+ * next millisecond boundary. The stretched tick is limited to TICKLESS_MAX_MS so the watchdog is still serviced.
  * 
+ * In Power Down State the processor is in standby. The watchdog keeps running and the RTC period is stretched
+ * to STANDBY_CHECK_MS, each RTC wake re-samples all inputs (a missed edge starts debouncing), services the
+ * watchdog and checks the wake-up configuration (reinitialized when corrupted) before sleeping again.
+ * The standby current has not been measured on the board. The estimate is a few uA average for the processor:
+ * Power Save with the RTC and watchdog on the internal 32kHz oscillators is a few uA (datasheet typical) and each
+ * check is estimated to be awake for about a thousand CPU cycles. To measure the awake time enable ISR_PROFILE,
+ * standby_awake holds the cycles awake per check,
+ *  average = I(PSAVE) + I(active at F_CPU) * standby_awake / (F_CPU * STANDBY_CHECK_MS / 1000).
+ *
+ * A switch press that will turn its output on does not wait for the debounce. The input change interrupt starts
+ * the output ramp at once (out_fast) and the RTC Overflow Interrupt rolls it back if the press does not debounce.
+ * Timer configuration is kept across Power Save, only the timer clocks are stopped.
+ *
  * The HSW, SW1, SW2, IGN, HB and REV inputs are configured so that any input change will automatically wake
  * the processor from an idle state. The idle state is entered only when Ignition is off (IGN at 0V) and no 
  * LED outputs (V1 and V2) are currently on. HSW, HB and REV inputs are ignored when Ignition is off.
  *
  * All indicator LEDs (HSWLR_EN, HSWLG_EN, HSWLG_EN, SW1L_EN and SW2L_EN) outputs are controlled by 
  * Output Compares which allows PWM of the LED (brightness adjustment).
+ * Every LED and output is a PWM channel with its own duty cycle. LED effects (on, off, breathe and flash) are
+ * timed in software so all channels of a timer keep the same PWM period and each LED can run any effect.
+ * Changed duty cycles are committed to the compare buffers once per tick by the RTC Overflow Interrupt.
+ * The commit scales every LED indicator duty cycle by one gain (led_gain). There is no light sensor, the gain
+ * is lowered while the High Beam has been on recently (taken as dark) and further during the key-off delay.
  * 
  * The main LED outputs V1 and V2 are connected to pins that can be used as Output Compares. So it is possible
- * to use PWM to modulate Output LED light intensity. Currently this code does not support this.
- * Both V1 and V2 can a fixed maximum and a soft start and stop.
+ * to use PWM to modulate Output LED light intensity. Both V1 and V2 ramp between off and a fixed maximum
+ * (soft start and stop) over OUT_RAMP_TIME_MS. The RTC Overflow Interrupt advances the ramps using a linear
+ * or gamma curve, a ramp can be reversed at any point. V1 and V2 are still turned off at once for the Horn.
+ * V2 is phase shifted by half a PWM period: V1 is on around the bottom of the dual slope counter and V2
+ * around its top, so their on-times only overlap when their duty cycles add up to more than 100%. An output
+ * turning on from off waits until OUT_STAGGER_MS after the last one did (ignition on turns both on at once),
+ * so their inrush currents do not add up either.
+ *
+ * The current sense outputs of the high side switches are not connected to the processor (ADCA stays powered
+ * down). V1 and V2 load current is modeled from their duty cycles and the V1_LOAD_MA and V2_LOAD_MA loads. When
+ * both ramp targets would exceed the current budget their duty cycles are folded back together.
+ *
+ * There is no battery voltage divider on the board so the battery is protected by metering the modeled
+ * charge V1 and V2 draw with Ignition off (SM_POWER_ON_SW). The meter is woken by the RTC every
+ * BATTERY_POLL_MS. After BATTERY_DIM_MAH the outputs are dimmed to BATTERY_DIM_MA and the Switch LEDs flash,
+ * after BATTERY_SHED_MAH the outputs are shed early. The meter is cleared once Ignition turns on.
  *
  */
 
@@ -68,6 +125,9 @@
 #include <avr/pgmspace.h>
 #include <avr/sleep.h>
 #include <avr/wdt.h>
+#include <stddef.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
 #include "math.h"
 
 /*
@@ -94,60 +154,403 @@ FUSES =
 #define TRUE							1
 #define OFF								FALSE
 #define ON								TRUE
+// Build option: ISR cycle count profiling (1 = enabled)
+//  Results are in isr_stat_rtc, isr_stat_porta, isr_stat_portc, isr_tick_overruns, isr_tick_period (1ms tick
+//   jitter is max - min) and in_event_latency (read with a debugger)
+//  The deepest stack is found by painting the unused SRAM at reset (stack_used)
+#ifndef ISR_PROFILE
+#define ISR_PROFILE						0
+#endif
+// Footprint budget measured by ISR_PROFILE builds, the Benchmark configuration passes these in from
+//  ATV Control.budget.props. Telemetry reports the budgets that were exceeded (BUDGET_xxx_bm).
+#ifndef BUDGET_ISR_RTC_CYCLES
+#define BUDGET_ISR_RTC_CYCLES			0xFFFF			// Longest RTC Overflow interrupt in cycles
+#endif
+#ifndef BUDGET_ISR_PORT_CYCLES
+#define BUDGET_ISR_PORT_CYCLES			0xFFFF			// Longest input change interrupt in cycles
+#endif
+#ifndef BUDGET_STACK
+#define BUDGET_STACK					0xFFFF			// Deepest stack in bytes
+#endif
+#define BUDGET_RTC_bm					(1 << 0)
+#define BUDGET_PORT_bm					(1 << 1)
+#define BUDGET_STACK_bm					(1 << 2)
+// Value unused SRAM is painted with to find the deepest stack (ISR_PROFILE)
+#define STACK_PAINT						0xC5
+// Build option: full period sine and hue tables in flash (1 = enabled)
+//  Breathing and rainbow steps become table reads instead of sine math at the cost of about 1KB of flash
+#ifndef SINE_TABLES
+#define SINE_TABLES						0
+#endif
+// Build option: Switch LED Indicator breathing streamed by EDMA (1 = enabled)
+//  The breathing waveform is kept in SRAM (256 bytes) and copied into the TCC5 compare buffers on every
+//  TCC5 overflow so the RTC Overflow interrupt no longer touches the breathing LEDs.
+#ifndef LED_EDMA
+#define LED_EDMA						0
+#endif
+// Build option: serial telemetry port on USARTD0 (1 = enabled)
+//  While awake and a host drives the RXD pin high (idle UART line) a telemetry_t frame is sent every
+//  TELEMETRY_PERIOD_MS by the USART Data Register Empty interrupt. The host can write the configuration with
+//  TELEMETRY_SYNC followed by a config_t record. The USART is powered down without a host and in standby.
+#ifndef TELEMETRY
+#define TELEMETRY						0
+#endif
 // Default number of minutes LEDs stay on when turned one with Ignition Off
 #define DEFAULT_DELAY_TIME_MINUTES		5
 // Number of seconds to activate programming sequence
 #define PROG_ACTIVATE_SECONDS			10
+// Number of additional seconds to activate dimming programming sequence
+#define PROG_DIM_ACTIVATE_SECONDS		10
+// Dimming level step, each press lowers an output brightness by this much (ramp curve position 0-255)
+#define DIM_LEVEL_STEP					32
+// Number of milliseconds a switch is held for a long press (a long press of a switch that turned its output
+//  on steps that output to the next brightness level)
+#define GESTURE_LONG_MS					1000
+// Maximum number of milliseconds from one short press release to the next for a double press
+#define GESTURE_DOUBLE_MS				400
 // Number of milliseconds for LED to be ON or OFF when flashing
 #define LED_FLASH_TIME					500
-// Timer Period that will produce normal PWM frequency for LED outputs
-// FREQ = CPU_FREQ / 2 * 64 * PER (PER = 255 = 61.27 Hz)
+// LED indicator brightness gain (LED_GAIN_FULL = full brightness), indicator duty cycles are scaled when committed
+#define LED_GAIN_FULL					256
+// LED indicator gain while it is dark, the High Beam was on within the last LED_NIGHT_HOLD_MS
+#define LED_GAIN_NIGHT					64
+#define LED_NIGHT_HOLD_MS				600000
+// LED indicator gain during the key-off delay (SM_POWER_ON_SW) to save the battery
+#define LED_GAIN_DELAY					48
+// Number of milliseconds between Horn Switch RGB LED rainbow steps
+#define RAINBOW_STEP_MS					65
+// Number of milliseconds between LED indicator effect steps (breathing and flashing)
+#define LED_FX_STEP_MS					9
+// Number of effect steps a flashing LED indicator is on and then off (about 10 Hz)
+#define LED_FLASH_STEPS					5
+// Number of milliseconds between Programming Task runs while programming
+#define PROG_POLL_MS					10
+// Number of milliseconds between telemetry frames (TELEMETRY)
+#define TELEMETRY_PERIOD_MS				100
+// Telemetry baud rate, 8 data bits, no parity, 1 stop bit (TELEMETRY)
+#define TELEMETRY_BAUD					19200
+// Telemetry baud rate BSEL value for a peripheral clock of hz (double speed mode)
+#define TELEMETRY_BSEL(hz)				((((hz) + 4ul * TELEMETRY_BAUD) / (8ul * TELEMETRY_BAUD)) - 1)
+// First byte of every telemetry frame and configuration write
+#define TELEMETRY_SYNC					0xA5
+// Output V1 and V2 PWM frequency profile, FREQ = CLK_FREQ / (2 * PRESCALER * PER)
+//  0 =   61 Hz (2MHz / 64, PER = 255)
+//  1 =  490 Hz (2MHz / 8, PER = 255)
+//  2 = 3.92 kHz (2MHz / 1, PER = 255)
+//  3 = 20.0 kHz (32MHz / 1, PER = 799) System clock is 32MHz only while V1 or V2 is on
+//  The BTS7008 output switching time is fixed so switching losses grow with frequency (keep 2 and 3 for
+//   loads that need them). Profile 3 also raises the processor supply current while an output is on.
+#ifndef OUT_PWM_PROFILE
+#define OUT_PWM_PROFILE					1
+#endif
+#if OUT_PWM_PROFILE == 0
 #define OUT_PWM_PERIOD					255
+#define OUT_PWM_CLKSEL					TC_CLKSEL_DIV64_gc
+#elif OUT_PWM_PROFILE == 1
+#define OUT_PWM_PERIOD					255
+#define OUT_PWM_CLKSEL					TC_CLKSEL_DIV8_gc
+#elif OUT_PWM_PROFILE == 2
+#define OUT_PWM_PERIOD					255
+#define OUT_PWM_CLKSEL					TC_CLKSEL_DIV1_gc
+#elif OUT_PWM_PROFILE == 3
+#define OUT_PWM_PERIOD					799
+#define OUT_PWM_CLKSEL					TC_CLKSEL_DIV1_gc
+#define OUT_PWM_FAST_CLOCK				1
+#else
+#error "Unknown OUT_PWM_PROFILE"
+#endif
+#ifndef OUT_PWM_FAST_CLOCK
+#define OUT_PWM_FAST_CLOCK				0
+#endif
+// Default number of milliseconds for V1 and V2 outputs to ramp from off to full on (0 = no ramp)
+#define OUT_RAMP_TIME_MS				250
+// Minimum number of milliseconds between V1 and V2 turning on from off (0 = both start at once)
+#ifndef OUT_STAGGER_MS
+#define OUT_STAGGER_MS					20
+#endif
+// Output ramp curve (0 = linear duty cycle, 1 = gamma corrected so perceived brightness is linear)
+#define OUT_RAMP_GAMMA					1
+// Load current of each output at 100% duty cycle in mA
+//  The BTS700x current sense (IS) outputs are not routed to the processor so load current is modeled from
+//   the duty cycle of each output. Set these to the connected loads.
+#ifndef V1_LOAD_MA
+#define V1_LOAD_MA						7500
+#endif
+#ifndef V2_LOAD_MA
+#define V2_LOAD_MA						7500
+#endif
+// Total board current budget in mA (V1 and V2 duty cycles are folded back to stay within it)
+#define CURRENT_BUDGET_MA				20000
+// Load current of the Horn in mA, V1 and V2 share what is left of the budget while the Horn is on
+//  The default is the Horn output rating which turns V1 and V2 off, set this to the connected horn.
+#ifndef HORN_LOAD_MA
+#define HORN_LOAD_MA					20000
+#endif
+#if HORN_LOAD_MA < CURRENT_BUDGET_MA
+#define HORN_OUT_BUDGET_MA				(CURRENT_BUDGET_MA - HORN_LOAD_MA)
+#else
+#define HORN_OUT_BUDGET_MA				0
+#endif
+// Battery protection with Ignition off, charge drawn by V1 and V2 in mAh before they are dimmed and shed
+#ifndef BATTERY_DIM_MAH
+#define BATTERY_DIM_MAH					3000
+#endif
+#ifndef BATTERY_SHED_MAH
+#define BATTERY_SHED_MAH				5000
+#endif
+// Current budget in mA for V1 and V2 once they are dimmed to save the battery
+#define BATTERY_DIM_MA					3000
+// Number of milliseconds between battery meter updates with Ignition off
+#define BATTERY_POLL_MS					1000
+// Number of milliseconds the Switch LEDs flash after V1 and V2 are shed before powering down
+#define BATTERY_SHED_NOTICE_MS			5000
+// mA milliseconds in one mAh
+#define MA_MS_PER_MAH					3600000UL
+// Number of milliseconds from folding back V1 and V2 to turning the Horn on
+#define HORN_SEQ_MS						2
+// Horn pattern duty cycle limit in percent, a pattern only (re)starts once the Horn has cooled down to it
+#define HORN_PATTERN_DUTY				25
+// Number of milliseconds of Horn pattern on-time allowed above the duty cycle limit from cold
+#define HORN_PATTERN_BURST_MS			10000
+// Modeled load current running average time constant (2^CURRENT_AVG_SHIFT milliseconds)
+#define CURRENT_AVG_SHIFT				4
+// Fixed point (16.16) mA per duty cycle count of a load, so the tick does not need a division
+#define OUT_LOAD_SCALE(ma)				(((uint32_t) (ma) << 16) / OUT_PWM_PERIOD)
 // Timer Period that will produce normal PWM frequency 
 // FREQ = CPU_FREQ / 2 * 64 * PER (PER = 255 = 61.27 Hz)
 #define LED_PWM_PERIOD					255
-// Timer Period that will produce a visible flash for Switch LED indicators
-// FREQ = CPU_FREQ / 2 * 64 * PER (PER = 2047 = 7.65 Hz)
-#define LED_FLASH_PERIOD				1500
-// input debounce time in milliseconds (cannot be larger than 255)
-#define DEBOUNCE_TIME					5
 // Watchdog timeout setting
 #define WATCHDOG_TO						WDTO_2S
-// Output defines
-#define HEN_port						PORTD
-#define HEN_bp							PIN3_bp
-#define V1EN_port						PORTD
-#define V1EN_bp							PIN4_bp
-#define V2EN_port						PORTD
-#define V2EN_bp							PIN5_bp
-#define HSWLREN_port					PORTC
-#define HSWLREN_bp						PIN3_bp
-#define HSWLGEN_port					PORTC
-#define HSWLGEN_bp						PIN2_bp
-#define HSWLBEN_port					PORTC
-#define HSWLBEN_bp						PIN1_bp
-#define SWL1EN_port						PORTC
-#define SWL1EN_bp						PIN5_bp
-#define SWL2EN_port						PORTC
-#define SWL2EN_bp						PIN4_bp
-// Input defines
-#define IGN_port						PORTA
-#define IGN_bp							PIN3_bp
-#define REV_port						PORTA
-#define REV_bp							PIN2_bp
-#define HB_port							PORTA
-#define HB_bp							PIN4_bp
-#define HSW_port						PORTA
-#define HSW_bp							PIN0_bp
-#define SW2_port						PORTA
-#define SW2_bp							PIN1_bp
-#define SW1_port						PORTC
-#define SW1_bp							PIN6_bp
+// Number of RTC clocks in one tick (RTC.PER = RTC_TICK_COUNTS - 1)
+#define RTC_TICK_COUNTS					34
+// Nominal RTC clock frequency in Hz (Internal 32.768 kHz oscillator)
+#define RTC_CLOCK_HZ					32768
+// Range of a calibrated RTC clock frequency in Hz, a calibration outside it is ignored (tick is at least 1ms)
+#define RTC_CLOCK_MIN_HZ				30000
+#define RTC_CLOCK_MAX_HZ				(RTC_TICK_COUNTS * 1000)
+// Length of one RTC tick in milliseconds (16.16 fixed point) for an RTC clock of hz
+#define RTC_TICK_LEN(hz)				(((uint32_t) RTC_TICK_COUNTS * (1000ul << 16)) / (hz))
+// Maximum length of a stretched tickless RTC period in milliseconds (must be well below WATCHDOG_TO)
+#define TICKLESS_MAX_MS					1000
+// Number of milliseconds between standby self-checks in Power Down State (must be well below WATCHDOG_TO)
+#define STANDBY_CHECK_MS				TICKLESS_MAX_MS
+// Pin and PWM channel tables
+//  Init, power down, the input change interrupts, debouncing and the PWM channel layer are all generated
+//  from these tables, a board revision only needs its rows changed.
+// Inputs of each port: X(name, pin, invert, wake, debounce, gesture)
+//  invert: input is active low (PORT_INVEN), wake: an edge wakes the processor from Power Down State,
+//  debounce: RTC ticks an input must read differently to change state (1-15),
+//  gesture: short, long and double presses are detected (gesture_short, gesture_long and gesture_double).
+//  Inputs are packed into IN_xxx_bm by pin position so PORTA and PORTC inputs must use different pins.
+#define IN_PORTA_TABLE(X) \
+	X(HSW,		0,	1,	1,	4,	1)	/* Horn Switch */ \
+	X(SW2,		1,	1,	1,	4,	1)	/* Switch 2 */ \
+	X(REV,		2,	0,	0,	15,	0)	/* Reverse (harness line) */ \
+	X(IGN,		3,	0,	1,	15,	0)	/* Ignition (harness line) */ \
+	X(HB,		4,	0,	0,	15,	0)	/* High Beam (harness line) */
+#define IN_PORTC_TABLE(X) \
+	X(SW1,		6,	1,	1,	4,	1)	/* Switch 1 */
+// Totem-pole outputs of each port, all low at reset: X(name, pin)
+//  Timer compare outputs are fixed to their pins (OC4x on PC0-PC3, OC5x on PC4-PC5 and PD4-PD5).
+#define OUT_PORTC_TABLE(X) \
+	X(HSWLB,	1)				/* Horn Switch RGB LED blue (OC4B) */ \
+	X(HSWLG,	2)				/* Horn Switch RGB LED green (OC4C) */ \
+	X(HSWLR,	3)				/* Horn Switch RGB LED red (OC4D) */ \
+	X(SWL2,		4)				/* Switch 2 LED (OC5A) */ \
+	X(SWL1,		5)				/* Switch 1 LED (OC5B) */
+#define OUT_PORTD_TABLE(X) \
+	X(HEN,		3)				/* Horn */ \
+	X(V1,		4)				/* Output V1 (OC5A) */ \
+	X(V2,		5)				/* Output V2 (OC5B) */
+// PWM channels of each timer: X(name, timer, type, cc, invert, shift)
+//  invert: compare output polarity is inverted (output is high while the counter is below the compare value)
+//  shift: on-time is centered on the counter top instead of its bottom (compare value is PER - duty cycle)
+#define PWM_TCC5_TABLE(X) \
+	X(SWL1,		TCC5,	TC5,	B,	1,	0)	/* Switch 1 LED */ \
+	X(SWL2,		TCC5,	TC5,	A,	1,	0)	/* Switch 2 LED */
+#define PWM_TCC4_TABLE(X) \
+	X(HSWLR,	TCC4,	TC4,	D,	1,	0)	/* Horn Switch RGB LED red */ \
+	X(HSWLG,	TCC4,	TC4,	C,	1,	0)	/* Horn Switch RGB LED green */ \
+	X(HSWLB,	TCC4,	TC4,	B,	1,	0)	/* Horn Switch RGB LED blue */
+#define PWM_TCD5_TABLE(X) \
+	X(V1,		TCD5,	TC5,	A,	1,	0)	/* Output V1 */ \
+	X(V2,		TCD5,	TC5,	B,	1,	1)	/* Output V2 */
+// All PWM channels in PWM_CH order, LED indicator channels first
+#define PWM_TABLE(X)					PWM_TCC5_TABLE(X) PWM_TCC4_TABLE(X) PWM_TCD5_TABLE(X)
+// Table generators
+#define IN_PIN(name, pin, invert, wake, debounce, gesture)		| (1 << (pin))
+#define IN_INV(name, pin, invert, wake, debounce, gesture)		| ((invert) << (pin))
+#define IN_WAKE(name, pin, invert, wake, debounce, gesture)		| ((wake) << (pin))
+#define IN_GESTURE(name, pin, invert, wake, debounce, gesture)	| ((gesture) << (pin))
+#define IN_GESTURE_N(name, pin, invert, wake, debounce, gesture)	+ (gesture)
+#define IN_DEB0(name, pin, invert, wake, debounce, gesture)		| (((debounce) & 1) << (pin))
+#define IN_DEB1(name, pin, invert, wake, debounce, gesture)		| ((((debounce) >> 1) & 1) << (pin))
+#define IN_DEB2(name, pin, invert, wake, debounce, gesture)		| ((((debounce) >> 2) & 1) << (pin))
+#define IN_DEB3(name, pin, invert, wake, debounce, gesture)		| ((((debounce) >> 3) & 1) << (pin))
+#define IN_DEB_BAD(name, pin, invert, wake, debounce, gesture)	|| ((debounce) < 1) || ((debounce) > 15)
+#define IN_BM(name, pin, invert, wake, debounce, gesture)		IN_##name##_bm = (1 << (pin)),
+#define IN_DEB(name, pin, invert, wake, debounce, gesture)		IN_##name##_DEB = (debounce),
+#define OUT_PIN(name, pin)				| (1 << (pin))
+#define OUT_BM(name, pin)				OUT_##name##_bm = (1 << (pin)),
+#define PWM_CH_ID(name, timer, type, cc, invert, shift)	CH_##name,
+#define PWM_BUF(name, timer, type, cc, invert, shift)	&timer.CC##cc##BUF,
+#define PWM_POL(name, timer, type, cc, invert, shift)	| (((invert) ^ (shift)) << type##_POL##cc##_bp)
+#define PWM_MODE(name, timer, type, cc, invert, shift)	| TC_CC##cc##MODE_COMP_gc
+#define PWM_BV(name, timer, type, cc, invert, shift)	| type##_CC##cc##BV_bm
+#define PWM_STATIC(name, timer, type, cc, invert, shift)	&& hal_cc_static(timer.CC##cc, timer.PER)
+#define PWM_SHIFT(name, timer, type, cc, invert, shift)	if ((shift) && (ch == CH_##name)) { duty = timer.PER - duty; }
+#define PWM_OFF(name, timer, type, cc, invert, shift)	if (shift) { timer.CC##cc = timer.PER; }
+// Pin masks of each port
+#define IN_PORTA_gm						(0 IN_PORTA_TABLE(IN_PIN))
+#define IN_PORTC_gm						(0 IN_PORTC_TABLE(IN_PIN))
+#define IN_PORTA_INV_gm					(0 IN_PORTA_TABLE(IN_INV))
+#define IN_PORTC_INV_gm					(0 IN_PORTC_TABLE(IN_INV))
+#define IN_PORTA_WAKE_gm				(0 IN_PORTA_TABLE(IN_WAKE))
+#define IN_PORTC_WAKE_gm				(0 IN_PORTC_TABLE(IN_WAKE))
+// Packed input masks (IN_xxx_bm) of inputs with gestures and of each debounce tick count bit
+#define IN_GESTURE_gm					(0 IN_PORTA_TABLE(IN_GESTURE) IN_PORTC_TABLE(IN_GESTURE))
+#define IN_GESTURE_COUNT				(0 IN_PORTA_TABLE(IN_GESTURE_N) IN_PORTC_TABLE(IN_GESTURE_N))
+#define IN_DEB0_gm						(0 IN_PORTA_TABLE(IN_DEB0) IN_PORTC_TABLE(IN_DEB0))
+#define IN_DEB1_gm						(0 IN_PORTA_TABLE(IN_DEB1) IN_PORTC_TABLE(IN_DEB1))
+#define IN_DEB2_gm						(0 IN_PORTA_TABLE(IN_DEB2) IN_PORTC_TABLE(IN_DEB2))
+#define IN_DEB3_gm						(0 IN_PORTA_TABLE(IN_DEB3) IN_PORTC_TABLE(IN_DEB3))
+#define OUT_PORTC_gm					(0 OUT_PORTC_TABLE(OUT_PIN))
+#define OUT_PORTD_gm					(0 OUT_PORTD_TABLE(OUT_PIN))
+#if (IN_PORTA_gm & IN_PORTC_gm)
+#error "PORTA and PORTC inputs must use different bit positions"
+#endif
+#if (IN_PORTC_gm & OUT_PORTC_gm)
+#error "PORTC pins can not be both input and output"
+#endif
+#if (0 IN_PORTA_TABLE(IN_DEB_BAD) IN_PORTC_TABLE(IN_DEB_BAD))
+#error "Input debounce must be 1 to 15 RTC ticks"
+#endif
+// Telemetry port pins, USARTD0 remapped to PD6 (RXD) and PD7 (TXD), the default pins are used by outputs
+#define TELEMETRY_RX_bm					(1 << PIN6_bp)
+#define TELEMETRY_TX_bm					(1 << PIN7_bp)
+#if ((TELEMETRY_RX_bm | TELEMETRY_TX_bm) & OUT_PORTD_gm)
+#error "Telemetry pins can not be used by outputs"
+#endif
+// Number of input events the RTC Overflow interrupt can queue for main (power of 2)
+#define IN_EVENT_QUEUE_SIZE				16
+#define IN_EVENT_QUEUE_MASK				(IN_EVENT_QUEUE_SIZE - 1)
+// Task return value when it only needs to run on input edges or signals
+#define TASK_WAIT						0xFFFFFFFF
+#define TASK_bm(id)						(1 << (id))
+// Output ramp levels are 8.8 fixed point, the integer part is the ramp curve position (0-255)
+#define OUT_RAMP_FULL					0xFF00
+// First ramp level with a non-zero duty cycle, ramps from off start here
+#if OUT_RAMP_GAMMA
+#define OUT_RAMP_START					(15 << 8)
+#else
+#define OUT_RAMP_START					(1 << 8)
+#endif
+// Configuration record version (records with another version are ignored)
+#define CONFIG_VERSION					1
+// Configuration feature flags (config_t flags)
+#define CONFIG_FLAG_CHIRP				(1 << 0)		// Chirp the Horn once when Ignition turns on and twice when it turns off
+// Number of configuration record slots in EEPROM, records rotate through the slots for wear levelling
+#define CONFIG_SLOTS					16
+// Number of event log pages in EEPROM (one EEPROM page each), the log is a ring of pages
+#define LOG_PAGES						6
+// Number of events in one event log page
+#define LOG_PAGE_ENTRIES				7
+// Number of milliseconds events are collected before the event log page is written
+#define LOG_BATCH_MS					2000
+// Minimum number of milliseconds between writes of a partly filled event log page (EEPROM endurance)
+#define LOG_WRITE_MS					10000
+// Number of usage statistics record slots in EEPROM (one EEPROM page each), records alternate between the slots
+#define STATS_SLOTS						2
 
 /*
  * Constants
  */
 
+#if SINE_TABLES
+// Full period of get_sine(), generated from quarter_sine[] below
+const uint8_t PROGMEM full_sine[256] = {128, 131, 134, 137, 140, 143, 146, 149, 152, 155, 158, 162, 165, 167, 170, 173,
+										176, 179, 182, 185, 188, 190, 193, 196, 198, 201, 203, 206, 208, 211, 213, 215,
+										218, 220, 222, 224, 226, 228, 230, 232, 234, 235, 237, 238, 240, 241, 243, 244,
+										245, 246, 248, 249, 250, 250, 251, 252, 253, 253, 254, 254, 254, 255, 255, 255,
+										255, 255, 255, 254, 254, 254, 253, 253, 252, 251, 250, 250, 249, 248, 246, 245,
+										244, 243, 241, 240, 238, 237, 235, 234, 232, 230, 228, 226, 224, 222, 220, 218,
+										215, 213, 211, 208, 206, 203, 201, 198, 196, 193, 190, 188, 185, 182, 179, 176,
+										173, 170, 167, 165, 162, 158, 155, 152, 149, 146, 143, 140, 137, 134, 131, 128,
+										127, 124, 121, 118, 115, 112, 109, 106, 103, 100,  97,  93,  90,  88,  85,  82,
+										 79,  76,  73,  70,  67,  65,  62,  59,  57,  54,  52,  49,  47,  44,  42,  40,
+										 37,  35,  33,  31,  29,  27,  25,  23,  21,  20,  18,  17,  15,  14,  12,  11,
+										 10,   9,   7,   6,   5,   5,   4,   3,   2,   2,   1,   1,   1,   0,   0,   0,
+										  0,   0,   0,   1,   1,   1,   2,   2,   3,   4,   5,   5,   6,   7,   9,  10,
+										 11,  12,  14,  15,  17,  18,  20,  21,  23,  25,  27,  29,  31,  33,  35,  37,
+										 40,  42,  44,  47,  49,  52,  54,  57,  59,  62,  65,  67,  70,  73,  76,  79,
+										 82,  85,  88,  90,  93,  97, 100, 103, 106, 109, 112, 115, 118, 121, 124, 127};
+// Horn Switch RGB LED intensities {red, green, blue} for each hswl_rgb() angle, generated from get_sine_peak()
+const uint8_t PROGMEM hue_rgb[256][3] = {
+											{254,   0,   0}, {254,   0,   0}, {254,   6,   0}, {254,  12,   0},
+											{252,  18,   0}, {252,  18,   0}, {252,  24,   0}, {252,  30,   0},
+											{250,  36,   0}, {250,  36,   0}, {250,  42,   0}, {248,  48,   0},
+											{246,  54,   0}, {246,  54,   0}, {244,  60,   0}, {244,  68,   0},
+											{242,  74,   0}, {242,  74,   0}, {240,  78,   0}, {236,  84,   0},
+											{234,  90,   0}, {234,  90,   0}, {232,  96,   0}, {230, 102,   0},
+											{226, 108,   0}, {226, 108,   0}, {224, 114,   0}, {220, 120,   0},
+											{218, 124,   0}, {218, 124,   0}, {214, 130,   0}, {212, 136,   0},
+											{208, 140,   0}, {208, 140,   0}, {204, 146,   0}, {200, 150,   0},
+											{196, 156,   0}, {196, 156,   0}, {192, 160,   0}, {188, 166,   0},
+											{184, 170,   0}, {184, 170,   0}, {180, 174,   0}, {174, 180,   0},
+											{170, 184,   0}, {170, 184,   0}, {166, 188,   0}, {160, 192,   0},
+											{156, 196,   0}, {156, 196,   0}, {150, 200,   0}, {146, 204,   0},
+											{140, 208,   0}, {140, 208,   0}, {136, 212,   0}, {130, 214,   0},
+											{124, 218,   0}, {124, 218,   0}, {120, 220,   0}, {114, 224,   0},
+											{108, 226,   0}, {108, 226,   0}, {102, 230,   0}, { 96, 232,   0},
+											{ 90, 234,   0}, { 90, 234,   0}, { 84, 236,   0}, { 78, 240,   0},
+											{ 74, 242,   0}, { 74, 242,   0}, { 68, 244,   0}, { 60, 244,   0},
+											{ 54, 246,   0}, { 54, 246,   0}, { 48, 248,   0}, { 42, 250,   0},
+											{ 36, 250,   0}, { 36, 250,   0}, { 30, 252,   0}, { 24, 252,   0},
+											{ 18, 252,   0}, { 18, 252,   0}, { 12, 254,   0}, {  6, 254,   0},
+											{  0, 254,   0}, {  0, 254,   0}, {  0, 254,   0}, {  0, 254,   6},
+											{  0, 254,  12}, {  0, 254,  12}, {  0, 252,  18}, {  0, 252,  24},
+											{  0, 252,  30}, {  0, 252,  30}, {  0, 250,  36}, {  0, 250,  42},
+											{  0, 248,  48}, {  0, 248,  48}, {  0, 246,  54}, {  0, 244,  60},
+											{  0, 244,  68}, {  0, 244,  68}, {  0, 242,  74}, {  0, 240,  78},
+											{  0, 236,  84}, {  0, 236,  84}, {  0, 234,  90}, {  0, 232,  96},
+											{  0, 230, 102}, {  0, 230, 102}, {  0, 226, 108}, {  0, 224, 114},
+											{  0, 220, 120}, {  0, 220, 120}, {  0, 218, 124}, {  0, 214, 130},
+											{  0, 212, 136}, {  0, 212, 136}, {  0, 208, 140}, {  0, 204, 146},
+											{  0, 200, 150}, {  0, 200, 150}, {  0, 196, 156}, {  0, 192, 160},
+											{  0, 188, 166}, {  0, 188, 166}, {  0, 184, 170}, {  0, 180, 174},
+											{  0, 174, 180}, {  0, 174, 180}, {  0, 170, 184}, {  0, 166, 188},
+											{  0, 160, 192}, {  0, 160, 192}, {  0, 156, 196}, {  0, 150, 200},
+											{  0, 146, 204}, {  0, 146, 204}, {  0, 140, 208}, {  0, 136, 212},
+											{  0, 130, 214}, {  0, 130, 214}, {  0, 124, 218}, {  0, 120, 220},
+											{  0, 114, 224}, {  0, 114, 224}, {  0, 108, 226}, {  0, 102, 230},
+											{  0,  96, 232}, {  0,  96, 232}, {  0,  90, 234}, {  0,  84, 236},
+											{  0,  78, 240}, {  0,  78, 240}, {  0,  74, 242}, {  0,  68, 244},
+											{  0,  60, 244}, {  0,  60, 244}, {  0,  54, 246}, {  0,  48, 248},
+											{  0,  42, 250}, {  0,  42, 250}, {  0,  36, 250}, {  0,  30, 252},
+											{  0,  24, 252}, {  0,  24, 252}, {  0,  18, 252}, {  0,  12, 254},
+											{  0,   6, 254}, {  0,   6, 254}, {  0,   0, 254}, {  0,   0, 254},
+											{  6,   0, 254}, {  6,   0, 254}, { 12,   0, 254}, { 18,   0, 252},
+											{ 24,   0, 252}, { 24,   0, 252}, { 30,   0, 252}, { 36,   0, 250},
+											{ 42,   0, 250}, { 42,   0, 250}, { 48,   0, 248}, { 54,   0, 246},
+											{ 60,   0, 244}, { 60,   0, 244}, { 68,   0, 244}, { 74,   0, 242},
+											{ 78,   0, 240}, { 78,   0, 240}, { 84,   0, 236}, { 90,   0, 234},
+											{ 96,   0, 232}, { 96,   0, 232}, {102,   0, 230}, {108,   0, 226},
+											{114,   0, 224}, {114,   0, 224}, {120,   0, 220}, {124,   0, 218},
+											{130,   0, 214}, {130,   0, 214}, {136,   0, 212}, {140,   0, 208},
+											{146,   0, 204}, {146,   0, 204}, {150,   0, 200}, {156,   0, 196},
+											{160,   0, 192}, {160,   0, 192}, {166,   0, 188}, {170,   0, 184},
+											{174,   0, 180}, {174,   0, 180}, {180,   0, 174}, {184,   0, 170},
+											{188,   0, 166}, {188,   0, 166}, {192,   0, 160}, {196,   0, 156},
+											{200,   0, 150}, {200,   0, 150}, {204,   0, 146}, {208,   0, 140},
+											{212,   0, 136}, {212,   0, 136}, {214,   0, 130}, {218,   0, 124},
+											{220,   0, 120}, {220,   0, 120}, {224,   0, 114}, {226,   0, 108},
+											{230,   0, 102}, {230,   0, 102}, {232,   0,  96}, {234,   0,  90},
+											{236,   0,  84}, {236,   0,  84}, {240,   0,  78}, {242,   0,  74},
+											{244,   0,  68}, {244,   0,  68}, {244,   0,  60}, {246,   0,  54},
+											{248,   0,  48}, {248,   0,  48}, {250,   0,  42}, {250,   0,  36},
+											{252,   0,  30}, {252,   0,  30}, {252,   0,  24}, {252,   0,  18},
+											{254,   0,  12}, {254,   0,  12}, {254,   0,   6}, {254,   0,   0}};
+#else
 const uint8_t PROGMEM quarter_sine[64] = {128, 131, 134, 137, 140, 143, 146, 149, 
 										  152, 155, 158, 162, 165, 167, 170, 173,
 										  176, 179, 182, 185, 188, 190, 193, 196,
@@ -156,61 +559,496 @@ const uint8_t PROGMEM quarter_sine[64] = {128, 131, 134, 137, 140, 143, 146, 149
 										  234, 235, 237, 238, 240, 241, 243, 244,
 										  245, 246, 248, 249, 250, 250, 251, 252,
 										  253, 253, 254, 254, 254, 255, 255, 255};
+#endif
+#if OUT_RAMP_GAMMA
+// Output ramp gamma curve (2.2) from ramp position to duty cycle
+const uint8_t PROGMEM out_gamma[256] = {  0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+										  1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+										  3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+										  6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+										 12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+										 20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+										 30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+										 42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+										 56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+										 73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+										 91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+										113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+										137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+										163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+										192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+										223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255};
+#endif
+
+// Horn patterns: pairs of on and off milliseconds ending with HORN_END (stop) or HORN_REPEAT (play again)
+#define HORN_END						0, 0
+#define HORN_REPEAT						0, 1
+const uint16_t PROGMEM horn_chirp[] = { 60, 0, HORN_END };
+const uint16_t PROGMEM horn_double_chirp[] = { 60, 120, 60, 0, HORN_END };
+const uint16_t PROGMEM horn_panic[] = { 200, 200, 200, 200, 200, 600,			// S
+										600, 200, 600, 200, 600, 600,			// O
+										200, 200, 200, 200, 200, 1400,			// S
+										HORN_REPEAT };
+// Horn patterns in HORN_PATTERN order
+const uint16_t *const PROGMEM horn_patterns[] = { NULL, horn_chirp, horn_double_chirp, horn_panic };
+
 /*
  * Enumerations
  */
 enum POWER_SM  { SM_POWER_RESET = 0, SM_POWER_DOWN, SM_POWER_ON_IGN, SM_POWER_ON_SW };
-enum PROG_SM   { SM_PROG_RESET = 0, SM_PROG_ACTIVATE, SM_PROG_WAIT, SM_PROG_ON_WAIT, SM_PROG_OFF_WAIT, SM_PROG_DISPLAY_DWELL, SM_PROG_DISPLAY};
+enum PROG_SM   { SM_PROG_RESET = 0, SM_PROG_ACTIVATE, SM_PROG_WAIT, SM_PROG_ON_WAIT, SM_PROG_OFF_WAIT, SM_PROG_DISPLAY_DWELL, SM_PROG_DISPLAY,
+				 SM_PROG_DIM_WAIT, SM_PROG_DIM_ON_WAIT, SM_PROG_DIM_OFF_WAIT };
 enum LED_STATE { LED_OFF = 0, LED_ON, LED_BREATHE, LED_FLASH };
 enum SW_TOGGLE { TOGGLE_OFF = 0, TOGGLE_ON, TOGGLE_ON_USER };
 enum SW_LED    { SW1_LED = 1, SW2_LED = 2, SW12_LED = 3 };
+enum HORN      { HORN_OFF = 0, HORN_STARTING, HORN_ON };
+enum HORN_PATTERN { HORN_PATTERN_NONE = 0, HORN_PATTERN_CHIRP, HORN_PATTERN_DOUBLE_CHIRP, HORN_PATTERN_PANIC };
+enum BATTERY   { BATT_OK = 0, BATT_DIM, BATT_SHED };
+enum LOG_EVENT { LOG_RESET = 1, LOG_POWER, LOG_DELAY, LOG_BATTERY, LOG_HORN, LOG_FOLDBACK, LOG_STANDBY_FAULT };
+enum TASK_ID   { TASK_POWER = 0, TASK_GESTURE, TASK_HORN, TASK_PROG, TASK_OUTPUT, TASK_ANIMATE, TASK_TELEMETRY,
+				 TASK_COUNT = TASK_TELEMETRY + TELEMETRY };		// Telemetry Task only with TELEMETRY
+enum PWM_CH    { PWM_TABLE(PWM_CH_ID) CH_COUNT };
+enum IN_BITS   { IN_PORTA_TABLE(IN_BM) IN_PORTC_TABLE(IN_BM) };
+enum IN_TICKS  { IN_PORTA_TABLE(IN_DEB) IN_PORTC_TABLE(IN_DEB) };
+enum OUT_BITS  { OUT_PORTC_TABLE(OUT_BM) OUT_PORTD_TABLE(OUT_BM) };
+#define CH_LED_COUNT					CH_V1			// LED indicator channels come first
+#define CH_bm(ch)						(1 << (ch))
+
+/*
+ * Structures
+ */
+typedef struct
+{
+	uint16_t level;										// Current ramp level (8.8 fixed point)
+	uint16_t target;									// Ramp target level (8.8 fixed point)
+	uint16_t hold;										// RTC ticks before the ramp starts (staggered turn on)
+	uint8_t  fast;										// RTC ticks until an early switch press is confirmed or rolled back
+} out_ramp_t;
+
+// Configuration record (16 bytes so a record never crosses an EEPROM page)
+typedef struct
+{
+	uint8_t  version;									// CONFIG_VERSION
+	uint8_t  sequence;									// Incremented on every write, the newest valid record is used
+	uint32_t delay_time_ms;								// Number of milliseconds to stay on when ignition is off
+	uint16_t ramp_time_ms;								// Number of milliseconds for V1 and V2 to ramp from off to full on
+	uint8_t  v1_level;									// Output V1 brightness (ramp curve position 0-255)
+	uint8_t  v2_level;									// Output V2 brightness (ramp curve position 0-255)
+	uint8_t  flags;										// Feature flags (CONFIG_FLAG_xxx)
+	uint16_t rtc_clock_hz;								// RTC clock frequency measured in production (0 = RTC_CLOCK_HZ)
+	uint8_t  reserved[1];								// Written as 0
+	uint16_t crc;										// CRC16 CCITT of all fields above
+} config_t;
+
+// Event log entry
+typedef struct
+{
+	uint16_t time;										// Uptime in 1.024 second units (uptime_ms >> 10)
+	uint8_t  event;										// LOG_EVENT
+	uint8_t  data;										// Event data
+} log_entry_t;
+
+// Event log page (32 bytes, one EEPROM page)
+typedef struct
+{
+	uint8_t  sequence;									// Incremented for every new page, the newest valid page is the head
+	uint8_t  count;										// Number of entries used
+	log_entry_t entry[LOG_PAGE_ENTRIES];				// Events, oldest first
+	uint16_t crc;										// CRC16 CCITT of all fields above
+} log_page_t;
+
+// Usage statistics record (32 bytes, one EEPROM page)
+typedef struct
+{
+	uint8_t  sequence;									// Incremented on every write, the newest valid record is used
+	uint8_t  reserved[9];								// Written as 0
+	uint32_t v1_on_s;									// Output V1 on-time weighted by duty cycle in seconds
+	uint32_t v2_on_s;									// Output V2 on-time weighted by duty cycle in seconds
+	uint32_t horn_on_s;									// Horn on-time in seconds
+	uint32_t horn_count;								// Horn Switch presses and Horn patterns played
+	uint32_t wakes;										// Input change wake-ups from Power Down State
+	uint16_t crc;										// CRC16 CCITT of all fields above
+} stats_t;
+
+// Duty cycle weighted on-time counter
+typedef struct
+{
+	uint16_t frac;										// Duty cycle sum not yet a full on tick (OUT_PWM_PERIOD = 1 tick)
+	uint32_t ticks;										// RTC ticks at full duty cycle not yet in stats_t (saturating)
+} stats_on_t;
+
+// Telemetry frame (TELEMETRY)
+typedef struct
+{
+	uint8_t  sync;										// TELEMETRY_SYNC
+	uint8_t  length;									// Frame length in bytes
+	uint32_t uptime;									// Milliseconds since reset
+	uint8_t  inputs;									// Debounced inputs (IN_xxx_bm)
+	uint8_t  toggles;									// SW1 toggle (high nibble) and SW2 toggle (SW_TOGGLE)
+	uint8_t  power_state;								// POWER_SM
+	uint8_t  prog_state;								// PROG_SM
+	uint8_t  batt_state;								// BATTERY
+	uint8_t  horn_state;								// HORN
+	uint16_t duty[CH_COUNT];							// Duty cycle of each PWM channel (PWM_CH order)
+	uint16_t standby_wakes;								// Input change wake-ups from Power Down State
+	uint16_t standby_faults;							// Standby self-checks that found the configuration corrupted
+	uint32_t v1_on_s;									// Usage statistics as of the last power down (stats_t)
+	uint32_t v2_on_s;
+	uint32_t horn_on_s;
+	uint32_t horn_count;
+	uint32_t wakes;
+	uint16_t isr_rtc_max;								// Longest RTC Overflow interrupt in cycles (ISR_PROFILE, else 0)
+	uint16_t isr_port_max;								// Longest input change interrupt in cycles (ISR_PROFILE, else 0)
+	uint16_t isr_tick_overruns;							// RTC ticks pending when the tick finished (ISR_PROFILE, else 0)
+	uint16_t stack_max;									// Deepest stack in bytes (ISR_PROFILE, else 0)
+	uint8_t  over_budget;								// Footprint budgets exceeded (BUDGET_xxx_bm, ISR_PROFILE, else 0)
+	uint16_t crc;										// CRC16 CCITT of all fields above
+} telemetry_t;
+
+// Uptime in milliseconds when a deadline expires
+typedef uint32_t deadline_t;
+
+// Debounced input change event
+typedef struct
+{
+	uint16_t time;										// Uptime when the change was debounced (low 16 bits of milliseconds)
+	uint8_t  changed;									// Inputs that changed state (IN_xxx_bm)
+	uint8_t  state;										// Debounced state of all inputs after the change (IN_xxx_bm)
+} in_event_t;
+
+// LED indicator channel effect
+typedef struct
+{
+	uint8_t  effect;									// LED_OFF, LED_ON, LED_BREATHE or LED_FLASH
+	uint8_t  level;										// Duty cycle when on (0-255)
+	uint8_t  phase;										// Sine angle when breathing, step when flashing
+} led_fx_t;
+
+// Desired Outputs and Switch LED Indicators
+typedef struct
+{
+	uint8_t  led[2];									// Switch 1 and 2 LED effects (LED_STATE)
+	uint16_t target[2];									// Output V1 and V2 ramp targets
+} out_state_t;
+
+// Press timing of an input with gestures
+typedef struct
+{
+	uint16_t pressed;									// Uptime of the last press (low 16 bits of milliseconds)
+	uint16_t released;									// Uptime of the last short press release
+} gesture_t;
+
+// Scheduler task
+typedef struct
+{
+	uint32_t (*run)(void);								// Returns milliseconds until it needs to run again or TASK_WAIT
+	uint8_t  edges;										// Input edges that make the task ready (IN_xxx_bm)
+} task_t;
 
 /* 
  * EEPROM variables
  */
-uint32_t EEMEM eeprom_delay_time_ms = DEFAULT_DELAY_TIME_MINUTES * 60ul * 1000ul;
+config_t EEMEM eeprom_config[CONFIG_SLOTS] __attribute__((aligned(16)));	// Configuration record slots
+log_page_t EEMEM eeprom_log[LOG_PAGES] __attribute__((aligned(32)));		// Event log pages
+stats_t EEMEM eeprom_stats[STATS_SLOTS] __attribute__((aligned(32)));		// Usage statistics record slots
 
 /*
  * Global variables (Note best code optimization (code size) requires all defaults to be 0)
  */
-volatile uint8_t  tick_ms = 0;							// Free-running milliseconds tick counter (255 milliseconds max)
-volatile uint32_t delay_ms = 0;							// Delay milliseconds counter
-volatile uint32_t prog_ms = 0;							// Program milliseconds counter
-volatile uint16_t led_ms = 0;							// LED milliseconds counter
-
-volatile uint8_t  ign_db = FALSE;						// Ignition currently debouncing
-volatile uint8_t  ign_dbtime = 0;						// Ignition debounce start time
-volatile uint8_t  ign_cur = OFF;						// Current Ignition state
-volatile uint8_t  ign_last = ON;						// Last Ignition state
-
-volatile uint8_t  rev_db = FALSE;						// Reverse currently debouncing
-volatile uint8_t  rev_dbtime = 0;						// Reverse debounce start time
-volatile uint8_t  rev_cur = OFF;						// Current Reverse state
-volatile uint8_t  rev_last = ON;						// Last Reverse state
-
-volatile uint8_t  hb_db = FALSE;						// High beam currently debouncing
-volatile uint8_t  hb_dbtime = 0;						// High beam debounce start time
-volatile uint8_t  hb_cur = OFF;							// Current High beam state
-volatile uint8_t  hb_last = ON;							// Last High beam state
-
-volatile uint8_t  hsw_db = FALSE;						// Horn Switch currently debouncing
-volatile uint8_t  hsw_dbtime = 0;						// Horn Switch debounce start time
-volatile uint8_t  hsw_cur = OFF;						// Current Horn Switch state
-volatile uint8_t  hsw_last = ON;						// Last Horn Switch state
-
-volatile uint8_t  sw1_db = FALSE;						// Switch 1 currently debouncing
-volatile uint8_t  sw1_dbtime = 0;						// Switch 1 debounce start time
-volatile uint8_t  sw1_cur = OFF;						// Current Switch 1 state
-volatile uint8_t  sw1_toggle = TOGGLE_OFF;				// Switch 1 toggle state
-volatile uint8_t  sw1_led_intensity = 0;				// Current Switch 1 LED intensity (0-255)
-volatile uint8_t  sw1_led_state = LED_OFF;				// Current Switch 1 LED state
-
-volatile uint8_t  sw2_db = FALSE;						// Switch 2 currently debouncing
-volatile uint8_t  sw2_dbtime = 0;						// Switch 2 debounce start time
-volatile uint8_t  sw2_cur = OFF;						// Current Switch 2 state
-volatile uint8_t  sw2_toggle = TOGGLE_OFF;				// Switch 2 toggle state
-volatile uint8_t  sw2_led_intensity = 0;				// Current Switch 2 LED intensity (0-255)
-volatile uint8_t  sw2_led_state = LED_OFF;				// Current Switch 2 LED state
+volatile uint32_t uptime_ms = 0;						// Milliseconds since reset
+volatile uint16_t tick_step = 1;						// RTC ticks in the current RTC period (1 unless tickless)
+uint32_t tick_len = RTC_TICK_LEN(RTC_CLOCK_HZ);			// Length of one RTC tick in milliseconds (16.16 fixed point)
+uint16_t tick_frac = 0;									// Fraction of a millisecond not counted in uptime_ms yet (1/65536)
+
+volatile uint8_t  in_state = 0;							// Debounced state of all inputs (IN_xxx_bm)
+volatile in_event_t in_events[IN_EVENT_QUEUE_SIZE];	// Input events queued by RTC Overflow interrupt for main
+volatile uint8_t  in_event_head = 0;					// Next event written (only written by RTC Overflow interrupt)
+volatile uint8_t  in_event_tail = 0;					// Next event read (only written by main)
+volatile uint8_t  in_cnt0 = 0;							// Debounce vertical counter bit 0 (one bit per input)
+volatile uint8_t  in_cnt1 = 0;							// Debounce vertical counter bit 1 (one bit per input)
+volatile uint8_t  in_cnt2 = 0;							// Debounce vertical counter bit 2 (one bit per input)
+volatile uint8_t  in_cnt3 = 0;							// Debounce vertical counter bit 3 (one bit per input)
+volatile uint8_t  in_woken = FALSE;						// An input change interrupt fired since the processor went to standby
+volatile uint8_t  in_edge = FALSE;						// An input change interrupt fired since the last RTC input sample
+
+gesture_t gesture[IN_GESTURE_COUNT];					// Press timing of each input with gestures (pin order)
+uint8_t  gesture_held = 0;								// Pressed and not reported as a long press yet (IN_xxx_bm)
+uint8_t  gesture_tap = 0;								// Last release was a short press (IN_xxx_bm)
+uint8_t  gesture_short = 0;								// Short presses released this scheduler pass (IN_xxx_bm)
+uint8_t  gesture_long = 0;								// Long presses detected this scheduler pass (IN_xxx_bm)
+uint8_t  gesture_double = 0;							// Double presses released this scheduler pass (IN_xxx_bm)
+
+uint8_t  sw1_toggle = TOGGLE_OFF;						// Switch 1 toggle state
+uint8_t  sw2_toggle = TOGGLE_OFF;						// Switch 2 toggle state
+
+led_fx_t led_fx[CH_LED_COUNT];							// LED indicator channel effects
+volatile uint16_t pwm_duty[CH_COUNT];					// Duty cycle of each PWM channel
+volatile uint8_t  pwm_dirty = 0;						// Channels to commit on the next tick (CH_bm)
+volatile uint16_t led_gain = LED_GAIN_FULL;				// LED indicator brightness gain applied by pwm_commit
+
+volatile out_ramp_t v1_ramp;							// Output V1 soft start and stop ramp
+volatile out_ramp_t v2_ramp;							// Output V2 soft start and stop ramp
+deadline_t out_stagger_deadline;						// Next output turning on from off waits until then
+volatile uint8_t  out_ramping = FALSE;					// An output ramp has not reached its target
+uint16_t out_ramp_inc = OUT_RAMP_FULL;					// Output ramp level change per RTC tick
+volatile uint8_t  out_fast = 0;							// Switches whose press turns their output on at once (IN_xxx_bm)
+volatile uint8_t  out_fast_pending = 0;					// Switch presses that turned outputs on before debouncing
+volatile uint16_t v1_duty_max = OUT_PWM_PERIOD;			// Output V1 duty cycle limit from current foldback
+volatile uint16_t v2_duty_max = OUT_PWM_PERIOD;			// Output V2 duty cycle limit from current foldback
+uint16_t v1_duty_lim = OUT_PWM_PERIOD;					// Output V1 duty cycle limit applied (soft start to v1_duty_max)
+uint16_t v2_duty_lim = OUT_PWM_PERIOD;					// Output V2 duty cycle limit applied (soft start to v2_duty_max)
+uint16_t out_duty_inc = OUT_PWM_PERIOD;					// Output duty cycle limit rise per RTC tick
+uint16_t out_budget_ma = CURRENT_BUDGET_MA;				// Current available to V1 and V2 in mA
+volatile uint16_t v1_current_ma = 0;					// Output V1 modeled load current in mA
+volatile uint16_t v2_current_ma = 0;					// Output V2 modeled load current in mA
+volatile uint16_t v1_current_avg = 0;					// Output V1 modeled load current running average in mA
+volatile uint16_t v2_current_avg = 0;					// Output V2 modeled load current running average in mA
+#if OUT_PWM_FAST_CLOCK
+volatile uint8_t  clock_fast = FALSE;					// System clock is the 32MHz oscillator
+#endif
+#if LED_EDMA
+uint16_t breathe_wave[128];								// Breathing duty cycles streamed by EDMA (one per TCC5 overflow)
+uint8_t  breathe_leds = 0;								// LEDs currently breathing by EDMA (SW1_LED, SW2_LED or SW12_LED)
+#endif
+
+uint8_t  power_state = SM_POWER_RESET;					// Current power state
+uint8_t  prog_state = SM_PROG_RESET;					// Current programming state
+uint8_t  prog_count = 0;								// Program ON time count in number of # minutes
+uint8_t  prog_led = 0;									// Program mode LED on state
+uint8_t  inputs = 0;									// Debounced inputs for this pass of the main loop
+uint8_t  in_last = IN_HB_bm | IN_REV_bm;				// Last High beam and Reverse state
+uint32_t delay_time_ms = 0;								// Number of milliseconds to stay on when ignition is off
+uint8_t  v1_level = 0;									// Output V1 brightness when on (ramp curve position 0-255)
+uint8_t  v2_level = 0;									// Output V2 brightness when on (ramp curve position 0-255)
+deadline_t delay_deadline;								// Outputs turn off when ignition is off
+deadline_t prog_deadline;								// Programming mode timeouts
+deadline_t led_deadline;								// Programming mode LED display timing
+uint8_t  horn_state = HORN_OFF;							// Horn switch on sequence state
+deadline_t horn_deadline;								// Horn turns on once V1 and V2 are folded back
+uint8_t  horn_pattern = HORN_PATTERN_NONE;				// Horn pattern playing (HORN_PATTERN)
+const uint16_t *horn_step;								// Horn pattern step playing (on and off milliseconds in flash)
+deadline_t horn_step_deadline;							// Horn pattern step ends
+uint32_t horn_heat = 0;									// Horn pattern on-time above the duty cycle limit (ms x percent)
+uint32_t horn_heat_time = 0;							// Uptime of the last horn_heat update
+uint8_t  horn_power = SM_POWER_RESET;					// Power state last seen by the Horn Task
+uint16_t standby_faults = 0;							// Standby self-checks that found the configuration corrupted
+uint16_t standby_wakes = 0;								// Input change wake-ups from Power Down State (not self-checks)
+uint8_t  batt_state = BATT_OK;							// Battery protection state with Ignition off
+uint16_t batt_mah = 0;									// Charge drawn by V1 and V2 with Ignition off in mAh
+uint32_t batt_ma_ms = 0;								// Charge drawn in mA milliseconds not yet counted in batt_mah
+uint32_t batt_time = 0;									// Uptime of the last battery meter update
+
+deadline_t task_deadline[TASK_COUNT];					// Next run of each task
+uint8_t  task_waiting = (uint8_t) ~TASK_bm(TASK_POWER);	// Tasks waiting only for edges or signals (TASK_bm)
+														//  only the Power Task runs until it initializes the processor
+uint8_t  task_signals = 0;								// Tasks signalled to run on the next pass (TASK_bm)
+
+config_t config;										// Newest configuration record
+uint8_t  config_slot = 0;								// EEPROM slot of the newest configuration record
+uint8_t  config_dirty = FALSE;							// Configuration record needs to be written
+volatile uint8_t  eeprom_busy = FALSE;					// EEPROM page write in progress
+
+log_page_t log_page;									// Event log page being filled
+uint8_t  log_slot = 0;									// EEPROM page of log_page
+uint8_t  log_dirty = FALSE;								// Event log page needs to be written
+deadline_t log_deadline;								// Event log page write is due (batching and rate limit)
+uint8_t  log_power = SM_POWER_RESET;					// Last logged power state
+uint8_t  log_batt = BATT_OK;							// Last logged battery protection state
+uint8_t  log_horn = HORN_OFF;							// Last seen horn state
+uint8_t  log_folded = FALSE;							// Last logged current foldback (not from the horn)
+
+stats_t  stats;											// Usage statistics record
+uint8_t  stats_slot = 0;								// EEPROM slot of the newest usage statistics record
+uint8_t  stats_dirty = FALSE;							// Usage statistics record needs to be written
+volatile stats_on_t stats_v1_on;						// V1 on-time counted by the RTC Overflow interrupt
+volatile stats_on_t stats_v2_on;						// V2 on-time counted by the RTC Overflow interrupt
+volatile uint32_t stats_horn_ticks = 0;					// Horn on RTC ticks not yet in stats (saturating)
+
+#if TELEMETRY
+telemetry_t telemetry_frame;							// Telemetry frame being sent
+volatile uint8_t  telemetry_tx = sizeof(telemetry_t);	// Next frame byte to send (sizeof(telemetry_t) when sent)
+config_t telemetry_rx;									// Configuration record being received
+volatile uint8_t  telemetry_rx_len = 0;					// Bytes received including TELEMETRY_SYNC
+uint8_t  telemetry_on = FALSE;							// USART powered up for a host
+#endif
+
+#if ISR_PROFILE
+/*
+ * ISR cycle count profiling
+ *  XCL is used as a free running 16-bit timer clocked at the CPU clock so counts are CPU cycles.
+ *  Counts include the profiling overhead (about 20 cycles) but not the interrupt entry and exit.
+ */
+typedef struct
+{
+	uint16_t min;										// Minimum cycles
+	uint16_t max;										// Maximum cycles
+	uint16_t count;										// Number of samples in total
+	uint32_t total;										// Total cycles (average = total / count)
+} isr_stat_t;
+
+volatile isr_stat_t isr_stat_rtc;						// RTC Overflow interrupt cycles
+volatile isr_stat_t isr_stat_porta;						// PORTA interrupt cycles
+volatile isr_stat_t isr_stat_portc;						// PORTC interrupt cycles
+volatile uint16_t isr_tick_overruns = 0;				// RTC ticks already pending when RTC Overflow interrupt finished
+isr_stat_t in_event_latency;							// Milliseconds from input debounced to event handled by main
+volatile isr_stat_t out_fast_latency;					// Cycles from switch edge interrupt entry to V1/V2 PWM update
+volatile isr_stat_t isr_tick_period;					// Cycles between 1ms RTC Overflow interrupts while awake
+volatile uint8_t  isr_tick_psave = FALSE;				// Profiling timer stopped in Power Save this tick
+isr_stat_t standby_awake;								// Cycles awake for each standby self-check
+uint16_t standby_wake;									// Profiling timer count when woken from standby
+extern uint8_t _end;									// End of the static variables (linker), the stack is above
+uint8_t  standby_timing = FALSE;						// Awake straight from standby since standby_wake
+
+/*
+ * Return the current profiling timer count
+ *  The XCL timer counts down, high byte is read twice in case the low byte wrapped.
+ */
+static inline uint16_t isr_profile_now(void)
+{
+	uint8_t hi;
+	uint8_t lo;
+	
+	do
+	{
+		hi = XCL.CNTH;
+		lo = XCL.CNTL;
+	} while (hi != XCL.CNTH);
+	return ((uint16_t) hi << 8) | lo;
+}
+
+/*
+ * Add a sample to ISR statistics
+ *  When count is about to overflow count and total are halved which keeps a running average.
+ */
+static inline void isr_profile_record(volatile isr_stat_t *stat, uint16_t cycles)
+{
+	if ((stat->count == 0) || (cycles < stat->min))
+	{
+		stat->min = cycles;
+	}
+	if (cycles > stat->max)
+	{
+		stat->max = cycles;
+	}
+	if (stat->count == 0xFFFF)
+	{
+		stat->count >>= 1;
+		stat->total >>= 1;
+	}
+	stat->count++;
+	stat->total += cycles;
+}
+
+/*
+ * Paint the SRAM between the static variables and the stack before main runs
+ *  Runs from the .init3 section once the stack pointer and r1 are set up.
+ */
+void stack_paint(void) __attribute__((naked, used, section(".init3")));
+void stack_paint(void)
+{
+	for (uint8_t *p = &_end; p < (uint8_t *) SP; p++)
+	{
+		*p = STACK_PAINT;
+	}
+}
+
+/*
+ * Return the deepest the stack has been in bytes
+ *  The lowest SRAM byte that is no longer painted marks the deepest stack.
+ */
+static uint16_t stack_used(void)
+{
+	const uint8_t *p = &_end;
+	
+	while ((p <= (const uint8_t *) RAMEND) && (*p == STACK_PAINT))
+	{
+		p++;
+	}
+	return RAMEND + 1 - (uint16_t) p;
+}
+
+#define ISR_PROFILE_ENTER()				uint16_t isr_profile_start = isr_profile_now()
+#define ISR_PROFILE_EXIT(stat)			isr_profile_record(&stat, isr_profile_start - isr_profile_now())
+#else
+#define ISR_PROFILE_ENTER()
+#define ISR_PROFILE_EXIT(stat)
+#endif
+
+/*
+ * Return the number of milliseconds since reset
+ *  Safe to call with interrupts enabled or disabled.
+ */
+static inline uint32_t uptime(void)
+{
+	uint32_t ms;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ms = uptime_ms;
+	}
+	return ms;
+}
+
+/*
+ * Start a deadline that expires ms milliseconds from now
+ */
+static inline void deadline_start(deadline_t *deadline, uint32_t ms)
+{
+	*deadline = uptime() + ms;
+}
+
+/*
+ * Return TRUE when a deadline has expired
+ *  Uptime wrap around (49 days) is handled as long as deadlines are less than 24 days long.
+ */
+static inline uint8_t deadline_expired(deadline_t deadline)
+{
+	return (int32_t) (uptime() - deadline) >= 0;
+}
+
+/*
+ * Return the number of milliseconds until a deadline expires (0 when expired)
+ */
+static inline uint32_t deadline_remaining(deadline_t deadline)
+{
+	int32_t ms = deadline - uptime();
+	
+	return (ms > 0) ? ms : 0;
+}
+
+/*
+ * Make tasks run on the next scheduler pass
+ *  Used when one task changes something another task acts on.
+ */
+static inline void task_signal(uint8_t tasks)
+{
+	task_signals |= tasks & (TASK_bm(TASK_COUNT) - 1);	// Tasks that are not built are ignored
+}
+
+/*
+ * Return the inputs that are part way through debouncing (IN_xxx_bm)
+ */
+static inline uint8_t in_debouncing(void)
+{
+	return in_cnt0 | in_cnt1 | in_cnt2 | in_cnt3;
+}
+
+/*
+ * Return TRUE when input events are waiting for main
+ */
+static inline uint8_t in_event_pending(void)
+{
+	return in_event_head != in_event_tail;
+}
+
+/*
+ * Return count + n, saturating at the counter maximum
+ */
+static inline uint32_t stats_add(uint32_t count, uint32_t n)
+{
+	count += n;
+	return (count < n) ? UINT32_MAX : count;
+}
 
 /*
  * Return sine wave values offset at 128.
@@ -219,9 +1057,11 @@ volatile uint8_t  sw2_led_state = LED_OFF;				// Current Switch 2 LED state
  */
 uint8_t get_sine(uint8_t angle)
 {
-	volatile uint8_t quad = (angle & 0xC0) >> 6;					// what quadrant of sine wave is this angle
-	volatile uint8_t newang = angle;
-	volatile uint8_t ang = newang & 0x3F;							// force angle into quad angle range 0-63
+#if SINE_TABLES
+	return pgm_read_byte(&full_sine[angle]);			// get the value from the table
+#else
+	uint8_t quad = angle >> 6;							// what quadrant of sine wave is this angle
+	uint8_t ang = angle & 0x3F;							// force angle into quad angle range 0-63
 	
  	if (quad & 0x01)
  	{
@@ -233,6 +1073,7 @@ uint8_t get_sine(uint8_t angle)
  		val = 255 - val;								// invert value (Quadrant 3 and 4)
  	}
 	return val;
+#endif
 }
 
 /*
@@ -243,19 +1084,8 @@ uint8_t get_sine(uint8_t angle)
  */
 uint8_t get_sine_peak(uint8_t angle)
 {
-	volatile uint8_t quad = (angle & 0xC0) >> 6;					// what quadrant of sine wave is this angle
-	volatile uint8_t newang = angle;
-	volatile uint8_t ang = newang & 0x3F;							// force angle into quad angle range 0-63
+	uint8_t val = get_sine(angle);
 	
- 	if (quad & 0x01)
- 	{
- 		ang = 63 - ang;									// angle should be reversed (Quadrant 2 and 4)
- 	}
-	uint8_t val = pgm_read_byte(&quarter_sine[ang]);	// get the value from the table
- 	if (quad & 0x02)
- 	{
- 		val = 255 - val;								// invert value (Quadrant 3 and 4)
- 	}
 	if (val >= 128)
 	{
 		return (val - 128) << 1;
@@ -266,1005 +1096,3031 @@ uint8_t get_sine_peak(uint8_t angle)
 	}
 }
 
-/* 
- * Turn output V1 and V2 off
+/*
+ * Hardware abstraction
+ *  All register access needed by the tasks goes through these functions.
+ *  The tasks themselves only deal with debounced inputs, deadlines and these calls.
  */
-void v12_off(void)
+
+/*
+ * Return the raw state of all inputs (IN_xxx_bm)
+ */
+static inline uint8_t hal_inputs(void)
 {
-	TCD5.CCABUF = 0;									// OC5A set to 0% duty cycle (V1_EN)
-	TCD5.CCBBUF = 0;									// OC5B set to 0% duty cycle (V2_EN)
-	TCD5.CTRLGSET = TC_CMD_UPDATE_gc;					// Force TCD5 timer UPDATE
+	return (PORTA.IN & IN_PORTA_gm)						// PORTA inputs
+		 | (PORTC.IN & IN_PORTC_gm);					// PORTC inputs
 }
 
-/* 
- * Turn output V1 on
+/*
+ * Compare buffer of each PWM channel (PWM_CH order)
  */
-void v1_on(void)
+volatile uint16_t * const hal_pwm_buf[CH_COUNT] =
 {
-	TCD5.CCABUF = OUT_PWM_PERIOD;						// OC5A set to 100% duty cycle (V1_EN)
-}
+	PWM_TABLE(PWM_BUF)									// Compare buffer from the PWM channel tables
+};
 
-/* 
- * Turn output V1 off
+/*
+ * Set a PWM channel duty cycle (0 - LED_PWM_PERIOD for LEDs, 0 - OUT_PWM_PERIOD for outputs)
+ *  The timer applies the buffered duty cycle at the end of its period.
+ *  A phase shifted channel compares against the complement with its polarity flipped, so it is on around
+ *   the counter top.
  */
-void v1_off(void)
+static inline void hal_pwm_duty(uint8_t ch, uint16_t duty)
 {
-	TCD5.CCABUF = 0;									// OC5A set to 0% duty cycle (V1_EN)
+	PWM_TABLE(PWM_SHIFT)								// Phase shifted channels from the PWM channel tables
+	*hal_pwm_buf[ch] = duty;
 }
 
-/* 
- * Turn output V2 on
+/*
+ * Apply output V1 and V2 duty cycles now instead of at the next PWM period
  */
-void v2_on(void)
+static inline void hal_v12_update(void)
 {
-	TCD5.CCBBUF = OUT_PWM_PERIOD;						// OC5B set to 100% duty cycle (V2_EN)
+	TCD5.CTRLGSET = TC_CMD_UPDATE_gc;					// Force TCD5 timer UPDATE
 }
 
-/* 
- * Turn output V2 off
+/*
+ * Set Horn output
  */
-void v2_off(void)
+static inline void hal_horn(uint8_t on)
 {
-	TCD5.CCBBUF = 0;									// OC5B set to 100% duty cycle (V2_EN)
+	if (on)
+	{
+		PORTD.OUTSET = OUT_HEN_bm;						// Turn Horn ON
+	}
+	else
+	{
+		PORTD.OUTCLR = OUT_HEN_bm;						// Turn Horn OFF
+	}
 }
 
-/* 
- * Set Switch 1 and 2 LED Indicators
- *   led indicates which LED (SW1_LED, SW2_LED or SW12_LED)
- *   state indicates the desired state (LED_OFF, LED_ON, LED_BREATH or LED_FLASH)
+#if LED_EDMA
+/*
+ * Build the breathing waveform streamed by EDMA scaled by an LED indicator gain
+ *  Starts at the peak like the software breathing.
  */
-void swl12_set(uint8_t led, uint8_t state)
+void hal_breathe_wave(uint16_t gain)
 {
-	cli();												// Disable global interrupts
-	switch (state)
+	for (uint8_t i = 0; i < 128; i++)
 	{
-	case LED_ON:
-		// Time to turn the Switch LED Indicators full on
-		if ((led & 0x1) && (sw1_led_state != LED_ON))
-		{
-			sw1_led_state = LED_ON;
-			TCC5.CCBBUF = LED_PWM_PERIOD;				// OC5B set to 100% duty cycle
-		}
-		if ((led & 0x2) && (sw2_led_state != LED_ON))
-		{
-			sw2_led_state = LED_ON;
-			TCC5.CCABUF = LED_PWM_PERIOD;				// OC5A set to 100% duty cycle
-		}
-		if (TCC5.PERBUF != LED_PWM_PERIOD)
-		{
-			// The LEDs are set to 100% duty cycle so the outputs are always on
-			TCC5.PERBUF = LED_PWM_PERIOD;
-			TCC5.CTRLGSET = TC_CMD_RESTART_gc;			// Restart TCC5 timer
-		}
-		break;
-	case LED_BREATHE:
-		// Millisecond timer interrupt will handle LED breathing
-		// These if statements only initialize the breathing
-		if ((led & 0x1) && (sw1_led_state != LED_BREATHE))
-		{
-			sw1_led_state = LED_BREATHE;
-			sw1_led_intensity = 0;						// restart LED intensity
-			TCC5.CCBBUF = 0;							// OC5B set to 0% duty cycle
-			
-		}
-		if ((led & 0x2) && (sw2_led_state != LED_BREATHE))
-		{
-			sw2_led_state = LED_BREATHE;
-			sw2_led_intensity = 0;						// restart LED intensity
-			TCC5.CCABUF = 0;							// OC5A set to 0% duty cycle
-		}
-		if (TCC5.PERBUF != LED_PWM_PERIOD)
-		{
-			// This timer period is fast enough to not be visible by the naked eye
-			// Thus the duty cycle produces intensity
-			TCC5.PERBUF = LED_PWM_PERIOD;
-			TCC5.CTRLGSET = TC_CMD_RESTART_gc;			// Restart TCC5 timer
-		}
-		break;
-	case LED_FLASH:
-		if ((led & 0x1) && (sw1_led_state != LED_FLASH))
-		{
-			sw1_led_state = LED_FLASH;
-			TCC5.CCBBUF = LED_FLASH_PERIOD/2;			// OC5B set to 50% duty cycle
-		}
-		if ((led & 0x2) && (sw2_led_state != LED_FLASH))
-		{
-			sw2_led_state = LED_FLASH;
-			TCC5.CCABUF = LED_FLASH_PERIOD/2;			// OC5A set to 50% duty cycle
-		}
-		if (TCC5.PERBUF != LED_FLASH_PERIOD)
-		{
-			// Flash timer period is actually slower than normal
-			// The 50% duty cycle flash is slow enough to be visible
-			TCC5.PERBUF = LED_FLASH_PERIOD;
-			TCC5.CTRLGSET = TC_CMD_RESTART_gc;			// Restart TCC5 timer
-		}
-		break;
-	default:
-		// all other states are assumed to be LED_OFF
-		if ((led & 0x1) && (sw1_led_state != LED_OFF))
-		{
-			sw1_led_state = LED_OFF;
-			TCC5.CCBBUF = 0;							// OC5B set to 0% duty cycle
-		}
-		if ((led & 0x2) && (sw2_led_state != LED_OFF))
-		{
-			sw2_led_state = LED_OFF;
-			TCC5.CCABUF = 0;							// OC5A set to 0% duty cycle
-		}
-		if (TCC5.PERBUF != LED_PWM_PERIOD)
-		{
-			// The LEDs are set to 0% duty cycle so the outputs are always off
-			TCC5.PERBUF = LED_PWM_PERIOD;
-			TCC5.CTRLGSET = TC_CMD_RESTART_gc;			// Restart TCC5 timer
-		}
-		break;
+		breathe_wave[i] = ((uint16_t) get_sine((i << 1) + 64) * gain) >> 8;
 	}
-	sei();												// Enable global interrupts
 }
 
-/* 
- * Set Horn Switch RGB LED Indicators to RGB sine pattern
- *   Running a continuously incrementing angle will cycle 
- *    through all colors.
- *   angle 0 - 255 is like hue.
+/*
+ * Start an EDMA channel streaming the breathing waveform into a Switch LED Indicator duty cycle
+ *  One 16-bit duty cycle is written per TCC5 overflow, the waveform repeats forever.
  */
-void inline hswl_rgb(uint8_t angle)
+static inline void hal_breathe_start(EDMA_CH_t *ch, volatile uint16_t *duty)
 {
-	uint8_t bigangle = (uint16_t) angle * 3 / 4;
+	ch->ADDRCTRL = EDMA_CH_RELOAD_BLOCK_gc				// Source address reloaded at end of waveform
+				 | EDMA_CH_DIR_INC_gc;					// Source address incremented
+	ch->DESTADDRCTRL = EDMA_CH_DESTRELOAD_BURST_gc		// Destination address reloaded after each duty cycle
+					 | EDMA_CH_DESTDIR_INC_gc;			// Destination address incremented (low then high byte)
+	ch->TRIGSRC = EDMA_CH_TRIGSRC_TCC5_OVF_gc;			// Triggered by TCC5 overflow
+	ch->TRFCNT = sizeof(breathe_wave);					// Block is the whole waveform
+	ch->ADDR = (uint16_t) breathe_wave;
+	ch->DESTADDR = (uint16_t) duty;
+	ch->CTRLA = EDMA_CH_ENABLE_bm						// Channel enabled
+			  | EDMA_CH_REPEAT_bm						// Repeat the block forever
+			  | EDMA_CH_SINGLE_bm						// One burst per trigger
+			  | EDMA_CH_BURSTLEN_bm;					// Burst is 2 bytes
+}
 
-	// produce red LED intensity
- 	if (angle < 85)
- 	{
-		TCC4.CCDBUF = get_sine_peak(bigangle + 64);
- 	}
- 	else if (angle >= 170)
- 	{
-		TCC4.CCDBUF = get_sine_peak(bigangle - 128);		
- 	}
- 	else
- 	{
- 		TCC4.CCDBUF = 0;
- 	}
- 	// produce green LED intensity
- 	if (angle <= 170)
- 	{
-		TCC4.CCCBUF = get_sine_peak(bigangle);
- 	}
- 	else
- 	{
- 		TCC4.CCCBUF = 0;
- 	}
-  	// produce blue LED intensity
-  	if (angle < 85)
-  	{
-  		TCC4.CCBBUF = 0;
-  	}
-  	else
-  	{
-  		TCC4.CCBBUF = get_sine_peak(bigangle - 64);
-  	}
-	// Make sure the period is correct
-	if (TCC4.PERBUF != LED_PWM_PERIOD)
+/*
+ * Set the Switch LED Indicators breathing by EDMA
+ *  leds selects the breathing LEDs (SW1_LED, SW2_LED or SW12_LED), 0 stops all breathing.
+ *  Channel 0 feeds Switch 1 LED and channel 2 feeds Switch 2 LED. Both channels restart together from the
+ *   peak of the waveform whenever the selection changes so the LEDs always breathe in phase.
+ */
+static inline void hal_swl_breathe(uint8_t leds)
+{
+	if (leds != breathe_leds)
 	{
-		TCC4.PERBUF = LED_PWM_PERIOD;
+		breathe_leds = leds;
+		EDMA.CH0.CTRLA = 0;								// Stop both channels
+		EDMA.CH2.CTRLA = 0;
+		while ((EDMA.CH0.CTRLA | EDMA.CH2.CTRLA) & EDMA_CH_ENABLE_bm);	// wait for current bursts to finish
+		if (leds & SW1_LED)
+		{
+			hal_breathe_start(&EDMA.CH0, hal_pwm_buf[CH_SWL1]);
+		}
+		if (leds & SW2_LED)
+		{
+			hal_breathe_start(&EDMA.CH2, hal_pwm_buf[CH_SWL2]);
+		}
 	}
 }
+#endif
 
-/* 
- * Set Horn LED RGB Indicators to OFF
+/*
+ * Read bytes from EEPROM
  */
-void inline hswl_off(void)
+static inline void hal_eeprom_read(void *data, uint16_t addr, uint8_t len)
 {
-	TCC4.CCDBUF = 0;									// Red LED off
- 	TCC4.CCCBUF = 0;									// Green LED off
- 	TCC4.CCBBUF = 0;									// Blue LED off
-	TCC4.PERBUF = LED_PWM_PERIOD;						// Set normal PWM period
+	eeprom_read_block(data, (const void *) addr, len);
 }
 
-/* 
- * Turn output Horn on
+/*
+ * Start writing bytes to one EEPROM page without waiting for the write to finish
+ *  The bytes are loaded into the NVM page buffer through the memory mapped EEPROM, only loaded bytes are
+ *   erased and written. The EEPROM Ready interrupt marks the end of the write so interrupts and the
+ *   watchdog keep running while the page is written.
+ *  Returns FALSE when the previous write is still in progress.
  */
-void horn_on(void)
+uint8_t hal_eeprom_write(uint16_t addr, const void *data, uint8_t len)
 {
-	// The other two outputs (V1 and V2) cannot be on at the same time
-	v12_off();											// Turn OFF all other outputs (V1 and V2)
-	swl12_set(SW12_LED, LED_OFF);						// Turn OFF Switch 1 and 2 Indicator LEDs
+	const uint8_t *src = data;
+	volatile uint8_t *dst = (volatile uint8_t *) (MAPPED_EEPROM_START + addr);
 	
-	// Delay a bit before continuing
-	asm("nop"); asm("nop"); asm("nop"); asm("nop"); asm("nop");
-	asm("nop"); asm("nop"); asm("nop"); asm("nop"); asm("nop");
-	asm("nop"); asm("nop"); asm("nop"); asm("nop"); asm("nop");
-	asm("nop"); asm("nop"); asm("nop"); asm("nop"); asm("nop");
-	
-	HEN_port.OUTSET = (1 << HEN_bp);					// Turn Horn ON
-	if (TCC4.CCDBUF != LED_FLASH_PERIOD/2) 
-	{
-		TCC4.CCDBUF = LED_FLASH_PERIOD/2;				// Red LED 50% duty cycle
-	}
-	if (TCC4.CCCBUF != 0) 
-	{
- 		TCC4.CCCBUF = 0;								// Green LED off
-	}
-	if (TCC4.CCBBUF != 0) 
+	if (eeprom_busy || (NVM.STATUS & NVM_NVMBUSY_bm))
 	{
- 		TCC4.CCBBUF = 0;								// Blue LED off
+		return FALSE;
 	}
-	// Make sure the period is correct
-	if (TCC4.PERBUF != LED_FLASH_PERIOD)
+	eeprom_busy = TRUE;
+	NVM.CMD = NVM_CMD_ERASE_EEPROM_BUFFER_gc;			// Throw away anything left in the page buffer
+	CCP = CCP_IOREG_gc;
+	NVM.CTRLA = NVM_CMDEX_bm;
+	while (NVM.STATUS & NVM_NVMBUSY_bm);				// wait for page buffer erase
+	NVM.CMD = NVM_CMD_NO_OPERATION_gc;					// Memory mapped writes load the page buffer
+	while (len--)
 	{
-		TCC4.PERBUF = LED_FLASH_PERIOD;					// Set visible flash period
+		*dst++ = *src++;
 	}
+	NVM.ADDR0 = addr & 0xFF;							// Page address
+	NVM.ADDR1 = addr >> 8;
+	NVM.ADDR2 = 0;
+	NVM.CMD = NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc;		// Erase and write the loaded bytes
+	CCP = CCP_IOREG_gc;
+	NVM.CTRLA = NVM_CMDEX_bm;
+	NVM.INTCTRL = NVM_EELVL_HI_gc;						// EEPROM Ready interrupt when the write is done
+	return TRUE;
 }
 
-/* 
- * Turn output Horn off
+#if TELEMETRY
+/*
+ * Return TRUE when a host is connected to the telemetry port
+ *  An idle UART line is high, the RXD pull-down keeps the pin low without a host.
  */
-void inline horn_off(void)
+static inline uint8_t hal_telemetry_host(void)
 {
-	HEN_port.OUTCLR = (1 << HEN_bp);					// Turn Horn OFF
+	return (PORTD.IN & TELEMETRY_RX_bm) != 0;
 }
 
-int main(void)
+/*
+ * Set the telemetry baud rate for the current system clock
+ */
+static inline void hal_telemetry_baud(void)
 {
-	uint8_t  power_state = SM_POWER_RESET;				// Current power state
-	uint8_t  prog_state = SM_PROG_RESET;				// Current programming state
-	uint8_t  prog_count = 0;							// Program ON time count in number of # minutes
-	uint8_t  prog_led = 0;								// Program mode LED on state
+#if OUT_PWM_FAST_CLOCK
+	USARTD0.BAUDCTRLA = clock_fast ? TELEMETRY_BSEL(32000000) : TELEMETRY_BSEL(2000000);
+#else
+	USARTD0.BAUDCTRLA = TELEMETRY_BSEL(2000000);
+#endif
+	USARTD0.BAUDCTRLB = 0;								// BSCALE is 0
+}
 
-	// Number of minutes to stay on when ignition is off
-	uint32_t  delay_time_ms = eeprom_read_dword(&eeprom_delay_time_ms);
-	
-	// Disable the Watchdog timer on start
-	wdt_disable();
-    // main loop forever
-    while (TRUE) 
-    {
-		// Each loop of main reset the Watchdog timer
-		wdt_reset();
-		
-		// Power State Machine
-		//   Manages initialization and power down of processor
-		switch (power_state)
-		{
-		case SM_POWER_DOWN:								// Powered Down State
-			// See if IGN has switched ON
-			if (ign_cur)
+/*
+ * Power the telemetry USART up or down
+ *  Powered up the USART receives configuration writes and can send frames.
+ */
+void hal_telemetry_power(uint8_t on)
+{
+	if (on)
+	{
+		PR.PRPD &= ~(1 << PR_USART0_bp);				// USART0D power down: disabled
+		PORTD.REMAP |= PORT_USART0_bm;					// USART0D on PD6 (RXD) and PD7 (TXD)
+		PORTD.OUTSET = TELEMETRY_TX_bm;					// TXD idles high
+		PORTD.DIRSET = TELEMETRY_TX_bm;
+		hal_telemetry_baud();
+		USARTD0.CTRLC = USART_CMODE_ASYNCHRONOUS_gc		// Asynchronous
+					  | USART_PMODE_DISABLED_gc			// No parity
+					  | USART_CHSIZE_8BIT_gc;			// 8 data bits, 1 stop bit
+		USARTD0.CTRLB = (1 << USART_RXEN_bp)			// Receiver enabled
+					  | (1 << USART_TXEN_bp)			// Transmitter enabled
+					  | (1 << USART_CLK2X_bp);			// Double speed mode
+		USARTD0.CTRLA = USART_RXCINTLVL_LO_gc;			// Receive Complete Low level interrupt
+	}
+	else
+	{
+		USARTD0.CTRLA = 0;								// Interrupts disabled
+		USARTD0.CTRLB = 0;								// Receiver and transmitter disabled
+		PORTD.DIRCLR = TELEMETRY_TX_bm;					// TXD back to a pulled down input
+		PR.PRPD |= (1 << PR_USART0_bp);					// USART0D power down: enabled
+	}
+}
+
+/*
+ * Start sending the telemetry frame
+ *  The USART Data Register Empty interrupt sends one byte at a time.
+ */
+static inline void hal_telemetry_send(void)
+{
+	telemetry_tx = 0;
+	USARTD0.STATUS = USART_TXCIF_bm;					// Clear Transmit Complete, set again after the last byte
+	USARTD0.CTRLA = USART_RXCINTLVL_LO_gc				// Receive Complete Low level interrupt
+				  | USART_DREINTLVL_LO_gc;				// Data Register Empty Low level interrupt
+}
+
+/*
+ * Return TRUE when the whole telemetry frame has been shifted out
+ */
+static inline uint8_t hal_telemetry_sent(void)
+{
+	return (telemetry_tx == sizeof(telemetry_frame)) && (USARTD0.STATUS & USART_TXCIF_bm);
+}
+#endif
+
+/*
+ * Return TRUE when the telemetry USART is powered up (it needs the peripheral clock, no Power Save)
+ */
+static inline uint8_t hal_telemetry_active(void)
+{
+#if TELEMETRY
+	return telemetry_on;
+#else
+	return FALSE;
+#endif
+}
+
+/*
+ * Set the pin control of the selected pins of a port in one write (Multi-Pin Configuration)
+ *  Nothing is written when no pin is selected, PORTCFG.MPCMASK = 0 would only configure pin 0.
+ */
+static inline void hal_pins_ctrl(PORT_t *port, uint8_t pins, uint8_t ctrl)
+{
+	if (pins)
+	{
+		PORTCFG.MPCMASK = pins;							// Multi-Pin Configuration select pins
+		port->PIN0CTRL = ctrl;
+	}
+}
+
+/*
+ * Return TRUE when a compare value keeps its output fully on or fully off
+ */
+static inline uint8_t hal_cc_static(uint16_t cc, uint16_t per)
+{
+	return (cc == 0) || (cc >= per);
+}
+
+/*
+ * Return TRUE when every timer output is fully on or fully off and no buffered update is pending
+ *  Power Save mode stops the timers, a PWM output would freeze part way through its period.
+ */
+static inline uint8_t hal_pwm_static(void)
+{
+	if ((TCC4.CTRLHSET & (TC4_PERBV_bm PWM_TCC4_TABLE(PWM_BV)))
+	 || (TCC5.CTRLHSET & (TC5_PERBV_bm PWM_TCC5_TABLE(PWM_BV)))
+	 || (TCD5.CTRLHSET & (TC5_PERBV_bm PWM_TCD5_TABLE(PWM_BV))))
+	{
+		return FALSE;									// Buffered values are applied at the next timer period
+	}
+	return TRUE PWM_TABLE(PWM_STATIC);					// Every channel in the PWM channel tables
+}
+
+/*
+ * Enter a sleep mode until the next interrupt
+ *  Global interrupts are enabled, the instruction after sei is always executed so no wake up is missed.
+ */
+static inline void hal_sleep(uint8_t mode)
+{
+	set_sleep_mode(mode);
+	sleep_enable();
+	sei();												// Enable global interrupts
+	sleep_cpu();										// Sleep until the next interrupt
+	sleep_disable();
+}
+
+#if OUT_PWM_FAST_CLOCK
+/*
+ * Switch the system clock between the internal 2MHz and 32MHz oscillators
+ *  TCC4 and TCC5 prescalers follow the clock so the LED Indicators keep the same timing.
+ *  Must be called with interrupts disabled.
+ */
+void hal_clock_fast(uint8_t fast)
+{
+	if (fast == clock_fast)
+	{
+		return;
+	}
+	clock_fast = fast;
+	if (fast)
+	{
+		OSC.CTRL |= (1 << OSC_RC32MEN_bp);				// Enable internal 32MHz oscillator
+		while (!(OSC.STATUS & OSC_RC32MRDY_bm));		// wait for 32MHz oscillator ready
+		CCP = CCP_IOREG_gc;								// Unlock clock control
+		CLK.CTRL = CLK_SCLKSEL_RC32M_gc;				// System clock is internal 32MHz oscillator
+		TCC4.CTRLA = TC_CLKSEL_DIV1024_gc;				// Clock is 32MHz/1024 or 31.25kHz
+		TCC5.CTRLA = TC_CLKSEL_DIV1024_gc;				// Clock is 32MHz/1024 or 31.25kHz
+	}
+	else
+	{
+		CCP = CCP_IOREG_gc;								// Unlock clock control
+		CLK.CTRL = CLK_SCLKSEL_RC2M_gc;					// System clock is internal 2MHz oscillator
+		OSC.CTRL &= ~(1 << OSC_RC32MEN_bp);				// Disable internal 32MHz oscillator
+		TCC4.CTRLA = TC_CLKSEL_DIV64_gc;				// Clock is 2MHz/64 or 31.25kHz
+		TCC5.CTRLA = TC_CLKSEL_DIV64_gc;				// Clock is 2MHz/64 or 31.25kHz
+	}
+#if TELEMETRY
+	if (telemetry_on)
+	{
+		hal_telemetry_baud();							// Same baud rate from the new clock
+	}
+#endif
+}
+#endif
+
+/*
+ * Initialize clocks, IOs, timers, RTC, interrupts and power reduction
+ *  Called with interrupts disabled.
+ */
+void hal_init(void)
+{
+	// clock setup
+	OSC.CTRL = (1 << OSC_RC32KEN_bp)					// Enable internal 32.768 kHz oscillator
+	         | (1 << OSC_RC2MEN_bp);					// Keep internal 2MHz oscillator enabled
+	// Initialize IOs, default all pins to input and have pull-downs enabled
+	PORTA.DIRCLR = 0xFF;								// PORTA is all inputs
+	hal_pins_ctrl(&PORTA, 0xFF, PORT_OPC_PULLDOWN_gc);	// PORTA is all pull-downs
+	PORTC.DIRCLR = 0xFF;								// PORTC is all inputs
+	hal_pins_ctrl(&PORTC, 0xFF, PORT_OPC_PULLDOWN_gc);	// PORTC is all pull-downs
+	PORTD.DIRCLR = 0xFF;								// PORTD is all inputs
+	hal_pins_ctrl(&PORTD, 0xFF, PORT_OPC_PULLDOWN_gc);	// PORTD is all pull-downs
+	PORTR.DIRCLR = 0xFF;								// PORTR is all inputs
+	hal_pins_ctrl(&PORTR, 0xFF, PORT_OPC_PULLDOWN_gc);	// PORTR is all pull-downs
+	// Configure all inputs from the input tables, not pulled down and interrupt on any edge
+	hal_pins_ctrl(&PORTA, IN_PORTA_gm & ~IN_PORTA_INV_gm, PORT_OPC_TOTEM_gc | PORT_ISC_BOTHEDGES_gc);
+	hal_pins_ctrl(&PORTA, IN_PORTA_INV_gm, PORT_OPC_TOTEM_gc | PORT_ISC_BOTHEDGES_gc | (1 << PORT_INVEN_bp));
+	PORTA.INTCTRL = PORT_INTLVL_HI_gc;					// Interrupt will be high level
+	PORTA.INTMASK = IN_PORTA_gm;						// Input interrupts enabled
+	hal_pins_ctrl(&PORTC, IN_PORTC_gm & ~IN_PORTC_INV_gm, PORT_OPC_TOTEM_gc | PORT_ISC_BOTHEDGES_gc);
+	hal_pins_ctrl(&PORTC, IN_PORTC_INV_gm, PORT_OPC_TOTEM_gc | PORT_ISC_BOTHEDGES_gc | (1 << PORT_INVEN_bp));
+	PORTC.INTCTRL = PORT_INTLVL_HI_gc;					// Interrupt will be high level
+	PORTC.INTMASK = IN_PORTC_gm;						// Input interrupts enabled
+	// Configure all outputs from the output tables as totem-pole outputs
+	PORTC.OUTCLR = OUT_PORTC_gm;						// All will be low when turned into outputs
+	hal_pins_ctrl(&PORTC, OUT_PORTC_gm, PORT_OPC_TOTEM_gc);
+	PORTC.DIRSET = OUT_PORTC_gm;						// All are now outputs
+	PORTD.OUTCLR = OUT_PORTD_gm;						// All will be low when turned into outputs
+	hal_pins_ctrl(&PORTD, OUT_PORTD_gm, PORT_OPC_TOTEM_gc);
+	PORTD.DIRSET = OUT_PORTD_gm;						// All are now outputs
+	// Configure TCC4 timer
+	TCC4.CTRLB = TC_WGMODE_DSTOP_gc						// Dual Slope Top Update
+			   | TC_CIRCEN_DISABLE_gc					// Circular Buffer disabled
+			   | TC_BYTEM_NORMAL_gc;					// Normal Mode
+	TCC4.CTRLC = 0 PWM_TCC4_TABLE(PWM_POL);				// Output polarity of each channel in the table
+	TCC4.CTRLE = 0 PWM_TCC4_TABLE(PWM_MODE);			// Channels in the table enabled, others disabled
+	TCC4.PERBUF = LED_PWM_PERIOD;						// FREQ = CPU_FREQ / (64 * 2 * LED_PWM_PERIOD)
+	TCC4.PER = LED_PWM_PERIOD;
+	TCC4.CTRLA = TC_CLKSEL_DIV64_gc;					// Clock is main/64 or 2MHz/64 or 31.25kHz
+	// Configure TCC5 timer
+	TCC5.CTRLB = TC_WGMODE_DSTOP_gc						// Dual Slope Top Update
+			   | TC_CIRCEN_DISABLE_gc					// Circular Buffer disabled
+			   | TC_BYTEM_NORMAL_gc;					// Normal Mode
+	TCC5.CTRLC = 0 PWM_TCC5_TABLE(PWM_POL);				// Output polarity of each channel in the table
+	TCC5.CTRLE = 0 PWM_TCC5_TABLE(PWM_MODE);			// Channels in the table enabled, others disabled
+	TCC5.PERBUF = LED_PWM_PERIOD;						// FREQ = CPU_FREQ / (64 * 2 * LED_PWM_PERIOD)
+	TCC5.PER = LED_PWM_PERIOD;
+	TCC5.CTRLA = TC_CLKSEL_DIV64_gc;					// Clock is main/64 or 2MHz/64 or 31.25kHz
+	// Configure TCD5 timer
+	TCD5.CTRLB = TC_WGMODE_DSTOP_gc						// Dual Slope Top Update
+			   | TC_CIRCEN_DISABLE_gc					// Circular Buffer disabled
+			   | TC_BYTEM_NORMAL_gc;					// Normal Mode
+	TCD5.CTRLC = 0 PWM_TCD5_TABLE(PWM_POL);				// Output polarity of each channel in the table
+	TCD5.CTRLE = 0 PWM_TCD5_TABLE(PWM_MODE);			// Channels in the table enabled, others disabled
+	TCD5.PERBUF = OUT_PWM_PERIOD;						// FREQ = CPU_FREQ / (PRESCALER * 2 * OUT_PWM_PERIOD)
+	TCD5.PER = OUT_PWM_PERIOD;
+	PWM_TCD5_TABLE(PWM_OFF)								// Phase shifted channels are off at the top compare value
+	TCD5.CTRLA = OUT_PWM_CLKSEL;						// Clock prescaler from OUT_PWM_PROFILE
+	// Configure RTC Clock
+	CLK.RTCCTRL = (1 << CLK_RTCEN_bp)					// enable RTC Clock
+				| CLK_RTCSRC_RCOSC32_gc;				// RTC Clock is Internal 32.768 kHz Clock
+	// Configure RTC
+	while (RTC.STATUS & RTC_SYNCBUSY_bm);				// wait for RTC sync ready
+	RTC.PER = RTC_TICK_COUNTS - 1;						// set RTC overflow to every 1ms (slightly more than)
+	RTC.CTRL = RTC_PRESCALER_DIV1_gc					// RTC prescaler is divide 1
+	         | (0 << RTC_CORREN_bp);					// RTC correction: disabled
+	RTC.INTCTRL = RTC_OVFINTLVL_HI_gc					// Overflow High level interrupt priority
+	            | RTC_COMPINTLVL_OFF_gc;				// Compare interrupt disabled
+	// Enable high level interrupts
+	PMIC.CTRL = 0 << PMIC_RREN_bp						// Round-Robin Priority Enable: disabled
+	          | 0 << PMIC_IVSEL_bp						// Interrupt Vector Select: disabled
+	          | 1 << PMIC_HILVLEN_bp					// High Level Enable: enabled
+			  | 0 << PMIC_MEDLVLEN_bp					// Medium Level Enable: disabled
+			  | TELEMETRY << PMIC_LOLVLEN_bp;			// Low Level Enable: disabled (unless telemetry)
+#if LED_EDMA
+	hal_breathe_wave(led_gain);							// Build the breathing waveform
+	EDMA.CTRL = EDMA_ENABLE_bm							// EDMA enabled
+			  | EDMA_CHMODE_STD02_gc					// Channels 0 and 2 are standard channels
+			  | EDMA_DBUFMODE_DISABLE_gc				// No double buffering
+			  | EDMA_PRIMODE_RR0123_gc;					// Round robin priority
+#endif
+	// Configure Power Reduction
+#if ISR_PROFILE
+	// Configure XCL as a free running 16-bit timer for ISR profiling
+	XCL.PERCAPTL = 0xFF;								// Timer period is 65536 counts
+	XCL.PERCAPTH = 0xFF;
+	XCL.CTRLE = XCL_TCSEL_TC16_gc						// One 16-bit timer
+			  | XCL_CLKSEL_DIV1_gc;						// Clock is main/1 or 2MHz (CPU cycles)
+#endif
+	PR.PRGEN = !ISR_PROFILE << PR_XCL_bp				// XCL power down: enabled (unless ISR profiling)
+			 | 0 << PR_RTC_bp							// RTC power down: disabled
+			 | 1 << PR_EVSYS_bp							// EVSYS power down: enabled
+			 | !LED_EDMA << PR_EDMA_bp;					// EDMA power down: enabled (unless EDMA breathing)
+	PR.PRPA = 1 << PR_DAC_bp							// DACA power down: enabled
+			| 1 << PR_ADC_bp							// ADCA power down: enabled
+			| 1 << PR_AC_bp;							// ACA power down: enabled
+	PR.PRPC = 1 << PR_TWI_bp							// TWIC power down: enabled
+			| 1 << PR_USART0_bp							// USART0C power down: enabled
+			| 1 << PR_SPI_bp							// SPIC power down: enabled
+			| 1 << PR_HIRES_bp							// HIRESC power down: enabled
+			| 0 << PR_TC5_bp							// TCC5 power down: disabled
+			| 0 << PR_TC4_bp;							// TCC4 power down: disabled
+	PR.PRPD = 1 << PR_USART0_bp							// USART0D power down: enabled
+			| 0 << PR_TC5_bp;							// TCD5 power down: disabled
+}
+
+/*
+ * Power down until an input changes or the RTC overflows
+ *  Timers are stopped while powered down, the watchdog keeps running so the RTC period must be shorter.
+ *  Only inputs marked wake in the input tables interrupt while powered down (not High beam and Reverse).
+ *  Called with interrupts disabled.
+ */
+void hal_power_down(void)
+{
+#if OUT_PWM_FAST_CLOCK
+	hal_clock_fast(FALSE);								// Power down from the 2MHz oscillator
+#endif
+	wdt_reset();										// Watchdog period starts now
+	TCC4.CTRLA = TC_CLKSEL_OFF_gc;						// TCC4 Clock is OFF
+	TCC5.CTRLA = TC_CLKSEL_OFF_gc;						// TCC5 Clock is OFF
+	TCD5.CTRLA = TC_CLKSEL_OFF_gc;						// TCD5 Clock is OFF
+	PORTA.INTMASK = IN_PORTA_WAKE_gm;					// Only wake-up inputs interrupt
+	PORTC.INTMASK = IN_PORTC_WAKE_gm;
+#if ISR_PROFILE
+	if (standby_timing)
+	{
+		isr_profile_record(&standby_awake, standby_wake - isr_profile_now());
+	}
+#endif
+	hal_sleep(SLEEP_SMODE_PSAVE_gc);					// Enter Power Down State now
+#if ISR_PROFILE
+	standby_wake = isr_profile_now();
+	standby_timing = TRUE;
+#endif
+	PORTA.INTMASK = IN_PORTA_gm;						// All input interrupts enabled again
+	PORTC.INTMASK = IN_PORTC_gm;
+	// Timer configuration and duty cycles are kept in Power Save, just restart the clocks
+	TCD5.CTRLA = OUT_PWM_CLKSEL;						// Clock prescaler from OUT_PWM_PROFILE (outputs first)
+	TCC4.CTRLA = TC_CLKSEL_DIV64_gc;					// Clock is main/64 or 2MHz/64 or 31.25kHz
+	TCC5.CTRLA = TC_CLKSEL_DIV64_gc;					// Clock is main/64 or 2MHz/64 or 31.25kHz
+}
+
+/*
+ * Return TRUE when the configuration standby depends on is intact
+ *  Inputs and their interrupt level, RTC tick, prescaler, clock and power, interrupt level, watchdog and Horn off.
+ *  The input change masks are not checked, hal_power_down writes them on every wake.
+ */
+static inline uint8_t hal_check(void)
+{
+	return !(PORTA.DIR & IN_PORTA_gm)
+		&& !(PORTC.DIR & IN_PORTC_gm)
+		&& (PORTA.INTCTRL == PORT_INTLVL_HI_gc)
+		&& (PORTC.INTCTRL == PORT_INTLVL_HI_gc)
+		&& (RTC.INTCTRL == RTC_OVFINTLVL_HI_gc)
+		&& (RTC.CTRL == RTC_PRESCALER_DIV1_gc)
+		&& (CLK.RTCCTRL == ((1 << CLK_RTCEN_bp) | CLK_RTCSRC_RCOSC32_gc))
+		&& (OSC.CTRL & (1 << OSC_RC32KEN_bp))
+		&& !(PR.PRGEN & (1 << PR_RTC_bp))
+		&& (PMIC.CTRL & (1 << PMIC_HILVLEN_bp))
+		&& (WDT.CTRL & WDT_ENABLE_bm)
+		&& !(PORTD.OUT & OUT_HEN_bm);
+}
+
+/*
+ * Set the duty cycle of a PWM channel, committed to the timer on the next tick
+ *  Must be called with interrupts disabled (or from an interrupt).
+ */
+static inline void pwm_set(uint8_t ch, uint16_t duty)
+{
+	if (pwm_duty[ch] != duty)
+	{
+		pwm_duty[ch] = duty;
+		pwm_dirty |= CH_bm(ch);
+	}
+}
+
+/*
+ * Commit the changed PWM channel duty cycles to the timer compare buffers
+ *  LED indicator duty cycles are scaled by the LED indicator gain here, pwm_duty keeps the unscaled values.
+ *  Called once per tick by the RTC Overflow interrupt.
+ */
+static inline void pwm_commit(void)
+{
+	uint8_t dirty = pwm_dirty;
+	uint16_t duty;
+	
+	for (uint8_t ch = 0; dirty; ch++, dirty >>= 1)
+	{
+		if (dirty & 1)
+		{
+			duty = pwm_duty[ch];
+			if (ch < CH_LED_COUNT)
+			{
+				duty = (duty * led_gain) >> 8;			// LED indicator duty cycles are at most 255
+			}
+			hal_pwm_duty(ch, duty);
+		}
+	}
+	pwm_dirty = 0;
+}
+
+/*
+ * Return the duty cycle of an LED indicator channel effect
+ */
+static inline uint16_t led_fx_duty(led_fx_t *fx)
+{
+	switch (fx->effect)
+	{
+	case LED_ON:
+		return fx->level;
+	case LED_BREATHE:
+		return get_sine(fx->phase);
+	case LED_FLASH:
+		return (fx->phase < LED_FLASH_STEPS) ? fx->level : 0;
+	default:
+		return 0;										// LED_OFF
+	}
+}
+
+/*
+ * Return TRUE when an LED indicator channel effect changes every step
+ *  With LED_EDMA the Switch LEDs breathe without any steps.
+ */
+static inline uint8_t led_fx_animated(uint8_t ch)
+{
+	uint8_t effect = led_fx[ch].effect;
+	
+	return (effect == LED_FLASH) || ((effect == LED_BREATHE) && !(LED_EDMA && (ch <= CH_SWL2)));
+}
+
+/*
+ * Return TRUE when any LED indicator channel effect is stepped in software
+ */
+static inline uint8_t led_fx_stepping(void)
+{
+	for (uint8_t ch = 0; ch < CH_LED_COUNT; ch++)
+	{
+		if (led_fx_animated(ch))
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Set the effect (LED_OFF, LED_ON, LED_BREATHE or LED_FLASH) of an LED indicator channel
+ *  level is the duty cycle when on (0-255). A new effect starts from its beginning, breathing at the sine
+ *   peak and flashing with the LED on. The Indicator Animation Task steps breathing and flashing.
+ */
+void led_set(uint8_t ch, uint8_t effect, uint8_t level)
+{
+	led_fx_t *fx = &led_fx[ch];
+	
+	if ((fx->effect == effect) && (fx->level == level))
+	{
+		return;											// Effect is already running
+	}
+	fx->effect = effect;
+	fx->level = level;
+	fx->phase = (effect == LED_BREATHE) ? 64 : 0;		// Peak sine value or LED on
+	cli();												// Disable global interrupts
+#if LED_EDMA
+	if (ch <= CH_SWL2)
+	{
+		// Update EDMA breathing first so a channel never overwrites the new duty cycle
+		hal_swl_breathe(((led_fx[CH_SWL1].effect == LED_BREATHE) ? SW1_LED : 0)
+					  | ((led_fx[CH_SWL2].effect == LED_BREATHE) ? SW2_LED : 0));
+		if (effect == LED_BREATHE)
+		{
+			pwm_duty[ch] = 0xFFFF;						// EDMA owns the compare buffer, force the next duty cycle
+			pwm_dirty &= ~CH_bm(ch);
+			sei();
+			return;
+		}
+	}
+#endif
+	pwm_set(ch, led_fx_duty(fx));
+	sei();												// Enable global interrupts
+	if (led_fx_animated(ch))
+	{
+		task_signal(TASK_bm(TASK_ANIMATE));				// Start stepping the effect
+	}
+}
+
+/*
+ * Set the LED indicator brightness gain (LED_GAIN_FULL = full brightness)
+ *  Every LED indicator channel is committed again on the next tick.
+ */
+void led_gain_set(uint16_t gain)
+{
+	if (gain == led_gain)
+	{
+		return;
+	}
+	cli();												// Disable global interrupts
+	led_gain = gain;
+	for (uint8_t ch = 0; ch < CH_LED_COUNT; ch++)
+	{
+		if (!(LED_EDMA && (ch <= CH_SWL2) && (led_fx[ch].effect == LED_BREATHE)))
+		{
+			pwm_dirty |= CH_bm(ch);						// EDMA owns the compare buffer of a breathing Switch LED
+		}
+	}
+	sei();												// Enable global interrupts
+#if LED_EDMA
+	hal_breathe_wave(gain);
+#endif
+}
+
+/*
+ * Step all breathing and flashing LED indicator channels
+ *  Returns TRUE when a channel is being animated.
+ */
+static inline uint8_t led_fx_step(void)
+{
+	uint8_t animated = FALSE;
+	led_fx_t *fx = led_fx;
+	
+	cli();												// Disable global interrupts
+	for (uint8_t ch = 0; ch < CH_LED_COUNT; ch++, fx++)
+	{
+		if (led_fx_animated(ch))
+		{
+			animated = TRUE;
+			fx->phase++;
+			if ((fx->effect == LED_FLASH) && (fx->phase >= 2 * LED_FLASH_STEPS))
+			{
+				fx->phase = 0;							// Next flash
+			}
+			pwm_set(ch, led_fx_duty(fx));
+		}
+	}
+	sei();												// Enable global interrupts
+	return animated;
+}
+
+/*
+ * Return the output PWM duty cycle for a ramp curve position (0-255)
+ */
+static inline uint16_t out_duty(uint8_t pos)
+{
+#if OUT_RAMP_GAMMA
+	pos = pgm_read_byte(&out_gamma[pos]);				// gamma correct the position
+#endif
+	if (pos == 255)
+	{
+		return OUT_PWM_PERIOD;							// 100% duty cycle
+	}
+	return ((uint32_t) pos * (OUT_PWM_PERIOD + 1)) >> 8;
+}
+
+/*
+ * Return the modeled load current in mA for an output duty cycle
+ *  scale is OUT_LOAD_SCALE() of the output load.
+ */
+static inline uint16_t out_current(uint16_t duty, uint32_t scale)
+{
+	return (duty * scale) >> 16;
+}
+
+/*
+ * Move a load current running average toward the current load current
+ *  A period longer than a tick (tickless) had a constant load so the average is the load.
+ */
+static inline void out_current_avg(volatile uint16_t *avg, uint16_t ma, uint16_t ticks)
+{
+	int16_t delta = ma - *avg;
+	
+	if ((ticks != 1) || ((delta >> CURRENT_AVG_SHIFT) == 0))
+	{
+		*avg = ma;										// Close enough (or settled)
+	}
+	else
+	{
+		*avg += delta >> CURRENT_AVG_SHIFT;				// 1/2^CURRENT_AVG_SHIFT of the way there
+	}
+}
+
+/*
+ * Return the duty cycle limit that keeps an output at or below ma
+ */
+static inline uint16_t out_duty_limit(uint16_t ma, uint16_t load_ma)
+{
+	if (ma >= load_ma)
+	{
+		return OUT_PWM_PERIOD;							// Whole load fits
+	}
+	return ((uint32_t) ma * OUT_PWM_PERIOD) / load_ma;
+}
+
+/*
+ * Fold back the V1 and V2 duty cycles so their ramp targets stay within out_budget_ma
+ *  When both targets do not fit the budget is shared in proportion to the current of each target,
+ *   so the outputs dim together instead of exceeding the budget.
+ *  Called with interrupts disabled whenever a target or the budget changes.
+ */
+static inline void out_foldback(void)
+{
+	uint16_t v1_ma = out_current(out_duty(v1_ramp.target >> 8), OUT_LOAD_SCALE(V1_LOAD_MA));
+	uint16_t v2_ma = out_current(out_duty(v2_ramp.target >> 8), OUT_LOAD_SCALE(V2_LOAD_MA));
+	uint32_t total = (uint32_t) v1_ma + v2_ma;
+	uint16_t v1_max = OUT_PWM_PERIOD;
+	uint16_t v2_max = OUT_PWM_PERIOD;
+	
+	if (total > out_budget_ma)
+	{
+		v1_max = out_duty_limit(((uint32_t) out_budget_ma * v1_ma) / total, V1_LOAD_MA);
+		v2_max = out_duty_limit(((uint32_t) out_budget_ma * v2_ma) / total, V2_LOAD_MA);
+	}
+	if ((v1_max != v1_duty_max) || (v2_max != v2_duty_max))
+	{
+		v1_duty_max = v1_max;
+		v2_duty_max = v2_max;
+		out_ramping = TRUE;								// Millisecond timer interrupt applies the new limits
+	}
+}
+
+/*
+ * Advance an output ramp by ticks RTC ticks toward its target
+ *  Returns the new PWM duty cycle.
+ *  Nothing ramps during a stretched RTC period, a ramp started part way through one (switch press fast
+ *   path) advances a single step.
+ */
+static inline uint16_t out_ramp_step(volatile out_ramp_t *ramp, uint16_t ticks)
+{
+	uint16_t level = ramp->level;
+	uint16_t target = ramp->target;
+	uint16_t delta = out_ramp_inc;
+	
+	if (ramp->hold)
+	{
+		// Staggered turn on, stays off until the hold is over
+		if (ramp->hold > ticks)
+		{
+			ramp->hold -= ticks;
+			return out_duty(level >> 8);
+		}
+		ramp->hold = 0;
+		if ((level < OUT_RAMP_START) && (target > OUT_RAMP_START))
+		{
+			level = OUT_RAMP_START;						// Skip the levels that are still 0% duty cycle
+		}
+	}
+	if (level < target)
+	{
+		level = (target - level > delta) ? level + delta : target;	// ramp up
+	}
+	else if (level > target)
+	{
+		level = (level - target > delta) ? level - delta : target;	// ramp down
+	}
+	ramp->level = level;
+	return out_duty(level >> 8);
+}
+
+/*
+ * Move an output duty cycle limit toward its current foldback limit and return it
+ *  A lower limit applies at once, a higher one (budget returned after the Horn) is reached over the ramp time
+ *   so the output soft starts from its folded back duty cycle.
+ */
+static inline uint16_t out_duty_lim_step(uint16_t *lim, uint16_t max)
+{
+	if ((*lim > max) || (max - *lim <= out_duty_inc))
+	{
+		*lim = max;
+	}
+	else
+	{
+		*lim += out_duty_inc;
+	}
+	return *lim;
+}
+
+/*
+ * Set a new output ramp target
+ *  A ramp in progress continues from its current level so it can reverse half way.
+ *  A ramp turning on from off waits hold RTC ticks before it starts.
+ *  Returns TRUE when the output turns on from off (hold was used), FALSE when the hold was ignored.
+ */
+static inline uint8_t out_ramp_to(volatile out_ramp_t *ramp, uint16_t target, uint16_t hold)
+{
+	uint8_t from_off = FALSE;
+	
+	cli();												// prevent interrupts from corrupting non-atomic instructions
+	if (ramp->target != target)							// input change interrupt can also start a ramp
+	{
+		ramp->hold = 0;
+		if ((ramp->level < OUT_RAMP_START) && (target > OUT_RAMP_START))
+		{
+			from_off = TRUE;
+			if (hold)
+			{
+				ramp->hold = hold;						// RTC Overflow interrupt starts the ramp after the hold
+			}
+			else
+			{
+				ramp->level = OUT_RAMP_START;			// Skip the levels that are still 0% duty cycle
+			}
+		}
+		ramp->target = target;
+		out_ramping = TRUE;								// Millisecond timer interrupt will handle ramping
+		out_foldback();									// Keep the new target within the current budget
+#if OUT_PWM_FAST_CLOCK
+		if (target)
+		{
+			hal_clock_fast(TRUE);						// Output PWM needs the 32MHz clock
+		}
+#endif
+	}
+	sei();
+	return from_off;
+}
+
+/*
+ * Turn an output on from a switch edge before the press is debounced
+ *  out_fast says if a press of the switch would turn the output on. The ramp starts at its first visible level
+ *   and its duty cycle is applied at once, the RTC Overflow interrupt confirms or rolls it back once a full
+ *   debounce window of the switch (debounce RTC ticks) has passed.
+ *  With OUT_PWM_FAST_CLOCK the first duty cycles run from the 2MHz clock, waiting for the 32MHz oscillator
+ *   does not belong in an interrupt. The Output Task starts it once the press is debounced.
+ *  Called from the input change interrupts.
+ */
+static inline void out_fast_on(uint8_t sw, uint8_t debounce, volatile out_ramp_t *ramp, uint8_t ch, uint8_t level)
+{
+	uint16_t duty;
+	
+	if ((hal_inputs() & ~in_state & out_fast) & sw)
+	{
+		// Switch just went down with its output off
+		out_fast &= ~sw;								// Once per press
+		out_fast_pending |= sw;
+		ramp->fast = debounce + 1;						// The tick in progress is only part of the window
+		ramp->level = OUT_RAMP_START;
+		ramp->hold = 0;
+		ramp->target = (uint16_t) level << 8;
+		out_ramping = TRUE;
+		out_foldback();
+		duty = out_duty(OUT_RAMP_START >> 8);
+		pwm_duty[ch] = duty;
+		pwm_dirty &= ~CH_bm(ch);						// Written now instead of on the next tick
+		hal_pwm_duty(ch, duty);
+		hal_v12_update();								// Apply now
+	}
+}
+
+/*
+ * Confirm or roll back an output a switch press turned on before it was debounced
+ *  Waits for the debounce window set by out_fast_on and for the switch to stop debouncing, a press that
+ *   is not the debounced state by then was noise. Contact bounce inside the window changes nothing.
+ *  Called by the RTC Overflow interrupt after the inputs are debounced.
+ */
+static inline void out_fast_check(uint8_t sw, volatile out_ramp_t *ramp, uint16_t ticks)
+{
+	if (out_fast_pending & sw)
+	{
+		if (ramp->fast > ticks)
+		{
+			ramp->fast -= ticks;						// Debounce window not over yet
+		}
+		else if (!(in_debouncing() & sw))
+		{
+			ramp->fast = 0;
+			out_fast_pending &= ~sw;
+			if (!(in_state & sw))
+			{
+				// The press did not debounce (noise)
+				out_fast |= sw;							// The next press turns the output on early again
+				ramp->target = 0;						// Roll back the output
+				out_ramping = TRUE;
+			}
+		}
+	}
+}
+
+/* 
+ * Turn output V1 and V2 off now (no ramp)
+ */
+void v12_off(void)
+{
+	cli();												// prevent interrupts from corrupting non-atomic instructions
+	v1_ramp.level = 0;
+	v1_ramp.target = 0;
+	v1_ramp.hold = 0;
+	v2_ramp.level = 0;
+	v2_ramp.target = 0;
+	v2_ramp.hold = 0;
+	out_ramping = FALSE;
+	v1_current_ma = 0;
+	v2_current_ma = 0;
+	pwm_duty[CH_V1] = 0;
+	pwm_duty[CH_V2] = 0;
+	pwm_dirty &= ~(CH_bm(CH_V1) | CH_bm(CH_V2));		// Written now instead of on the next tick
+	hal_pwm_duty(CH_V1, 0);								// V1 set to 0% duty cycle
+	hal_pwm_duty(CH_V2, 0);								// V2 set to 0% duty cycle
+	hal_v12_update();									// Apply now
+#if OUT_PWM_FAST_CLOCK
+	hal_clock_fast(FALSE);								// Outputs are off, back to the 2MHz clock
+#endif
+	sei();
+}
+
+/* 
+ * Turn output V1 on (soft start)
+ */
+void v1_on(void)
+{
+	out_ramp_to(&v1_ramp, (uint16_t) v1_level << 8, 0);	// V1 ramps to its brightness level
+}
+
+/* 
+ * Turn output V1 off (soft stop)
+ */
+void v1_off(void)
+{
+	out_ramp_to(&v1_ramp, 0, 0);						// V1 ramps to 0% duty cycle
+}
+
+/* 
+ * Turn output V2 on (soft start)
+ */
+void v2_on(void)
+{
+	out_ramp_to(&v2_ramp, (uint16_t) v2_level << 8, 0);	// V2 ramps to its brightness level
+}
+
+/* 
+ * Turn output V2 off (soft stop)
+ */
+void v2_off(void)
+{
+	out_ramp_to(&v2_ramp, 0, 0);						// V2 ramps to 0% duty cycle
+}
+
+/* 
+ * Set Switch 1 and 2 LED Indicators
+ *   led indicates which LED (SW1_LED, SW2_LED or SW12_LED)
+ *   state indicates the desired state (LED_OFF, LED_ON, LED_BREATHE or LED_FLASH)
+ */
+void swl12_set(uint8_t led, uint8_t state)
+{
+	if (led & SW1_LED)
+	{
+		led_set(CH_SWL1, state, LED_PWM_PERIOD);		// Switch 1 LED at 100% duty cycle when on
+	}
+	if (led & SW2_LED)
+	{
+		led_set(CH_SWL2, state, LED_PWM_PERIOD);		// Switch 2 LED at 100% duty cycle when on
+	}
+}
+
+/* 
+ * Set Horn Switch RGB LED Indicators to RGB sine pattern
+ *   Running a continuously incrementing angle will cycle 
+ *    through all colors.
+ *   angle 0 - 255 is like hue.
+ */
+static inline void hswl_rgb(uint8_t angle)
+{
+#if SINE_TABLES
+	const uint8_t *rgb = hue_rgb[angle];
+	
+	led_set(CH_HSWLR, LED_ON, pgm_read_byte(&rgb[0]));
+	led_set(CH_HSWLG, LED_ON, pgm_read_byte(&rgb[1]));
+	led_set(CH_HSWLB, LED_ON, pgm_read_byte(&rgb[2]));
+#else
+	uint8_t bigangle = (uint16_t) angle * 3 / 4;
+	uint8_t red = 0;
+	uint8_t green = 0;
+	uint8_t blue = 0;
+
+	// produce red LED intensity
+	if (angle < 85)
+	{
+		red = get_sine_peak(bigangle + 64);
+	}
+	else if (angle >= 170)
+	{
+		red = get_sine_peak(bigangle - 128);
+	}
+	// produce green LED intensity
+	if (angle <= 170)
+	{
+		green = get_sine_peak(bigangle);
+	}
+	// produce blue LED intensity
+	if (angle >= 85)
+	{
+		blue = get_sine_peak(bigangle - 64);
+	}
+	led_set(CH_HSWLR, LED_ON, red);
+	led_set(CH_HSWLG, LED_ON, green);
+	led_set(CH_HSWLB, LED_ON, blue);
+#endif
+}
+
+/* 
+ * Set Horn LED RGB Indicators to OFF
+ */
+static inline void hswl_off(void)
+{
+	led_set(CH_HSWLR, LED_OFF, 0);						// Red, Green and Blue LEDs off
+	led_set(CH_HSWLG, LED_OFF, 0);
+	led_set(CH_HSWLB, LED_OFF, 0);
+}
+
+/* 
+ * Turn output Horn on
+ *  V1 and V2 are first folded back to what is left of the current budget with the Horn on, when nothing is
+ *   left they are turned off with their Indicator LEDs. The Horn turns on HORN_SEQ_MS later once the
+ *   interrupt has written the folded back duty cycles.
+ *  Returns the number of milliseconds until it needs to be called again or TASK_WAIT.
+ */
+uint32_t horn_on(void)
+{
+	switch (horn_state)
+	{
+	case HORN_OFF:
+		cli();											// prevent interrupts from corrupting non-atomic instructions
+		out_budget_ma = HORN_OUT_BUDGET_MA;				// Current left for V1 and V2
+		out_foldback();
+		sei();
+		if (HORN_OUT_BUDGET_MA == 0)
+		{
+			// The other two outputs (V1 and V2) cannot be on at the same time
+			v12_off();									// Turn OFF all other outputs (V1 and V2)
+			swl12_set(SW12_LED, LED_OFF);				// Turn OFF Switch 1 and 2 Indicator LEDs
+		}
+		deadline_start(&horn_deadline, HORN_SEQ_MS);
+		horn_state = HORN_STARTING;
+		return HORN_SEQ_MS;
+	case HORN_STARTING:
+		if (!deadline_expired(horn_deadline))
+		{
+			return deadline_remaining(horn_deadline);	// V1 and V2 are still being folded back
+		}
+		hal_v12_update();								// Apply folded back duty cycles now
+		hal_horn(ON);									// Turn Horn ON
+		led_set(CH_HSWLR, LED_FLASH, LED_PWM_PERIOD);	// Red LED flashing, Green and Blue LEDs off
+		led_set(CH_HSWLG, LED_OFF, 0);
+		led_set(CH_HSWLB, LED_OFF, 0);
+		horn_state = HORN_ON;
+		break;
+	}
+	return TASK_WAIT;
+}
+
+/* 
+ * Turn output Horn off
+ *  V1 and V2 get the whole current budget back.
+ */
+static inline void horn_off(void)
+{
+	hal_horn(OFF);										// Turn Horn OFF
+	if (horn_state != HORN_OFF)
+	{
+		horn_state = HORN_OFF;
+		cli();											// prevent interrupts from corrupting non-atomic instructions
+		out_budget_ma = CURRENT_BUDGET_MA;
+		out_foldback();
+		sei();
+	}
+}
+
+/*
+ * Return the number of whole RTC ticks in ms milliseconds
+ *  A stretched period ends at or before a deadline, the remainder is covered by the following 1 tick periods.
+ */
+static inline uint16_t tick_count(uint16_t ms)
+{
+	return ((uint32_t) ms << 16) / tick_len;
+}
+
+/*
+ * Stretch the current RTC period to end ticks RTC ticks from its start (tickless)
+ *  Nothing is changed when the current tick is too close to its end to safely rewrite the period.
+ *  Called with interrupts disabled.
+ */
+void tick_stretch(uint16_t ticks)
+{
+	while (RTC.STATUS & RTC_SYNCBUSY_bm);				// wait for RTC sync ready
+	if ((ticks > 1) && !(RTC.INTFLAGS & RTC_OVFIF_bm) && (RTC.CNT < RTC_TICK_COUNTS - 4))
+	{
+		// Far enough from the end of this tick to safely stretch the RTC period
+		tick_step = ticks;
+		RTC.PER = ticks * RTC_TICK_COUNTS - 1;			// RTC overflow at the deadline
+	}
+}
+
+/*
+ * End a stretched tickless RTC period early
+ *  The current period is shortened so it ends on the next tick boundary.
+ *  Must be called with interrupts disabled (Input Change Interrupts).
+ */
+void tick_resume(void)
+{
+	uint16_t cnt;
+	uint16_t ticks;
+	
+	if (tick_step != 1)
+	{
+		while (RTC.STATUS & RTC_SYNCBUSY_bm);			// wait for RTC sync ready
+		cnt = RTC.CNT;
+		// Number of ticks until the next tick boundary
+		ticks = cnt / RTC_TICK_COUNTS + 1;
+		if ((ticks * RTC_TICK_COUNTS - 1) - cnt < 3)
+		{
+			ticks++;									// Too close to the boundary for the write to land in time
+		}
+		if (ticks < tick_step)
+		{
+			tick_step = ticks;
+			RTC.PER = ticks * RTC_TICK_COUNTS - 1;		// RTC overflow on the next tick boundary
+		}
+	}
+}
+
+/*
+ * Return TRUE when an input may be changing and the RTC must keep its millisecond tick
+ *  An edge not sampled yet, an input still debouncing or a raw input that differs from its debounced state.
+ *  Called with interrupts disabled, right before sleeping.
+ */
+static inline uint8_t in_changing(void)
+{
+	return in_edge || in_debouncing() || (hal_inputs() != in_state);
+}
+
+/*
+ * Sleep until the next event
+ *  ms is the number of milliseconds until the next task deadline.
+ *  When no input is debouncing (all vertical counters idle), no output is ramping, no duty cycle commit is
+ *   pending and no LED effect is stepped in software the RTC period is stretched to the deadline. A PWM output
+ *   holding a steady duty cycle (dimmed LEDs), EDMA breathing and telemetry do not need any ticks.
+ *  Power Save mode is used when all timer outputs are static, Idle mode keeps PWM outputs and telemetry running.
+ *  Any interrupt (RTC or Input Change) wakes the processor. Nothing happens when an input edge is already
+ *   waiting for the scheduler. An input that may be changing keeps the millisecond tick, the check is made
+ *   with interrupts disabled so an edge that arrives after the scheduler looked is not left for a stretched
+ *   period to sample.
+ */
+void sleep_until(uint32_t ms)
+{
+	uint8_t animate = out_ramping || pwm_dirty || led_fx_stepping();
+	uint8_t idle = animate || !hal_pwm_static() || hal_telemetry_active();
+	uint16_t ticks = 1;
+	
+	if (!animate)
+	{
+		ticks = tick_count((ms > TICKLESS_MAX_MS) ? TICKLESS_MAX_MS : ms);
+	}
+	cli();												// Disable global interrupts
+	if (in_event_pending())
+	{
+		sei();											// Edge arrived since the scheduler looked
+		return;
+	}
+	if (!animate && !in_changing())
+	{
+		// Nothing changes until the deadline or an input change
+		tick_stretch(ticks);
+	}
+#if ISR_PROFILE
+	isr_tick_psave |= !idle;							// The profiling timer stops in Power Save
+	standby_timing = FALSE;								// Not a standby self-check
+#endif
+	hal_sleep(idle ? SLEEP_SMODE_IDLE_gc : SLEEP_SMODE_PSAVE_gc);
+}
+
+/*
+ * Return the CRC16 CCITT of len bytes
+ */
+uint16_t crc16(const void *bytes, uint8_t len)
+{
+	const uint8_t *data = bytes;
+	uint16_t crc = 0xFFFF;
+	
+	while (len--)
+	{
+		crc = _crc_ccitt_update(crc, *data++);
+	}
+	return crc;
+}
+
+/*
+ * Return the CRC of a configuration record
+ */
+static inline uint16_t config_crc(const config_t *rec)
+{
+	return crc16(rec, offsetof(config_t, crc));
+}
+
+/*
+ * Use the configuration record
+ *  The RTC tick length and ramp rate are derived from the RTC clock calibration.
+ */
+void config_apply(void)
+{
+	uint16_t hz;
+	uint32_t inc;
+	
+	delay_time_ms = config.delay_time_ms;
+	v1_level = config.v1_level;
+	v2_level = config.v2_level;
+	// Calibrated RTC tick length
+	hz = config.rtc_clock_hz;
+	if ((hz < RTC_CLOCK_MIN_HZ) || (hz > RTC_CLOCK_MAX_HZ))
+	{
+		hz = RTC_CLOCK_HZ;								// Not calibrated
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		tick_len = RTC_TICK_LEN(hz);					// Used by the RTC Overflow interrupt
+	}
+	// Ramp level change per tick (scaled by the tick length in 1/4096 milliseconds)
+	inc = config.ramp_time_ms ? (((uint32_t) OUT_RAMP_FULL * (tick_len >> 4)) / config.ramp_time_ms) >> 12 : OUT_RAMP_FULL;
+	out_ramp_inc = (inc < OUT_RAMP_FULL) ? inc : OUT_RAMP_FULL;
+	if (!out_ramp_inc)
+	{
+		out_ramp_inc = 1;								// Slowest possible ramp
+	}
+	// Duty cycle limit rise per tick, from 0% to 100% over the ramp time
+	inc = config.ramp_time_ms ? (((uint32_t) OUT_PWM_PERIOD * (tick_len >> 4)) / config.ramp_time_ms) >> 12 : OUT_PWM_PERIOD;
+	out_duty_inc = (inc < OUT_PWM_PERIOD) ? inc : OUT_PWM_PERIOD;
+	if (!out_duty_inc)
+	{
+		out_duty_inc = 1;
+	}
+}
+
+/*
+ * Load the newest valid configuration record from EEPROM
+ *  A record interrupted by a power loss fails its CRC so the previous record is used.
+ *  Defaults are used when there is no valid record (new board or a different CONFIG_VERSION).
+ */
+void config_load(void)
+{
+	config_t rec;
+	uint8_t found = FALSE;
+	
+	for (uint8_t slot = 0; slot < CONFIG_SLOTS; slot++)
+	{
+		hal_eeprom_read(&rec, (uint16_t) &eeprom_config[slot], sizeof(rec));
+		if ((rec.version == CONFIG_VERSION) && (rec.crc == config_crc(&rec))
+		 && (!found || ((int8_t) (rec.sequence - config.sequence) > 0)))
+		{
+			// Valid and newer than any record so far
+			config = rec;
+			config_slot = slot;
+			found = TRUE;
+		}
+	}
+	if (!found)
+	{
+		config.version = CONFIG_VERSION;
+		config.delay_time_ms = DEFAULT_DELAY_TIME_MINUTES * 60ul * 1000ul;
+		config.ramp_time_ms = OUT_RAMP_TIME_MS;
+		config.v1_level = 255;
+		config.v2_level = 255;
+		config_slot = CONFIG_SLOTS - 1;					// First write goes to slot 0
+	}
+	config_apply();
+}
+
+/*
+ * Write the configuration record when needed
+ *  Each record goes to the next slot so the previous record stays valid until the new one is written.
+ */
+void config_poll(void)
+{
+	uint8_t slot = (config_slot + 1) % CONFIG_SLOTS;
+	
+	if (config_dirty)
+	{
+		config.sequence++;
+		config.crc = config_crc(&config);
+		if (hal_eeprom_write((uint16_t) &eeprom_config[slot], &config, sizeof(config)))
+		{
+			config_slot = slot;
+			config_dirty = FALSE;
+		}
+		else
+		{
+			config.sequence--;							// Still busy, try again next time
+		}
+	}
+}
+
+/*
+ * Save the delay time and output brightness levels
+ *  The EEPROM write runs in the background.
+ */
+void config_save(void)
+{
+	config.delay_time_ms = delay_time_ms;
+	config.v1_level = v1_level;
+	config.v2_level = v2_level;
+	config_dirty = TRUE;
+	config_poll();
+}
+
+/*
+ * Load the event log head from EEPROM
+ *  Logging continues in the newest valid page, a page interrupted by a power loss fails its CRC.
+ */
+void log_load(void)
+{
+	log_page_t rec;
+	uint8_t found = FALSE;
+	
+	for (uint8_t slot = 0; slot < LOG_PAGES; slot++)
+	{
+		hal_eeprom_read(&rec, (uint16_t) &eeprom_log[slot], sizeof(rec));
+		if ((rec.count <= LOG_PAGE_ENTRIES) && (rec.crc == crc16(&rec, offsetof(log_page_t, crc)))
+		 && (!found || ((int8_t) (rec.sequence - log_page.sequence) > 0)))
+		{
+			// Valid and newer than any page so far
+			log_page = rec;
+			log_slot = slot;
+			found = TRUE;
+		}
+	}
+	if (!found)
+	{
+		log_page.sequence = 0xFF;
+		log_page.count = LOG_PAGE_ENTRIES;				// Looks full so the first event starts page 0
+		log_slot = LOG_PAGES - 1;
+	}
+}
+
+/*
+ * Add an event to the event log
+ *  The page is written to EEPROM by log_poll. An event is dropped while a full page waits to be written.
+ */
+void log_event(uint8_t event, uint8_t data)
+{
+	log_entry_t *entry;
+	
+	if (log_page.count >= LOG_PAGE_ENTRIES)
+	{
+		if (log_dirty)
+		{
+			return;										// Full page not written yet
+		}
+		// Start the next page of the ring
+		log_slot = (log_slot + 1) % LOG_PAGES;
+		log_page.sequence++;
+		log_page.count = 0;
+	}
+	entry = &log_page.entry[log_page.count++];
+	entry->time = uptime() >> 10;
+	entry->event = event;
+	entry->data = data;
+	if (!log_dirty)
+	{
+		log_dirty = TRUE;
+		if (deadline_remaining(log_deadline) < LOG_BATCH_MS)
+		{
+			deadline_start(&log_deadline, LOG_BATCH_MS);	// Collect the events that follow
+		}
+	}
+}
+
+/*
+ * Log state changes and write the event log page when it is due
+ *  A full page is written at once. A partly filled page is written LOG_BATCH_MS after its first new event
+ *   but no sooner than LOG_WRITE_MS after the last write. In Power Down State the page waits in standby and
+ *   is written by the self-check wake-up that finds it due.
+ *  The EEPROM write runs in the background.
+ */
+void log_poll(void)
+{
+	uint8_t folded;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		// Input change interrupts also fold back
+		folded = (v1_duty_max < OUT_PWM_PERIOD) || (v2_duty_max < OUT_PWM_PERIOD);
+	}
+	folded &= (horn_state == HORN_OFF);					// Folding back for the horn is expected
+	if (power_state != log_power)
+	{
+		log_power = power_state;
+		log_event(LOG_POWER, power_state);
+	}
+	if (batt_state != log_batt)
+	{
+		log_batt = batt_state;
+		log_event(LOG_BATTERY, batt_state);
+	}
+	if (horn_state != log_horn)
+	{
+		log_horn = horn_state;
+		if ((horn_state == HORN_ON) && !horn_pattern)
+		{
+			log_event(LOG_HORN, HORN_PATTERN_NONE);		// Horn Switch honk, patterns are logged by the Horn Task
+		}
+	}
+	if (folded != log_folded)
+	{
+		log_folded = folded;
+		log_event(LOG_FOLDBACK, folded);
+	}
+	if (log_dirty && ((log_page.count >= LOG_PAGE_ENTRIES) || deadline_expired(log_deadline)))
+	{
+		log_page.crc = crc16(&log_page, offsetof(log_page_t, crc));
+		if (hal_eeprom_write((uint16_t) &eeprom_log[log_slot], &log_page, sizeof(log_page)))
+		{
+			log_dirty = FALSE;
+			deadline_start(&log_deadline, LOG_WRITE_MS);
+		}
+		// else the EEPROM is still busy, try again next time
+	}
+}
+
+/*
+ * Count the duty cycle weighted on-time of an output over a number of RTC ticks
+ *  Called by the RTC Overflow interrupt, a single tick only adds and compares.
+ */
+static inline void stats_on_time(volatile stats_on_t *on, uint16_t duty, uint16_t ticks)
+{
+	uint32_t sum;
+	
+	if (duty)
+	{
+		if (ticks == 1)
+		{
+			sum = on->frac + duty;						// Less than 2 full ticks
+			if (sum >= OUT_PWM_PERIOD)
 			{
-				// IGN is ON
-				power_state = SM_POWER_ON_IGN;			// Switch to Power ON due to Ignition State
+				sum -= OUT_PWM_PERIOD;
+				on->ticks = stats_add(on->ticks, 1);
 			}
-			else if ((sw1_toggle || sw2_toggle) && (delay_time_ms != 0))
+		}
+		else
+		{
+			// End of a stretched tickless period
+			sum = on->frac + (uint32_t) duty * ticks;
+			on->ticks = stats_add(on->ticks, sum / OUT_PWM_PERIOD);
+			sum %= OUT_PWM_PERIOD;
+		}
+		on->frac = sum;
+	}
+}
+
+/*
+ * Take the whole seconds out of an RTC tick counter of the RTC Overflow interrupt
+ *  The remaining ticks stay in the counter.
+ */
+static uint32_t stats_seconds(volatile uint32_t *counter, uint16_t tick_hz)
+{
+	uint32_t ticks;
+	uint32_t seconds;
+	
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ticks = *counter;
+	}
+	seconds = ticks / tick_hz;							// Divide with interrupts enabled
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		*counter -= seconds * tick_hz;
+	}
+	return seconds;
+}
+
+/*
+ * Load the usage statistics record from EEPROM
+ *  Counting starts from 0 when there is no valid record.
+ */
+void stats_load(void)
+{
+	stats_t rec;
+	uint8_t found = FALSE;
+	
+	for (uint8_t slot = 0; slot < STATS_SLOTS; slot++)
+	{
+		hal_eeprom_read(&rec, (uint16_t) &eeprom_stats[slot], sizeof(rec));
+		if ((rec.crc == crc16(&rec, offsetof(stats_t, crc)))
+		 && (!found || ((int8_t) (rec.sequence - stats.sequence) > 0)))
+		{
+			// Valid and newer than any record so far
+			stats = rec;
+			stats_slot = slot;
+			found = TRUE;
+		}
+	}
+	if (!found)
+	{
+		stats_slot = STATS_SLOTS - 1;					// First write goes to slot 0
+	}
+}
+
+/*
+ * Write the usage statistics record when needed
+ *  Each record goes to the other slot so the previous record stays valid until the new one is written.
+ */
+void stats_poll(void)
+{
+	uint8_t slot = (stats_slot + 1) % STATS_SLOTS;
+	
+	if (stats_dirty)
+	{
+		stats.sequence++;
+		stats.crc = crc16(&stats, offsetof(stats_t, crc));
+		if (hal_eeprom_write((uint16_t) &eeprom_stats[slot], &stats, sizeof(stats)))
+		{
+			stats_slot = slot;
+			stats_dirty = FALSE;
+		}
+		else
+		{
+			stats.sequence--;							// Still busy, try again next time
+		}
+	}
+}
+
+/*
+ * Add the usage counted since the last power down to the usage statistics record and write it
+ *  On-time is counted in RTC ticks by the RTC Overflow interrupt and recorded in whole seconds.
+ */
+void stats_flush(void)
+{
+	uint16_t tick_hz = (1000ul << 16) / tick_len;		// RTC ticks per second
+	
+	stats.v1_on_s = stats_add(stats.v1_on_s, stats_seconds(&stats_v1_on.ticks, tick_hz));
+	stats.v2_on_s = stats_add(stats.v2_on_s, stats_seconds(&stats_v2_on.ticks, tick_hz));
+	stats.horn_on_s = stats_add(stats.horn_on_s, stats_seconds(&stats_horn_ticks, tick_hz));
+	stats_dirty = TRUE;
+	stats_poll();
+}
+
+/*
+ * Set the current budget of V1 and V2 (mA)
+ */
+static inline void out_budget(uint16_t ma)
+{
+	cli();												// prevent interrupts from corrupting non-atomic instructions
+	out_budget_ma = ma;
+	out_foldback();
+	sei();
+}
+
+/*
+ * Battery meter
+ *  Adds the charge V1 and V2 drew since the last update, then dims or sheds them past the thresholds.
+ *  Only used with Ignition off (SM_POWER_ON_SW).
+ */
+void battery_meter(void)
+{
+	uint32_t now = uptime();
+	uint16_t ma;
+	
+	cli();												// prevent interrupts from corrupting non-atomic instructions
+	ma = v1_current_avg + v2_current_avg;
+	sei();
+	batt_ma_ms += (uint32_t) ma * (now - batt_time);
+	batt_time = now;
+	while (batt_ma_ms >= MA_MS_PER_MAH)
+	{
+		batt_ma_ms -= MA_MS_PER_MAH;
+		batt_mah++;
+	}
+	if ((batt_state < BATT_SHED) && (batt_mah >= BATTERY_SHED_MAH))
+	{
+		// Battery needs what is left to crank, V1 and V2 are shed and their LEDs flash before power down
+		batt_state = BATT_SHED;
+		deadline_start(&delay_deadline, BATTERY_SHED_NOTICE_MS);
+		task_signal(TASK_bm(TASK_OUTPUT));
+	}
+	else if ((batt_state < BATT_DIM) && (batt_mah >= BATTERY_DIM_MAH))
+	{
+		// Dim V1 and V2 and flash their LEDs to show the battery is being saved
+		batt_state = BATT_DIM;
+		out_budget(BATTERY_DIM_MA);
+		task_signal(TASK_bm(TASK_OUTPUT));
+	}
+}
+
+/*
+ * Clear the battery meter, the battery is charging once Ignition is on
+ */
+static inline void battery_clear(void)
+{
+	if (batt_mah | batt_ma_ms)
+	{
+		batt_mah = 0;
+		batt_ma_ms = 0;
+		if (batt_state == BATT_DIM)
+		{
+			out_budget(CURRENT_BUDGET_MA);				// Dimmed outputs get the whole budget back
+		}
+		batt_state = BATT_OK;
+	}
+}
+
+/*
+ * Power Task (Power State Machine)
+ *  Manages initialization and power down of processor, the Horn and the automatic switch toggles
+ *  Returns the number of milliseconds until it needs to run again or TASK_WAIT.
+ */
+uint32_t power_task(void)
+{
+	uint8_t state = power_state;
+	uint8_t toggles = (sw1_toggle << 4) | sw2_toggle;
+	uint32_t next = TASK_WAIT;
+	uint16_t ticks;										// RTC ticks until the next standby self-check
+	
+	switch (power_state)
+	{
+	case SM_POWER_DOWN:									// Powered Down State
+		// See if IGN has switched ON
+		if (inputs & IN_IGN_bm)
+		{
+			// IGN is ON
+			power_state = SM_POWER_ON_IGN;				// Switch to Power ON due to Ignition State
+			battery_clear();
+		}
+		else if ((sw1_toggle || sw2_toggle) && (delay_time_ms != 0) && (batt_state != BATT_SHED))
+		{
+			// IGN is OFF, one of the switches were toggled ON and delay time is set to something other than 0
+			//  Time to wake up and do something
+			power_state = SM_POWER_ON_SW;				// Switch to Power ON due to Switch State
+			deadline_start(&delay_deadline, delay_time_ms);
+			batt_time = uptime();						// Battery meter starts now
+		}
+		else if (in_debouncing() | out_ramping | config_dirty | stats_dirty | eeprom_busy | hal_telemetry_active()
+		 | horn_pattern)
+		{
+			// An input is still debouncing, an output is ramping off, the configuration, event log or usage
+			//  statistics are being written, telemetry is still powered up or a Horn pattern is playing, wait
+			//  for it to finish before powering down (an event log page that is not due yet waits in standby)
+			next = 1;
+		}
+		else
+		{
+			// There is nothing to do so Power Down
+			horn_off();									// Turn OFF horn
+			hswl_off();									// Turn OFF horn RGD LED indicators
+			if (pwm_dirty || !hal_pwm_static())
 			{
-				// IGN is OFF, one of the switches were toggled ON and delay time is set to something other than 0
-				//  Time to wake up and do something
-				power_state = SM_POWER_ON_SW;			// Switch to Power ON due to Switch State
-				cli();									// prevent interrupts from corrupting non-atomic instructions
-				delay_ms = 0;
-				sei();
+				next = 1;								// LEDs turn off on the next tick
 			}
 			else
 			{
-				// There is nothing to do so Power Down
-				horn_off();								// Turn OFF horn
-				hswl_off();								// Turn OFF horn RGD LED indicators
-				wdt_disable();							// Disable the watchdog timer before going to sleep
- 				TCC4.CTRLA = TC_CLKSEL_OFF_gc;			// TCC4 Clock is OFF
-				TCC5.CTRLA = TC_CLKSEL_OFF_gc;			// TCC5 Clock is OFF
-				TCD5.CTRLA = TC_CLKSEL_OFF_gc;			// TCD5 Clock is OFF
-				REV_port.INTMASK &= ~(1 << REV_bp)		// REV Input Change Interrupt interrupt disabled
-								 &  ~(1 << HB_bp);		// HB Input Change Interrupt interrupt disabled
-				set_sleep_mode(SLEEP_SMODE_PSAVE_gc);	// Set Power Down Mode when sleep is executed
-				sleep_mode();							// Enter Power Down State now
-				REV_port.INTMASK |= (1 << REV_bp) 		// REV Input Change Interrupt interrupt enabled
-								 |  (1 << HB_bp);		// HB Input Change Interrupt interrupt enabled
- 				TCC4.CTRLA = TC_CLKSEL_DIV64_gc;		// Clock is main/64 or 2MHz/64 or 31.25kHz
- 				TCC4.CTRLC = (0 << TC4_POLA_bp)			// Non-Invert OC4A output (Not used)
- 						   | (1 << TC4_POLB_bp)			// Invert OC4B output (HSWLB_EN)
- 						   | (1 << TC4_POLC_bp)			// Invert OC4C output (HSWLG_EN)
- 						   | (1 << TC4_POLD_bp)			// Invert OC4D output (HSWLR_EN)
- 						   | (0 << TC4_CMPA_bp)			// Force OC4A output OFF (Not used)
- 						   | (0 << TC4_CMPB_bp)			// Force OC4B output OFF (HSWLB_EN) 
- 						   | (0 << TC4_CMPC_bp)			// Force OC4C output OFF (HSWLG_EN)
- 						   | (0 << TC4_CMPD_bp);		// Force OC4D output OFF (HSWLR_EN)
-				TCC5.CTRLA = TC_CLKSEL_DIV64_gc;		// Clock is main/64 or 2MHz/64 or 31.25kHz
-				TCC5.CTRLC = (1 << TC5_POLA_bp)			// Invert OC5A output (SWL2_EN)
-						   | (1 << TC5_POLB_bp)			// Invert OC5B output (SWL1_EN)
-						   | (0 << TC5_CMPA_bp)			// Force OC5A output OFF (SWL2_EN) OFF
-						   | (0 << TC5_CMPB_bp);		// Force OC5B output OFF (SWL1_EN) OFF
-				TCD5.CTRLA = TC_CLKSEL_DIV64_gc;		// Clock is main/64 or 2MHz/64 or 31.25kHz
-				TCD5.CTRLC = (1 << TC5_POLA_bp)			// Invert OC5A output (V1_EN)
-						   | (1 << TC5_POLB_bp)			// Invert OC5D output (V2_EN)
-						   | (0 << TC5_CMPA_bp)			// Force OC5A output OFF (V1_EN)
-						   | (0 << TC5_CMPB_bp);		// Force OC5B output OFF (V2_EN)
-				wdt_reset();							// reset watchdog before enabling it
-				wdt_enable(WATCHDOG_TO);				// Enable the Watchdog timer
-				continue;								// We were woken from Power Down state, restart the while(TRUE) loop
+				// Standby until an input changes or the next self-check
+				ticks = tick_count(STANDBY_CHECK_MS);
+				in_woken = FALSE;						// An edge from here on is a wake-up
+				cli();									// Disable interrupts
+				if (in_changing() || in_event_pending())
+				{
+					// An input changed since the checks above, sample it on the next tick before powering down
+					sei();
+					next = 1;
+				}
+				else
+				{
+					tick_stretch(ticks);
+					hal_power_down();					// Enter Power Down State now
+					if (in_woken)
+					{
+						// Woken by an input change, not by the self-check
+						standby_wakes++;
+						stats.wakes = stats_add(stats.wakes, 1);
+					}
+					// Woken, the RTC Overflow interrupt re-sampled all inputs
+					if (!hal_check())
+					{
+						// Wake-up configuration is corrupted, initialize everything again
+						standby_faults++;
+						log_event(LOG_STANDBY_FAULT, standby_faults);
+						power_state = SM_POWER_RESET;
+					}
+					next = 0;							// We were woken from Power Down state, check again
+				}
 			}
-			break;
-		case SM_POWER_ON_IGN:							// Power ON due to Ignition State
-			// See if IGN has switched OFF
-			if (!ign_cur)
+		}
+		break;
+	case SM_POWER_ON_IGN:								// Power ON due to Ignition State
+		// See if IGN has switched OFF
+		if (!(inputs & IN_IGN_bm))
+		{
+			// IGN switched OFF so Power Down
+			power_state = SM_POWER_DOWN;				// Switch to Power Down State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when IGN turns off
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when IGN turns off
+		}
+		else
+		{
+			if (inputs & IN_HSW_bm)
 			{
-				// IGN switched OFF so Power Down
-				power_state = SM_POWER_DOWN;			// Switch to Power Down State
-				sw1_toggle = TOGGLE_OFF;				// SW1 toggle forced off when IGN turns off
-				sw2_toggle = TOGGLE_OFF;				// SW2 toggle forced off when IGN turns off
+				// Horn Switch changed
+				if ((horn_state == HORN_OFF) || horn_pattern)
+				{
+					stats.horn_count = stats_add(stats.horn_count, 1);	// Once per press, also when it stops a pattern
+				}
+				next = horn_on();
+				// force difference for High Beam and Reverse
+				in_last = inputs ^ (IN_HB_bm | IN_REV_bm);
 			}
 			else
 			{
-				if (hsw_cur)
+				// horn is not engaged
+				if (!horn_pattern)
 				{
-					// Horn Switch changed
-					horn_on();
-					// force difference for High Beam and Reverse
-					hb_last = !hb_cur;
-					rev_last = !rev_last;
+					horn_off();							// A Horn pattern owns the Horn until it ends
 				}
-				else
+				if ((inputs ^ in_last) & IN_HB_bm)
 				{
-					// horn is not engaged
-					horn_off();
-					if (hb_cur != hb_last)
+					// High beam changed
+					if (inputs & IN_HB_bm)
 					{
-						// High beam changed
-						if (hb_cur)
+						// High beam turned ON
+						if (sw1_toggle != TOGGLE_ON_USER)
 						{
-							// High beam turned ON
-							if (sw1_toggle != TOGGLE_ON_USER)
-							{
-								// SW1 Toggle is not already ON from user request
-								sw1_toggle = TOGGLE_ON;	// SW1 Toggle automatically turned ON
-							}
+							// SW1 Toggle is not already ON from user request
+							sw1_toggle = TOGGLE_ON;		// SW1 Toggle automatically turned ON
 						}
-						else
+					}
+					else
+					{
+						// High beam turned OFF
+						if (sw1_toggle != TOGGLE_ON_USER)
 						{
-							// High beam turned OFF
-							if (sw1_toggle != TOGGLE_ON_USER)
-							{
-								// SW1 Toggle is not already ON from user request
-								sw1_toggle = TOGGLE_OFF;// SW1 Toggle automatically turned OFF
-							}
+							// SW1 Toggle is not already ON from user request
+							sw1_toggle = TOGGLE_OFF;// SW1 Toggle automatically turned OFF
 						}
-						hb_last = hb_cur;
 					}
-					if (rev_cur != rev_last)
+					in_last = (in_last & ~IN_HB_bm) | (inputs & IN_HB_bm);
+				}
+				if ((inputs ^ in_last) & IN_REV_bm)
+				{
+					// Reverse changed
+					if (inputs & IN_REV_bm)
 					{
-						// Reverse changed
-						if (rev_cur)
+						// Reverse turned ON
+						if (sw2_toggle != TOGGLE_ON_USER)
 						{
-							// Reverse turned ON
-							if (sw2_toggle != TOGGLE_ON_USER)
-							{
-								// SW2 Toggle is not already ON from user request
-								sw2_toggle = TOGGLE_ON;	// SW2 Toggle automatically turned ON
-							}
+							// SW2 Toggle is not already ON from user request
+							sw2_toggle = TOGGLE_ON;		// SW2 Toggle automatically turned ON
 						}
-						else
+					}
+					else
+					{
+						// Reverse turned OFF
+						if (sw2_toggle != TOGGLE_ON_USER)
 						{
-							// Reverse turned OFF
-							if (sw2_toggle != TOGGLE_ON_USER)
-							{
-								// SW2 Toggle is not already ON from user request
-								sw2_toggle = TOGGLE_OFF;// SW2 Toggle automatically turned OFF
-							}
+							// SW2 Toggle is not already ON from user request
+							sw2_toggle = TOGGLE_OFF;// SW2 Toggle automatically turned OFF
 						}
-						rev_last = rev_cur;
 					}
+					in_last = (in_last & ~IN_REV_bm) | (inputs & IN_REV_bm);
 				}
 			}
-			break;
-		case SM_POWER_ON_SW:							// Power ON due to Switch State
-			if (ign_cur)
-			{
-				// IGN switched on so we are no longer Power ON due to Switch
-				power_state = SM_POWER_ON_IGN;			// Switch to Power ON due to Ignition turning ON
-			}
-			else if (!sw1_toggle && !sw2_toggle)
-			{
-				// No switch is active, time to Power Down
-				power_state = SM_POWER_DOWN;			// Switch to Power Down State
-			}
-			else if (delay_ms >= delay_time_ms)
+		}
+		break;
+	case SM_POWER_ON_SW:								// Power ON due to Switch State
+		if (inputs & IN_IGN_bm)
+		{
+			// IGN switched on so we are no longer Power ON due to Switch
+			power_state = SM_POWER_ON_IGN;				// Switch to Power ON due to Ignition turning ON
+			battery_clear();
+		}
+		else if (!sw1_toggle && !sw2_toggle)
+		{
+			// No switch is active, time to Power Down
+			power_state = SM_POWER_DOWN;				// Switch to Power Down State
+		}
+		else
+		{
+			battery_meter();							// Count the charge drawn from the battery
+			if (deadline_expired(delay_deadline))
 			{
 				// Delay timeout
+				log_event(LOG_DELAY, 0);
 				sw1_toggle =  TOGGLE_OFF;
 				sw2_toggle =  TOGGLE_OFF;				// Turn off SW1 and SW2 toggle before entering power down
 				power_state = SM_POWER_DOWN;			// Switch to Power Down State
-			} 
-			break;
-		default:
-			// Anything else is considered to SM_POWER_RESET
-			cli();										// Disable interrupts
-			// clock setup
-			OSC.CTRL = (1 << OSC_RC32KEN_bp)			// Enable internal 32.768 kHz oscillator
-			         | (1 << OSC_RC2MEN_bp);			// Keep internal 2MHz oscillator enabled
-			// Initialize IOs, default all pins to input and have pull-downs enabled
-			PORTA.DIRCLR = 0xFF;						// PORTA is all inputs
-			PORTCFG.MPCMASK = 0xFF;						// Multi-Pin Configuration select all bits
-			PORTA.PIN0CTRL = PORT_OPC_PULLDOWN_gc;		// PORTA is all pull-downs
-			PORTC.DIRCLR = 0xFF;						// PORTC is all inputs
-			PORTCFG.MPCMASK = 0xFF;						// Multi-Pin Configuration select all bits
-			PORTC.PIN0CTRL = PORT_OPC_PULLDOWN_gc;		// PORTC is all pull-downs
-			PORTD.DIRCLR = 0xFF;						// PORTD is all inputs
-			PORTCFG.MPCMASK = 0xFF;						// Multi-Pin Configuration select all bits
-			PORTD.PIN0CTRL = PORT_OPC_PULLDOWN_gc;		// PORTD is all pull-downs
-			PORTR.DIRCLR = 0xFF;						// PORTR is all inputs
-			PORTCFG.MPCMASK = 0xFF;						// Multi-Pin Configuration select all bits
-			PORTR.PIN0CTRL = PORT_OPC_PULLDOWN_gc;		// PORTR is all pull-downs
-			// Configure IGN input
-			PORTCFG.MPCMASK = (1 << IGN_bp);			// Multi-Pin Configuration select input
-			IGN_port.PIN0CTRL = PORT_OPC_TOTEM_gc		// Input is not pulled down
-			                  | PORT_ISC_BOTHEDGES_gc;	// Input interrupt on any edge
-			IGN_port.INTCTRL = PORT_INTLVL_HI_gc;		// Interrupt will be high level
-			IGN_port.INTMASK |= (1 << IGN_bp);			// Input interrupt enabled
-			// Configure REV input
-			PORTCFG.MPCMASK = (1 << REV_bp);			// Multi-Pin Configuration select input
-			REV_port.PIN0CTRL = PORT_OPC_TOTEM_gc		// Input is not pulled down
-			                  | PORT_ISC_BOTHEDGES_gc;	// Input interrupt on any edge
-			REV_port.INTCTRL = PORT_INTLVL_HI_gc;		// Interrupt will be high level
-			REV_port.INTMASK |= (1 << REV_bp);			// Input interrupt enabled
-			// Configure HB input
-			PORTCFG.MPCMASK = (1 << HB_bp);				// Multi-Pin Configuration select input
-			HB_port.PIN0CTRL = PORT_OPC_TOTEM_gc		// Input is not pulled down
-			                 | PORT_ISC_BOTHEDGES_gc;	// Input interrupt on any edge
-			HB_port.INTCTRL = PORT_INTLVL_HI_gc;		// Interrupt will be high level
-			HB_port.INTMASK |= (1 << HB_bp);			// Input interrupt enabled
-			// Configure HSW input
-			PORTCFG.MPCMASK = (1 << HSW_bp);			// Multi-Pin Configuration select input
-			HSW_port.PIN0CTRL = PORT_OPC_TOTEM_gc		// Input is not pulled down
-			                  | PORT_ISC_BOTHEDGES_gc	// Input interrupt on any edge
-							  | (1 << PORT_INVEN_bp);	// Invert this input
-			HSW_port.INTCTRL = PORT_INTLVL_HI_gc;		// Interrupt will be high level
-			HSW_port.INTMASK |= (1 << HSW_bp);			// Input interrupt enabled
-			// Configure SW1 input
-			PORTCFG.MPCMASK = (1 << SW1_bp);			// Multi-Pin Configuration select input
-			SW1_port.PIN0CTRL = PORT_OPC_TOTEM_gc		// Input is not pulled down
-			                  | PORT_ISC_BOTHEDGES_gc	// Input interrupt on any edge
-							  | (1 << PORT_INVEN_bp);	// Invert this input
-			SW1_port.INTCTRL = PORT_INTLVL_HI_gc;		// Interrupt will be high level
-			SW1_port.INTMASK |= (1 << SW1_bp);			// Input interrupt enabled
-			// Configure SW2 input
-			PORTCFG.MPCMASK = (1 << SW2_bp);			// Multi-Pin Configuration select input
-			SW2_port.PIN0CTRL = PORT_OPC_TOTEM_gc		// Input is not pulled down
-			                  | PORT_ISC_BOTHEDGES_gc	// Input interrupt on any edge
-							  | (1 << PORT_INVEN_bp);	// Invert this input
-			SW2_port.INTCTRL = PORT_INTLVL_HI_gc;		// Interrupt will be high level
-			SW2_port.INTMASK |= (1 << SW2_bp);			// Input interrupt enabled
-			// Configure HEN, V1EN and V2EN as totem-pole outputs
-			HEN_port.OUTCLR = (1 << HEN_bp)
-							| (1 << V1EN_bp)
-							| (1 << V2EN_bp);			// All will be low when turned into outputs
-			PORTCFG.MPCMASK = (1 << HEN_bp)
-							| (1 << V1EN_bp)
-							| (1 << V2EN_bp);			// Multi-Pin Configuration select all outputs
-			HEN_port.PIN0CTRL = PORT_OPC_TOTEM_gc;		// All will be totem-pole outputs
-			HEN_port.DIRSET = (1 << HEN_bp)
-							| (1 << V1EN_bp)
-							| (1 << V2EN_bp);			// All are now outputs
-			// Configure HSWLREN, HSWLGEN, HSWLBEN, SWL1EN and SWL2EN as totem-pole outputs
-			HSWLREN_port.OUTCLR = (1 << HSWLREN_bp)
-								| (1 << HSWLGEN_bp)
-								| (1 << HSWLBEN_bp)
-								| (1 << SWL1EN_bp)
-								| (1 << SWL2EN_bp);		// All will be not high when turned into outputs
-			PORTCFG.MPCMASK = (1 << HSWLREN_bp)
-							| (1 << HSWLGEN_bp)
-							| (1 << HSWLBEN_bp)
-							| (1 << SWL1EN_bp)
-							| (1 << SWL2EN_bp);			// Multi-Pin Configuration select all outputs
-			HSWLREN_port.PIN0CTRL = PORT_OPC_TOTEM_gc;	// All will be totem-pole outputs
-			HSWLREN_port.DIRSET = (1 << HSWLREN_bp)
-								| (1 << HSWLGEN_bp)
-								| (1 << HSWLBEN_bp)
-								| (1 << SWL1EN_bp)
-								| (1 << SWL2EN_bp);		// All are now outputs
-			// Configure TCC4 timer
-			TCC4.CTRLB = TC_WGMODE_DSTOP_gc				// Dual Slope Top Update
-					   | TC_CIRCEN_DISABLE_gc			// Circular Buffer disabled
-					   | TC_BYTEM_NORMAL_gc;			// Normal Mode
-			TCC4.CTRLC = (0 << TC4_POLA_bp)				// Non-Invert OC4A output (Not used)
-			           | (1 << TC4_POLB_bp)				// Invert OC4B output (HSWLB_EN)
-			           | (1 << TC4_POLC_bp)				// Invert OC4C output (HSWLG_EN)
-			           | (1 << TC4_POLD_bp);			// Invert OC4D output (HSWLR_EN)
-			TCC4.CTRLE = TC_CCAMODE_DISABLE_gc			// OC4A disabled  (Not used)
-					   | TC_CCBMODE_COMP_gc				// OC4B enabled (HSWLB_EN)
-					   | TC_CCCMODE_COMP_gc				// OC4C enabled (HSWLG_EN)
-					   | TC_CCDMODE_COMP_gc;			// OC4D enabled (HSWLR_EN)
-			TCC4.PERBUF = LED_PWM_PERIOD;				// FREQ = CPU_FREQ / (64 * 2 * LED_PWM_PERIOD)
-			TCC4.PER = LED_PWM_PERIOD;
-			TCC4.CTRLA = TC_CLKSEL_DIV64_gc;			// Clock is main/64 or 2MHz/64 or 31.25kHz
-			// Configure TCC5 timer
-			TCC5.CTRLB = TC_WGMODE_DSTOP_gc				// Dual Slope Top Update
-					   | TC_CIRCEN_DISABLE_gc			// Circular Buffer disabled
-					   | TC_BYTEM_NORMAL_gc;			// Normal Mode
-			TCC5.CTRLC = (1 << TC5_POLA_bp)				// Invert OC5A output (SWL2_EN)
-			           | (1 << TC5_POLB_bp);			// Invert OC5B output (SWL1_EN)
-			TCC5.CTRLE = TC_CCAMODE_COMP_gc				// OC5A enabled (SWL2_EN)
-					   | TC_CCBMODE_COMP_gc;			// OC5B enabled (SWL1_EN)
-			TCC5.PERBUF = LED_PWM_PERIOD;				// FREQ = CPU_FREQ / (64 * 2 * LED_PWM_PERIOD)
-			TCC5.PER = LED_PWM_PERIOD;
-			TCC5.CTRLA = TC_CLKSEL_DIV64_gc;			// Clock is main/64 or 2MHz/64 or 31.25kHz
-			// Configure TCD5 timer
-			TCD5.CTRLB = TC_WGMODE_DSTOP_gc				// Dual Slope Top Update
-					   | TC_CIRCEN_DISABLE_gc			// Circular Buffer disabled
-					   | TC_BYTEM_NORMAL_gc;			// Normal Mode
-			TCD5.CTRLC = (1 << TC5_POLA_bp)				// Invert OC5A output (V1_EN)
-			           | (1 << TC5_POLB_bp);			// Invert OC5D output (V2_EN)
-			TCD5.CTRLE = TC_CCAMODE_COMP_gc				// OC5A enabled (V1_EN)
-					   | TC_CCBMODE_COMP_gc;			// OC5B enabled (V2_EN)
-			TCD5.PERBUF = OUT_PWM_PERIOD;				// FREQ = CPU_FREQ / (64 * 2 * OUT_PWM_PERIOD)
-			TCD5.PER = OUT_PWM_PERIOD;
-			TCD5.CTRLA = TC_CLKSEL_DIV64_gc;			// Clock is main/64 or 2MHz/64 or 31.25kHz
-			// Configure RTC Clock
-			CLK.RTCCTRL = (1 << CLK_RTCEN_bp)			// enable RTC Clock
-						| CLK_RTCSRC_RCOSC32_gc;		// RTC Clock is Internal 32.768 kHz Clock
-			// Configure RTC
-			while (RTC.STATUS & RTC_SYNCBUSY_bm);		// wait for RTC sync ready
-			RTC.PER = 33;								// set RTC overflow to every 1ms (slightly more than)
-			RTC.CTRL = RTC_PRESCALER_DIV1_gc			// RTC prescaler is divide 1
-			         | (0 << RTC_CORREN_bp);			// RTC correction: disabled
-			RTC.INTCTRL = RTC_OVFINTLVL_HI_gc			// Overflow High level interrupt priority
-			            | RTC_COMPINTLVL_OFF_gc;		// Compare interrupt disabled
-			// Enable high level interrupts
-			PMIC.CTRL = 0 << PMIC_RREN_bp				// Round-Robin Priority Enable: disabled
-			          | 0 << PMIC_IVSEL_bp				// Interrupt Vector Select: disabled
-			          | 1 << PMIC_HILVLEN_bp			// High Level Enable: enabled
-					  | 0 << PMIC_MEDLVLEN_bp			// Medium Level Enable: disabled
-					  | 0 << PMIC_LOLVLEN_bp;			// Low Level Enable: disabled
-			// Configure Power Reduction
-			PR.PRGEN = 1 << PR_XCL_bp					// XCL power down: enabled
-					 | 0 << PR_RTC_bp					// RTC power down: disabled
-					 | 1 << PR_EVSYS_bp					// EVSYS power down: enabled
-					 | 1 << PR_EDMA_bp;					// EDMA power down: enabled
-			PR.PRPA = 1 << PR_DAC_bp					// DACA power down: enabled
-					| 1 << PR_ADC_bp					// ADCA power down: enabled
-					| 1 << PR_AC_bp;					// ACA power down: enabled
-			PR.PRPC = 1 << PR_TWI_bp					// TWIC power down: enabled
-					| 1 << PR_USART0_bp					// USART0C power down: enabled
-					| 1 << PR_SPI_bp					// SPIC power down: enabled
-					| 1 << PR_HIRES_bp					// HIRESC power down: enabled
-					| 0 << PR_TC5_bp					// TCC5 power down: disabled
-					| 0 << PR_TC4_bp;					// TCC4 power down: disabled
-			PR.PRPD = 1 << PR_USART0_bp					// USART0D power down: enabled
-					| 0 << PR_TC5_bp;					// TCD5 power down: disabled
-			ign_cur = IGN_port.IN & (1 << IGN_bp);		// Get current state of Ignition Input
-			rev_cur = REV_port.IN & (1 << REV_bp);		// Get current state of Reverse Input
-			power_state = SM_POWER_DOWN;				// Goto to Power Down State
-			wdt_enable(WATCHDOG_TO);					// Enable the Watchdog timer
-			sei();										// Enable global interrupts
-			continue;									// Restart the main forever loop
-		}
-		
-		// Programming State Machine
-		//   Looks for programming state based on SW1 and SW2 inputs
-		switch (prog_state)
-		{
-		case SM_PROG_ACTIVATE:							// Program Activate State
-			if (!ign_cur || !sw1_cur || !sw2_cur)
-			{
-				// Either Ignition, Switch 1 or Switch 2 deactivated  
-				prog_state = SM_PROG_RESET;				// Goto Program Reset State
-			} 
+			}
 			else
 			{
-				// Ignition, Switch 1 and Switch 2 still active
-				cli();									// prevent interrupts from corrupting non-atomic instructions
-				if (prog_ms >= PROG_ACTIVATE_SECONDS * 1000)
+				// Nothing to do until the delay expires, the next battery meter update or an input changes
+				next = deadline_remaining(delay_deadline);
+				if (next > BATTERY_POLL_MS)
 				{
-					// Ignition, Switch 1 and Switch 2 active long enough to activate programming sequence
-					prog_ms = 0;						// Reset program millisecond counter
-					prog_count = 0;						// Start with Outputs will NOT turn on when ignition is OFF
-					swl12_set(SW12_LED, LED_FLASH);		// Flash LEDs when in programming mode
-					prog_state = SM_PROG_WAIT;			// Goto Program wait for SW1 and SW2 to deactivate State
+					next = BATTERY_POLL_MS;
 				}
-				sei();
 			}
-			break;
-		case SM_PROG_WAIT:								// Program wait for SW1 and SW2 to deactivate State
-			if (!ign_cur)
-			{
-				// Ignition turned OFF
-				prog_state = SM_PROG_RESET;				// Goto Program Reset State
-				sw1_toggle = TOGGLE_OFF;				// SW1 toggle forced off when exiting from Programming Mode
-				sw2_toggle = TOGGLE_OFF;				// SW2 toggle forced off when exiting from Programming Mode
-			}
-			else if (!sw1_cur && !sw2_cur)
-			{
-				// SW1 and SW2 deactivated
-				prog_state = SM_PROG_ON_WAIT;			// Goto Program Wait for Switch ON
-			}
-			break;
-		case SM_PROG_ON_WAIT:							// Program Wait for Switch ON State
-			if (!ign_cur)
-			{
-				// Ignition turned OFF
-				prog_state = SM_PROG_RESET;				// Goto Program Reset State
-				sw1_toggle = TOGGLE_OFF;				// SW1 toggle forced off when exiting from Programming Mode
-				sw2_toggle = TOGGLE_OFF;				// SW2 toggle forced off when exiting from Programming Mode
-			} 
-			else if (sw1_cur || sw2_cur)
-			{
-				// SW1 or SW2 turned ON
-				prog_count++;							// Add one to the number of minutes to stay on when ignition is off
-				prog_state = SM_PROG_OFF_WAIT;			// Goto Program Wait for Switch OFF State
-				swl12_set(SW12_LED, LED_ON);			// Turn LEDs on
-			}
-			else if (prog_ms >= (PROG_ACTIVATE_SECONDS * 1000 / 2))
+		} 
+		break;
+	default:
+		// Anything else is considered to SM_POWER_RESET
+		cli();											// Disable interrupts
+		hal_init();										// Initialize clocks, IOs, timers and interrupts
+		in_state = hal_inputs();						// Get current state of all inputs
+		inputs = in_state;								// Following changes arrive as input events
+		power_state = SM_POWER_DOWN;					// Goto to Power Down State
+		wdt_enable(WATCHDOG_TO);						// Enable the Watchdog timer
+		sei();											// Enable global interrupts
+		break;
+	}
+	if (power_state != state)
+	{
+		if ((power_state == SM_POWER_DOWN) && (state != SM_POWER_RESET))
+		{
+			stats_flush();								// Powering down, save the usage statistics
+		}
+		// Programming, Outputs and Indicators follow the power state
+		task_signal(TASK_bm(TASK_HORN) | TASK_bm(TASK_PROG) | TASK_bm(TASK_OUTPUT) | TASK_bm(TASK_ANIMATE)
+		 | TASK_bm(TASK_TELEMETRY));
+		next = 0;										// New state is checked on the next pass
+	}
+	else if (((sw1_toggle << 4) | sw2_toggle) != toggles)
+	{
+		// Outputs follow the switch toggles
+		task_signal(TASK_bm(TASK_OUTPUT));
+	}
+	return next;
+}
+
+/*
+ * Gesture Task
+ *  Reports a long press once an input with gestures is held for GESTURE_LONG_MS. It is not reported while
+ *   another input with gestures is also pressed (both switches are held to start programming).
+ *  Returns the number of milliseconds until the next long press can complete or TASK_WAIT.
+ */
+uint32_t gesture_task(void)
+{
+	uint16_t now = uptime();
+	uint16_t held;
+	uint32_t next = TASK_WAIT;
+	gesture_t *g = gesture;
+	
+	for (uint8_t bm = 1; bm; bm <<= 1)
+	{
+		if (IN_GESTURE_gm & bm)
+		{
+			if (gesture_held & bm)
 			{
-				// Programming mode timeout
-				//  Delay can't be longer than 20 minutes
-				if (prog_count > 20)
+				held = now - g->pressed;
+				if (held >= GESTURE_LONG_MS)
+				{
+					gesture_held &= ~bm;
+					gesture_tap &= ~bm;
+					if (!(inputs & IN_GESTURE_gm & ~bm))
+					{
+						gesture_long |= bm;
+						task_signal(TASK_bm(TASK_OUTPUT));
+					}
+				}
+				else if (GESTURE_LONG_MS - held < next)
 				{
-					prog_count = 20;
+					next = GESTURE_LONG_MS - held;
 				}
-				swl12_set(SW12_LED, LED_OFF);			// Turn LEDs off
-				//  Update delay time in RAM
-				delay_time_ms = prog_count * 60ul * 1000ul;
-				cli();									// prevent interrupts from corrupting non-atomic instructions
-				wdt_disable();							// Disable Watchdog timer before programming EEPROM
-				//  Write the delay time in milliseconds to EEPROM
-				eeprom_write_dword(&eeprom_delay_time_ms, delay_time_ms);
-				wdt_enable(WATCHDOG_TO);
-				led_ms = 0;								// reset LED millisecond counter
-				sei();
-				prog_led = OFF;							// start with LED off
-				prog_state = SM_PROG_DISPLAY_DWELL;		// Goto Program Display New ON Time
 			}
-			break;
-		case SM_PROG_OFF_WAIT:							// Program Wait for Switch OFF State
-			if (!ign_cur)
+			g++;
+		}
+	}
+	return next;
+}
+
+/*
+ * Update the Horn pattern heat for the time since the last update
+ *  On-time heats by 100 - HORN_PATTERN_DUTY per millisecond and off-time cools by HORN_PATTERN_DUTY per
+ *   millisecond, the heat stays level at the duty cycle limit.
+ */
+static void horn_heat_update(uint8_t on)
+{
+	uint32_t now = uptime();
+	uint32_t ms = now - horn_heat_time;
+	
+	horn_heat_time = now;
+	if (ms > 0xFFFF)
+	{
+		ms = 0xFFFF;									// Long enough to cool down completely
+	}
+	if (on)
+	{
+		horn_heat += ms * (100 - HORN_PATTERN_DUTY);
+	}
+	else
+	{
+		horn_heat = (horn_heat > ms * HORN_PATTERN_DUTY) ? horn_heat - ms * HORN_PATTERN_DUTY : 0;
+	}
+}
+
+/*
+ * Return the number of milliseconds until the Horn has cooled down enough to play a whole pattern (0 when ready)
+ */
+static uint32_t horn_cooldown(const uint16_t *step)
+{
+	uint32_t heat = horn_heat;
+	uint32_t limit = HORN_PATTERN_BURST_MS * (100ul - HORN_PATTERN_DUTY);
+	uint16_t on;
+	
+	while ((on = pgm_read_word(step)) != 0)
+	{
+		heat += (uint32_t) on * (100 - HORN_PATTERN_DUTY);
+		step += 2;
+	}
+	return (heat > limit) ? (heat - limit) / HORN_PATTERN_DUTY + 1 : 0;
+}
+
+/*
+ * Stop the Horn pattern
+ *  The Horn is left on when the Horn Switch took over.
+ */
+static void horn_pattern_stop(uint8_t manual)
+{
+	if (horn_state == HORN_ON)
+	{
+		horn_heat_update(TRUE);
+	}
+	if (!manual)
+	{
+		horn_off();
+	}
+	horn_pattern = HORN_PATTERN_NONE;
+	task_signal(TASK_bm(TASK_OUTPUT) | TASK_bm(TASK_ANIMATE));	// Outputs and the rainbow come back
+}
+
+/*
+ * Horn Task
+ *  Plays a chirp when Ignition turns on and a double chirp when it turns off (CONFIG_FLAG_CHIRP) and the
+ *   panic pattern after a double press of the Horn Switch. Pressing the Horn Switch stops a pattern and honks
+ *   as usual, the panic pattern also stops when Ignition turns off.
+ *  Every step is a deadline so main sleeps in between. V1 and V2 fold back HORN_SEQ_MS before the off step
+ *   ends so the Horn turns on right at the end of it. A pattern only (re)starts once the Horn has cooled down
+ *   to HORN_PATTERN_DUTY.
+ *  Returns the number of milliseconds until the next step or TASK_WAIT when no pattern is playing.
+ */
+uint32_t horn_task(void)
+{
+	uint8_t manual = (power_state == SM_POWER_ON_IGN) && (inputs & IN_HSW_bm);
+	uint8_t start = HORN_PATTERN_NONE;
+	const uint16_t *first;
+	uint16_t ms;
+	uint32_t next;
+	
+	// See if a pattern starts
+	if (power_state != horn_power)
+	{
+		if (config.flags & CONFIG_FLAG_CHIRP)
+		{
+			if (power_state == SM_POWER_ON_IGN)
+			{
+				start = HORN_PATTERN_CHIRP;				// Ignition turned on
+			}
+			else if (horn_power == SM_POWER_ON_IGN)
 			{
-				// Ignition turned OFF or 0 delay time
-				prog_state = SM_PROG_RESET;				// Goto Program Reset State
-				sw1_toggle = TOGGLE_OFF;				// SW1 toggle forced off when exiting from Programming Mode
-				sw2_toggle = TOGGLE_OFF;				// SW2 toggle forced off when exiting from Programming Mode
+				start = HORN_PATTERN_DOUBLE_CHIRP;		// Ignition turned off
 			}
-			else if (!sw1_cur && !sw2_cur)
+		}
+		horn_power = power_state;
+	}
+	else if ((power_state == SM_POWER_ON_IGN) && (gesture_double & IN_HSW_bm))
+	{
+		start = HORN_PATTERN_PANIC;
+	}
+	if (horn_pattern && (manual || start || ((horn_pattern == HORN_PATTERN_PANIC) && (power_state != SM_POWER_ON_IGN))))
+	{
+		horn_pattern_stop(manual);
+	}
+	if (start && !manual)
+	{
+		horn_off();										// Patterns start from off
+		horn_pattern = start;
+		horn_step = pgm_read_ptr(&horn_patterns[start]);
+		deadline_start(&horn_step_deadline, 0);		// First step starts now
+		log_event(LOG_HORN, start);
+		stats.horn_count = stats_add(stats.horn_count, 1);
+	}
+	if (!horn_pattern)
+	{
+		return TASK_WAIT;
+	}
+	
+	// Play the pattern
+	if (horn_state == HORN_STARTING)
+	{
+		// V1 and V2 are being folded back
+		next = horn_on();
+		if (horn_state != HORN_ON)
+		{
+			return next;
+		}
+		// Horn turned on, the on step starts now
+		horn_heat_update(FALSE);
+		ms = pgm_read_word(horn_step);
+		deadline_start(&horn_step_deadline, ms);
+		return ms;
+	}
+	if (!deadline_expired(horn_step_deadline))
+	{
+		return deadline_remaining(horn_step_deadline);
+	}
+	if (horn_state == HORN_ON)
+	{
+		// On step done, the off step ends HORN_SEQ_MS early to fold back V1 and V2 for the next on step
+		horn_off();
+		horn_heat_update(TRUE);
+		ms = pgm_read_word(horn_step + 1);
+		horn_step += 2;
+		ms = (ms > HORN_SEQ_MS) ? ms - HORN_SEQ_MS : 0;
+		deadline_start(&horn_step_deadline, ms);
+		return ms;
+	}
+	// Off step done
+	first = pgm_read_ptr(&horn_patterns[horn_pattern]);
+	if (pgm_read_word(horn_step) == 0)
+	{
+		if (pgm_read_word(horn_step + 1) == 0)
+		{
+			horn_pattern_stop(FALSE);					// HORN_END
+			return TASK_WAIT;
+		}
+		horn_step = first;								// HORN_REPEAT
+	}
+	if (horn_step == first)
+	{
+		horn_heat_update(FALSE);
+		next = horn_cooldown(first);
+		if (next)
+		{
+			deadline_start(&horn_step_deadline, next);	// Too hot for another run
+			return next;
+		}
+	}
+	return horn_on();									// Fold back V1 and V2, the Horn turns on next
+}
+
+/*
+ * Step an output brightness level down to the next level, the lowest level wraps around to full brightness
+ */
+static inline uint8_t dim_next(uint8_t level)
+{
+	return (level < DIM_LEVEL_STEP * 2) ? 255 : level - DIM_LEVEL_STEP;
+}
+
+/*
+ * Programming Task (Programming State Machine)
+ *  Looks for programming state based on SW1 and SW2 inputs
+ *  Returns the number of milliseconds until it needs to run again or TASK_WAIT.
+ */
+uint32_t prog_task(void)
+{
+	uint8_t state = prog_state;
+	
+	switch (prog_state)
+	{
+	case SM_PROG_ACTIVATE:								// Program Activate State
+		if ((inputs & (IN_IGN_bm | IN_SW1_bm | IN_SW2_bm)) != (IN_IGN_bm | IN_SW1_bm | IN_SW2_bm))
+		{
+			// Either Ignition, Switch 1 or Switch 2 deactivated  
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+		} 
+		else
+		{
+			// Ignition, Switch 1 and Switch 2 still active
+			if (deadline_expired(prog_deadline))
 			{
-				// SW1 and SW2 are both OFF
-				prog_state = SM_PROG_ON_WAIT;			// Goto Program Wait for Switch ON State
-				swl12_set(SW12_LED, LED_FLASH);			// back to Flash LEDs
-				cli();									// prevent interrupts from corrupting non-atomic instructions
-				prog_ms = 0;							// reset program millisecond counter
-				sei();
+				// Ignition, Switch 1 and Switch 2 active long enough to activate programming sequence
+				deadline_start(&prog_deadline, PROG_DIM_ACTIVATE_SECONDS * 1000);
+				prog_count = 0;							// Start with Outputs will NOT turn on when ignition is OFF
+				swl12_set(SW12_LED, LED_FLASH);			// Flash LEDs when in programming mode
+				prog_state = SM_PROG_WAIT;				// Goto Program wait for SW1 and SW2 to deactivate State
 			}
-			break;
-		case SM_PROG_DISPLAY_DWELL:						// Display new Delay On Time, Initial Dwell State
-			if (!ign_cur || delay_time_ms == 0)
+		}
+		break;
+	case SM_PROG_WAIT:									// Program wait for SW1 and SW2 to deactivate State
+		if (!(inputs & IN_IGN_bm))
+		{
+			// Ignition turned OFF
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when exiting from Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when exiting from Programming Mode
+		}
+		else if (!(inputs & (IN_SW1_bm | IN_SW2_bm)))
+		{
+			// SW1 and SW2 deactivated
+			deadline_start(&prog_deadline, PROG_ACTIVATE_SECONDS * 1000 / 2);
+			prog_state = SM_PROG_ON_WAIT;				// Goto Program Wait for Switch ON
+		}
+		else if (((inputs & (IN_SW1_bm | IN_SW2_bm)) == (IN_SW1_bm | IN_SW2_bm)) && deadline_expired(prog_deadline))
+		{
+			// SW1 and SW2 active long enough to activate dimming programming sequence
+			swl12_set(SW12_LED, LED_ON);				// Steady LEDs when in dimming programming mode
+			prog_state = SM_PROG_DIM_WAIT;				// Goto Program Dimming wait for SW1 and SW2 to deactivate State
+		}
+		break;
+	case SM_PROG_DIM_WAIT:								// Program Dimming wait for SW1 and SW2 to deactivate State
+		if (!(inputs & IN_IGN_bm))
+		{
+			// Ignition turned OFF
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when exiting from Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when exiting from Programming Mode
+		}
+		else if (!(inputs & (IN_SW1_bm | IN_SW2_bm)))
+		{
+			// SW1 and SW2 deactivated
+			deadline_start(&prog_deadline, PROG_ACTIVATE_SECONDS * 1000 / 2);
+			v1_on();									// Show the current brightness levels
+			v2_on();
+			prog_state = SM_PROG_DIM_ON_WAIT;			// Goto Program Dimming Wait for Switch ON
+		}
+		break;
+	case SM_PROG_DIM_ON_WAIT:							// Program Dimming Wait for Switch ON State
+		if (!(inputs & IN_IGN_bm))
+		{
+			// Ignition turned OFF, new levels are not saved
+			v1_level = config.v1_level;
+			v2_level = config.v2_level;
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when exiting from Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when exiting from Programming Mode
+		}
+		else if (inputs & (IN_SW1_bm | IN_SW2_bm))
+		{
+			// SW1 or SW2 turned ON, step its output to the next brightness level
+			if (inputs & IN_SW1_bm)
 			{
-				// Ignition turned OFF
-				prog_state = SM_PROG_RESET;				// Goto Program Reset State
-				sw1_toggle = TOGGLE_OFF;				// SW1 toggle forced off when exiting from Programming Mode
-				sw2_toggle = TOGGLE_OFF;				// SW2 toggle forced off when exiting from Programming Mode
+				v1_level = dim_next(v1_level);
+				v1_on();								// Show the new brightness level
+				swl12_set(SW1_LED, LED_OFF);			// Turn LED off while pressed
 			}
-			else if (led_ms >= 1000)
+			if (inputs & IN_SW2_bm)
 			{
-				// Initial dwell with LEDS off has expired
-				prog_state = SM_PROG_DISPLAY;			// Goto Display new Delay On Time, LED Toggle State
-				cli();									// prevent interrupts from corrupting non-atomic instructions
-				led_ms = 0;								// reset LED millisecond counter
-				sei();
+				v2_level = dim_next(v2_level);
+				v2_on();								// Show the new brightness level
+				swl12_set(SW2_LED, LED_OFF);			// Turn LED off while pressed
 			}
-			break;
-		case SM_PROG_DISPLAY:							// Display new Delay On Time, LED Off State
-			if (!ign_cur)
+			prog_state = SM_PROG_DIM_OFF_WAIT;			// Goto Program Dimming Wait for Switch OFF State
+		}
+		else if (deadline_expired(prog_deadline))
+		{
+			// Dimming programming mode timeout, save the new levels
+			config_save();
+			swl12_set(SW12_LED, LED_OFF);				// Turn LEDs off
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when exiting from Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when exiting from Programming Mode
+		}
+		break;
+	case SM_PROG_DIM_OFF_WAIT:							// Program Dimming Wait for Switch OFF State
+		if (!(inputs & IN_IGN_bm))
+		{
+			// Ignition turned OFF, new levels are not saved
+			v1_level = config.v1_level;
+			v2_level = config.v2_level;
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when exiting from Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when exiting from Programming Mode
+		}
+		else if (!(inputs & (IN_SW1_bm | IN_SW2_bm)))
+		{
+			// SW1 and SW2 are both OFF
+			swl12_set(SW12_LED, LED_ON);				// back to steady LEDs
+			deadline_start(&prog_deadline, PROG_ACTIVATE_SECONDS * 1000 / 2);
+			prog_state = SM_PROG_DIM_ON_WAIT;			// Goto Program Dimming Wait for Switch ON State
+		}
+		break;
+	case SM_PROG_ON_WAIT:								// Program Wait for Switch ON State
+		if (!(inputs & IN_IGN_bm))
+		{
+			// Ignition turned OFF
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when exiting from Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when exiting from Programming Mode
+		} 
+		else if (inputs & (IN_SW1_bm | IN_SW2_bm))
+		{
+			// SW1 or SW2 turned ON
+			prog_count++;								// Add one to the number of minutes to stay on when ignition is off
+			prog_state = SM_PROG_OFF_WAIT;				// Goto Program Wait for Switch OFF State
+			swl12_set(SW12_LED, LED_ON);				// Turn LEDs on
+		}
+		else if (deadline_expired(prog_deadline))
+		{
+			// Programming mode timeout
+			//  Delay can't be longer than 20 minutes
+			if (prog_count > 20)
 			{
-				// Ignition turned OFF
-				prog_state = SM_PROG_RESET;				// Goto Program Reset State
-				sw1_toggle = TOGGLE_OFF;				// SW1 toggle forced off when exiting from Programming Mode
-				sw2_toggle = TOGGLE_OFF;				// SW2 toggle forced off when exiting from Programming Mode
+				prog_count = 20;
 			}
-			else if (led_ms >= LED_FLASH_TIME)
+			swl12_set(SW12_LED, LED_OFF);				// Turn LEDs off
+			//  Update delay time in RAM
+			delay_time_ms = prog_count * 60ul * 1000ul;
+			//  Write the delay time in milliseconds to EEPROM
+			config_save();
+			deadline_start(&led_deadline, 1000);		// LEDs stay off for 1 second
+			prog_led = OFF;								// start with LED off
+			prog_state = SM_PROG_DISPLAY_DWELL;			// Goto Program Display New ON Time
+		}
+		break;
+	case SM_PROG_OFF_WAIT:								// Program Wait for Switch OFF State
+		if (!(inputs & IN_IGN_bm))
+		{
+			// Ignition turned OFF or 0 delay time
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when exiting from Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when exiting from Programming Mode
+		}
+		else if (!(inputs & (IN_SW1_bm | IN_SW2_bm)))
+		{
+			// SW1 and SW2 are both OFF
+			prog_state = SM_PROG_ON_WAIT;				// Goto Program Wait for Switch ON State
+			swl12_set(SW12_LED, LED_FLASH);				// back to Flash LEDs
+			deadline_start(&prog_deadline, PROG_ACTIVATE_SECONDS * 1000 / 2);
+		}
+		break;
+	case SM_PROG_DISPLAY_DWELL:							// Display new Delay On Time, Initial Dwell State
+		if (!(inputs & IN_IGN_bm) || delay_time_ms == 0)
+		{
+			// Ignition turned OFF
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when exiting from Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when exiting from Programming Mode
+		}
+		else if (deadline_expired(led_deadline))
+		{
+			// Initial dwell with LEDS off has expired
+			prog_state = SM_PROG_DISPLAY;				// Goto Display new Delay On Time, LED Toggle State
+			deadline_start(&led_deadline, LED_FLASH_TIME);
+		}
+		break;
+	case SM_PROG_DISPLAY:								// Display new Delay On Time, LED Off State
+		if (!(inputs & IN_IGN_bm))
+		{
+			// Ignition turned OFF
+			prog_state = SM_PROG_RESET;					// Goto Program Reset State
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when exiting from Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when exiting from Programming Mode
+		}
+		else if (deadline_expired(led_deadline))
+		{
+			deadline_start(&led_deadline, LED_FLASH_TIME);
+			if (prog_led)
 			{
-				cli();									// prevent interrupts from corrupting non-atomic instructions
-				led_ms = 0;								// reset LED millisecond counter
-				sei();
-				if (prog_led)
+				// LED is turning off which completes a single count display
+				if (--prog_count == 0)
 				{
-					// LED is turning off which completes a single count display
-					if (--prog_count == 0)
-					{
-						// no more flashes needed
-						prog_state = SM_PROG_RESET;		// Goto Program Reset State
-						sw1_toggle = TOGGLE_OFF;		// SW1 toggle forced off when exiting from Programming Mode
-						sw2_toggle = TOGGLE_OFF;		// SW2 toggle forced off when exiting from Programming Mode
-					}
+					// no more flashes needed
+					prog_state = SM_PROG_RESET;			// Goto Program Reset State
+					sw1_toggle = TOGGLE_OFF;			// SW1 toggle forced off when exiting from Programming Mode
+					sw2_toggle = TOGGLE_OFF;			// SW2 toggle forced off when exiting from Programming Mode
 				}
-				prog_led = !prog_led;					// toggle LED state
-			}
-			prog_led ? swl12_set(SW12_LED, LED_ON) : swl12_set(SW12_LED, LED_OFF);	// Set LEDs to correct state
-			break;
-		default:										// Program Reset State
-			if (ign_cur && sw1_cur && sw2_cur)
-			{
-				// Ignition, Switch 1 and Switch 2 are simultaneously active
-				cli();									// prevent interrupts from corrupting non-atomic instructions
-				prog_ms = 0;							// reset program millisecond counter
-				sei();								
-				sw1_toggle = TOGGLE_OFF;				// SW1 toggle forced off when entering Programming Mode
-				sw2_toggle = TOGGLE_OFF;				// SW2 toggle forced off when entering Programming Mode
-				swl12_set(SW12_LED, LED_OFF);			// Turn off Switch 1 and 2 Indicator LEDs
-				v12_off();								// Outputs turned off when in programming mode
-				prog_state = SM_PROG_ACTIVATE;			// Goto Program Activate State
-			}
-			else
-			{
-				// LEDs and Outputs operate normally when not in programming mode and horn not one
-				if (!hsw_cur)
-				{
-					if (sw1_toggle)
-					{
-						if (sw1_toggle == TOGGLE_ON_USER)
-						{
-							// User requested Toggle ON
-							swl12_set(SW1_LED, LED_ON);
-						}
-						else
-						{
-							// Automatic requested Toggle ON
-							swl12_set(SW1_LED, LED_BREATHE);
-						}
-						v1_on();
-					}
-					else
-					{
-						swl12_set(SW1_LED, LED_OFF);
-						v1_off();
-					}
-					if (sw2_toggle)
-					{
-						if (sw2_toggle == TOGGLE_ON_USER)
-						{
-							// User requested Toggle ON
-							swl12_set(SW2_LED, LED_ON);
-						}
-						else
-						{
-							// Automatic requested Toggle ON
-							swl12_set(SW2_LED, LED_BREATHE);
-						}
-						v2_on();
-					}
-					else
-					{
-						swl12_set(SW2_LED, LED_OFF);
-						v2_off();
-					}
-				}			
 			}
-			break;
+			prog_led = !prog_led;						// toggle LED state
 		}
-    }
+		prog_led ? swl12_set(SW12_LED, LED_ON) : swl12_set(SW12_LED, LED_OFF);	// Set LEDs to correct state
+		break;
+	default:											// Program Reset State
+		if ((inputs & (IN_IGN_bm | IN_SW1_bm | IN_SW2_bm)) == (IN_IGN_bm | IN_SW1_bm | IN_SW2_bm))
+		{
+			// Ignition, Switch 1 and Switch 2 are simultaneously active
+			deadline_start(&prog_deadline, PROG_ACTIVATE_SECONDS * 1000);
+			sw1_toggle = TOGGLE_OFF;					// SW1 toggle forced off when entering Programming Mode
+			sw2_toggle = TOGGLE_OFF;					// SW2 toggle forced off when entering Programming Mode
+			swl12_set(SW12_LED, LED_OFF);				// Turn off Switch 1 and 2 Indicator LEDs
+			v12_off();									// Outputs turned off when in programming mode
+			prog_state = SM_PROG_ACTIVATE;				// Goto Program Activate State
+		}
+		break;
+	}
+	if (prog_state != state)
+	{
+		// Outputs and Switch LED Indicators are only controlled by the Output Task when not programming
+		task_signal(TASK_bm(TASK_OUTPUT));
+	}
+	return (prog_state == SM_PROG_RESET) ? TASK_WAIT : PROG_POLL_MS;
 }
 
-/* 
- * RTC Overflow interrupt.
- *  RTC is configured to overflow every millisecond.
- *  Update delay counters and tick count
- *  Use tick count to handle debouncing inputs
+/*
+ * Set a new output ramp target, an output turning on from off starts OUT_STAGGER_MS after the last one
+ *  Spreads the inrush currents of V1 and V2 when both turn on at once (ignition on). The next output only
+ *   waits longer when this one really turned on from off.
  */
-ISR(RTC_OVF_vect)
+static inline void out_ramp_stagger(volatile out_ramp_t *ramp, uint16_t target)
 {
-	static uint8_t rainbow_ms = 0;						// number of milliseconds before incrementing rainbow_cnt
-	static uint8_t rainbow_cnt = 85;					// used to count through sine wave for Horn RGM LED rainbow
-	static uint8_t breathe_ms = 0;						// number of milliseconds before incrementing breathe_cnt
-	static uint8_t breathe_cnt = 0;						// used to count through sine wave for LED breathing
+	uint8_t off = !ramp->target;						// Not already turning on
+	uint32_t ms = off ? deadline_remaining(out_stagger_deadline) : 0;
 	
-	tick_ms++;											// increment tick millisecond counter
-	delay_ms++;											// Increment delay milliseconds
-	prog_ms++;											// increment program milliseconds counter
-	led_ms++;											// increment LED milliseconds counter
+	if (out_ramp_to(ramp, target, tick_count(ms)) && off)
+	{
+		deadline_start(&out_stagger_deadline, ms + OUT_STAGGER_MS);
+	}
+}
+
+/*
+ * Apply the desired Outputs and Switch LED Indicators
+ *  Only what differs from the current channel state is touched, so an unchanged pass never disables interrupts.
+ */
+static inline void out_apply(const out_state_t *want)
+{
+	if (led_fx[CH_SWL1].effect != want->led[0])
+	{
+		swl12_set(SW1_LED, want->led[0]);
+	}
+	if (led_fx[CH_SWL2].effect != want->led[1])
+	{
+		swl12_set(SW2_LED, want->led[1]);
+	}
+	if (v1_ramp.target != want->target[0])
+	{
+		out_ramp_stagger(&v1_ramp, want->target[0]);
+	}
+	if (v2_ramp.target != want->target[1])
+	{
+		out_ramp_stagger(&v2_ramp, want->target[1]);
+	}
+}
+
+/*
+ * Output Task
+ *  Controls the Outputs and Switch LED Indicators from the switch toggles when not programming and the
+ *   horn is not on. Outputs are kept off while powered down.
+ *  Switch LEDs flash while the battery meter has dimmed or shed the outputs.
+ *  A long press of a switch that turned its output on steps the output brightness level (saved to EEPROM).
+ *  Returns TASK_WAIT, runs on input edges and signals.
+ */
+uint32_t output_task(void)
+{
+	uint8_t on = (power_state == SM_POWER_ON_IGN) || ((power_state == SM_POWER_ON_SW) && (batt_state != BATT_SHED));
+	out_state_t want = { { LED_OFF, LED_OFF }, { 0, 0 } };
+	uint8_t fast;										// Switches whose press turns their output on at once
+	uint8_t v1 = v1_level;								// Brightness levels before a long press
+	uint8_t v2 = v2_level;
 	
-	// Handle Horn Switch RGB LED Indicator rainbow
-	if (ign_cur)
+	if ((prog_state != SM_PROG_RESET) || (inputs & IN_HSW_bm) || horn_pattern)
+	{
+		out_fast = 0;
+		return TASK_WAIT;								// Programming mode or the horn own the outputs
+	}
+	// A long press of a switch that turned its output on steps the output to its next brightness level
+	if (on && (gesture_long & (IN_SW1_bm | IN_SW2_bm)))
 	{
-		if (hsw_cur)
+		if ((gesture_long & IN_SW1_bm) && sw1_toggle)
+		{
+			v1_level = dim_next(v1_level);
+		}
+		if ((gesture_long & IN_SW2_bm) && sw2_toggle)
 		{
-			// Horn is currently on
-			rainbow_ms = 64;
-			rainbow_cnt = 0;
+			v2_level = dim_next(v2_level);
 		}
-		else if (rainbow_ms++ >= 64)
+		if ((v1_level != v1) || (v2_level != v2))
 		{
-			rainbow_ms = 0;
- 			hswl_rgb(rainbow_cnt++);
+			config_save();								// A long press of a switch that is off changes nothing
 		}
 	}
-	else
+	// LEDs and Outputs operate normally when not in programming mode and horn not on
+	if (on && sw1_toggle)
 	{
-		rainbow_ms = 0;
-		rainbow_cnt = 85;
+		// User requested Toggle ON is lit, automatic requested Toggle ON breathes
+		want.led[0] = (sw1_toggle == TOGGLE_ON_USER) ? LED_ON : LED_BREATHE;
+		want.target[0] = (uint16_t) v1_level << 8;		// V1 ramps to its brightness level
+	}
+	if (on && sw2_toggle)
+	{
+		want.led[1] = (sw2_toggle == TOGGLE_ON_USER) ? LED_ON : LED_BREATHE;
+		want.target[1] = (uint16_t) v2_level << 8;		// V2 ramps to its brightness level
+	}
+	if ((power_state == SM_POWER_ON_SW) && (batt_state != BATT_OK) && (sw1_toggle || sw2_toggle))
+	{
+		// Both Switch LEDs flash while the outputs are dimmed or shed to save the battery
+		want.led[0] = LED_FLASH;
+		want.led[1] = LED_FLASH;
+	}
+	out_apply(&want);
+#if OUT_PWM_FAST_CLOCK
+	if (!clock_fast && (v1_ramp.target || v2_ramp.target))
+	{
+		// A switch press turned its output on from the input change interrupt
+		cli();											// prevent interrupts from corrupting non-atomic instructions
+		hal_clock_fast(TRUE);							// Output PWM needs the 32MHz clock
+		sei();
+	}
+#endif
+	// A press of a switch whose toggle is off turns its output on when outputs are allowed
+	fast = 0;
+	if ((power_state == SM_POWER_ON_IGN)
+	 || ((delay_time_ms != 0) && (batt_state != BATT_SHED) && (power_state != SM_POWER_RESET)))
+	{
+		fast = (sw1_toggle ? 0 : IN_SW1_bm) | (sw2_toggle ? 0 : IN_SW2_bm);
+	}
+	out_fast = fast;
+	return TASK_WAIT;
+}
+
+/*
+ * Indicator Animation Task
+ *  Steps the Horn Switch RGB LED rainbow while Ignition is on and all LED indicator breathing and flashing.
+ *  Sets the LED indicator gain, dimmed at night (the High Beam was on within LED_NIGHT_HOLD_MS) and further
+ *   during the key-off delay.
+ *  Returns the number of milliseconds until the next step or TASK_WAIT when nothing is animated.
+ */
+uint32_t animate_task(void)
+{
+	static uint8_t night = FALSE;						// High Beam was on recently
+	static deadline_t night_deadline;					// Night ends once the High Beam was off this long
+	static uint8_t rainbow_cnt = 85;					// used to count through sine wave for Horn RGM LED rainbow
+	static deadline_t rainbow_deadline;					// next rainbow step
+	static uint8_t fx_animated = FALSE;					// LED indicator channels were being animated
+	static deadline_t fx_deadline;						// next LED effect step
+	uint32_t ms;
+	uint32_t next = TASK_WAIT;
+	uint16_t gain = LED_GAIN_FULL;
+	
+	// Handle LED indicator brightness
+	if (inputs & IN_HB_bm)
+	{
+		night = TRUE;
+		deadline_start(&night_deadline, LED_NIGHT_HOLD_MS);
 	}
-	// Handle Switch 1 and LED Indicator breathing
-	if (breathe_ms++ >= 8)
+	else if (night)
 	{
-		breathe_ms = 0;
-		if ((sw1_led_state != LED_BREATHE) && (sw2_led_state != LED_BREATHE))
+		if (deadline_expired(night_deadline))
 		{
-			breathe_cnt = 64;							// No LEDs are breathing
-														// set to peak sine value
+			night = FALSE;
 		}
 		else
 		{
-			breathe_cnt++;								// At least one LED is breathing
-			if (sw1_led_state == LED_BREATHE)
-			{
-				TCC5.CCBBUF = get_sine(breathe_cnt);	// OC5B set to next duty cycle
-			}
-			if (sw2_led_state == LED_BREATHE)
-			{
-				TCC5.CCABUF = get_sine(breathe_cnt);	// OC5A set to next duty cycle
-			}
+			next = deadline_remaining(night_deadline);	// Back to full brightness then
 		}
 	}
-	
-	// Handle all input debouncing
-	if (hsw_db)
+	if (night)
+	{
+		gain = LED_GAIN_NIGHT;
+	}
+	if ((power_state == SM_POWER_ON_SW) && (gain > LED_GAIN_DELAY))
+	{
+		gain = LED_GAIN_DELAY;
+	}
+	led_gain_set(gain);
+	// Handle Horn Switch RGB LED Indicator rainbow
+	if (!(inputs & IN_IGN_bm))
+	{
+		rainbow_cnt = 85;
+		deadline_start(&rainbow_deadline, RAINBOW_STEP_MS);
+	}
+	else if ((inputs & IN_HSW_bm) || horn_pattern)
+	{
+		// Horn is currently on, restart the rainbow as soon as it is released or the pattern ends
+		rainbow_cnt = 0;
+		deadline_start(&rainbow_deadline, 0);
+	}
+	else
 	{
-		// Input is in the process of debouncing
-		if (tick_ms >= hsw_dbtime)
+		if (deadline_expired(rainbow_deadline))
+		{
+			deadline_start(&rainbow_deadline, RAINBOW_STEP_MS);
+			hswl_rgb(rainbow_cnt++);
+		}
+		ms = deadline_remaining(rainbow_deadline);
+		if (ms < next)
 		{
-			// It has been long enough since last input change
-			hsw_db = FALSE;								// We are no longer debouncing
-			hsw_cur = HSW_port.IN & (1 << HSW_bp);		// Set to current state of input
+			next = ms;
 		}
 	}
-	if (sw1_db)
+	// Handle LED indicator breathing and flashing
+	if (!fx_animated)
 	{
-		// Input is in the process of debouncing
-		if (tick_ms >= sw1_dbtime)
+		// Effects just started, they run from their beginning for a whole step
+		deadline_start(&fx_deadline, LED_FX_STEP_MS);
+		for (uint8_t ch = 0; ch < CH_LED_COUNT; ch++)
 		{
-			// It has been long enough since last input change
-			sw1_db = FALSE;								// We are no longer debouncing
-			sw1_cur = SW1_port.IN & (1 << SW1_bp);		// Set to current state of input
+			fx_animated |= led_fx_animated(ch);
 		}
 	}
-	if (sw2_db)
+	else if (deadline_expired(fx_deadline))
+	{
+		deadline_start(&fx_deadline, LED_FX_STEP_MS);
+		fx_animated = led_fx_step();
+	}
+	if (fx_animated)
 	{
-		// Input is in the process of debouncing
-		if (tick_ms >= sw2_dbtime)
+		ms = deadline_remaining(fx_deadline);
+		if (ms < next)
 		{
-			// It has been long enough since last input change
-			sw2_db = FALSE;								// We are no longer debouncing
-			sw2_cur = SW2_port.IN & (1 << SW2_bp);		// Set to current state of input
+			next = ms;
 		}
 	}
-	if (ign_db)
+	return next;
+}
+
+#if TELEMETRY
+/*
+ * Fill the telemetry frame with the current state
+ */
+void telemetry_snapshot(void)
+{
+	telemetry_t *frame = &telemetry_frame;
+	
+	frame->sync = TELEMETRY_SYNC;
+	frame->length = sizeof(telemetry_t);
+	frame->uptime = uptime();
+	frame->inputs = inputs;
+	frame->toggles = (sw1_toggle << 4) | sw2_toggle;
+	frame->power_state = power_state;
+	frame->prog_state = prog_state;
+	frame->batt_state = batt_state;
+	frame->horn_state = horn_state;
+	frame->standby_wakes = standby_wakes;
+	frame->standby_faults = standby_faults;
+	frame->v1_on_s = stats.v1_on_s;
+	frame->v2_on_s = stats.v2_on_s;
+	frame->horn_on_s = stats.horn_on_s;
+	frame->horn_count = stats.horn_count;
+	frame->wakes = stats.wakes;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 	{
-		// Input is in the process of debouncing
-		if (tick_ms >= ign_dbtime)
+		// Written by interrupts
+		for (uint8_t ch = 0; ch < CH_COUNT; ch++)
 		{
-			// It has been long enough since last input change
-			ign_db = FALSE;								// We are no longer debouncing
-			ign_cur = IGN_port.IN & (1 << IGN_bp);		// Set to current state of input
+			frame->duty[ch] = pwm_duty[ch];
 		}
+#if ISR_PROFILE
+		frame->isr_rtc_max = isr_stat_rtc.max;
+		frame->isr_port_max = (isr_stat_porta.max > isr_stat_portc.max) ? isr_stat_porta.max : isr_stat_portc.max;
+		frame->isr_tick_overruns = isr_tick_overruns;
+#endif
+	}
+#if ISR_PROFILE
+	frame->stack_max = stack_used();
+	frame->over_budget = ((frame->isr_rtc_max > BUDGET_ISR_RTC_CYCLES) ? BUDGET_RTC_bm : 0)
+					   | ((frame->isr_port_max > BUDGET_ISR_PORT_CYCLES) ? BUDGET_PORT_bm : 0)
+					   | ((frame->stack_max > BUDGET_STACK) ? BUDGET_STACK_bm : 0);
+#endif
+	frame->crc = crc16(frame, offsetof(telemetry_t, crc));
+}
+
+/*
+ * Telemetry Task
+ *  Powers the telemetry USART up while awake with a host connected and down otherwise. Sends a frame every
+ *   TELEMETRY_PERIOD_MS and uses a valid configuration record written by the host (saved to EEPROM).
+ *  Returns the number of milliseconds until it needs to run again or TASK_WAIT in Power Down State.
+ */
+uint32_t telemetry_task(void)
+{
+	uint8_t awake = (power_state != SM_POWER_RESET) && (power_state != SM_POWER_DOWN);
+	uint8_t host = awake && hal_telemetry_host();
+	
+	if (telemetry_on && !host && hal_telemetry_sent())
+	{
+		telemetry_on = FALSE;							// Host gone or powering down, USART off
+		hal_telemetry_power(FALSE);
+	}
+	else if (!telemetry_on && host)
+	{
+		telemetry_rx_len = 0;
+		telemetry_tx = sizeof(telemetry_frame);
+		hal_telemetry_power(TRUE);
+		telemetry_on = TRUE;
+	}
+	if (!telemetry_on)
+	{
+		return awake ? TELEMETRY_PERIOD_MS : TASK_WAIT;	// Wake-up input edges run the task again
 	}
-	if (rev_db)
+	if (telemetry_rx_len > sizeof(config_t))
 	{
-		// Input is in the process of debouncing
-		if (tick_ms >= rev_dbtime)
+		// Configuration record received
+		if ((telemetry_rx.version == CONFIG_VERSION) && (telemetry_rx.crc == config_crc(&telemetry_rx)))
 		{
-			// It has been long enough since last input change
-			rev_db = FALSE;								// We are no longer debouncing
-			rev_cur = REV_port.IN & (1 << REV_bp);		// Set to current state of input
+			telemetry_rx.sequence = config.sequence;	// Numbered by config_poll
+			config = telemetry_rx;
+			config_apply();
+			config_dirty = TRUE;
 		}
+		telemetry_rx_len = 0;							// Ready for the next write
+	}
+	if (host && hal_telemetry_sent())
+	{
+		telemetry_snapshot();
+		hal_telemetry_send();
 	}
-	if (hb_db)
+	return TELEMETRY_PERIOD_MS;
+}
+#endif
+
+/*
+ * Track the presses of the inputs with gestures in one input event
+ *  A release before GESTURE_LONG_MS is a short press, a second short press released within
+ *   GESTURE_DOUBLE_MS of the first is also a double press. Long presses are detected by the Gesture Task.
+ */
+void gesture_event(volatile in_event_t *event)
+{
+	gesture_t *g = gesture;
+	
+	for (uint8_t bm = 1; bm; bm <<= 1)
 	{
-		// Input is in the process of debouncing
-		if (tick_ms >= hb_dbtime)
+		if (IN_GESTURE_gm & bm)
 		{
-			// It has been long enough since last input change
-			hb_db = FALSE;								// We are no longer debouncing
-			hb_cur = HB_port.IN & (1 << HB_bp);			// Set to current state of input
+			if (event->changed & bm)
+			{
+				if (event->state & bm)
+				{
+					g->pressed = event->time;			// Pressed
+					gesture_held |= bm;
+				}
+				else if (gesture_held & bm)
+				{
+					// Released before a long press
+					gesture_held &= ~bm;
+					gesture_short |= bm;
+					if ((gesture_tap & bm) && ((uint16_t) (event->time - g->released) <= GESTURE_DOUBLE_MS))
+					{
+						gesture_double |= bm;
+						gesture_tap &= ~bm;				// A third press starts over
+					}
+					else
+					{
+						gesture_tap |= bm;
+					}
+					g->released = event->time;
+				}
+			}
+			g++;
 		}
 	}
 }
 
 /*
- * PORTA Interrupt. (HSW, SW2, IGN, HB and REV Input Sense Interrupt)
- *  Used to detect these inputs changing, any edge will cause this interrupt.
+ * Handle all queued input events
+ *  Switch presses are user requested toggles, the toggles are only changed by main.
+ *  inputs is left at the debounced state of the last event so each pass sees consistent states.
+ *  Gestures of the last pass are cleared, gestures completed by these events are set.
+ *  Returns all inputs that changed (IN_xxx_bm).
  */
-ISR(PORTA_INT_vect)
+uint8_t in_events_handle(void)
 {
-	if (PORTA.INTFLAGS & (1 << HSW_bp))
+	uint8_t tail = in_event_tail;
+	uint8_t edges = 0;
+	uint8_t rose;
+	volatile in_event_t *event;
+	
+	gesture_short = 0;
+	gesture_long = 0;
+	gesture_double = 0;
+	while (tail != in_event_head)
 	{
-		// HSW input has changed
-		PORTA.INTFLAGS |= (1 << HSW_bp);				// Clear the interrupt flag
-		hsw_db = TRUE;									// We are currently debouncing
-		hsw_dbtime = tick_ms + DEBOUNCE_TIME;			// Reset debounce timer
-		if (!hsw_cur)
+		event = &in_events[tail & IN_EVENT_QUEUE_MASK];
+		gesture_event(event);
+		rose = event->changed & event->state;			// Inputs turned ON
+		if (rose & IN_SW1_bm)
+		{
+			sw1_toggle = (sw1_toggle == TOGGLE_OFF) ? TOGGLE_ON_USER : TOGGLE_OFF;
+		}
+		if (rose & IN_SW2_bm)
 		{
-			// This is the input turning on (rising edge)
-			hsw_cur = ON;								// Input is now ON
+			sw2_toggle = (sw2_toggle == TOGGLE_OFF) ? TOGGLE_ON_USER : TOGGLE_OFF;
 		}
+		edges |= event->changed;
+		inputs = event->state;
+#if ISR_PROFILE
+		isr_profile_record(&in_event_latency, (uint16_t) uptime() - event->time);
+#endif
+		in_event_tail = ++tail;							// Free the slot for the RTC Overflow interrupt
 	}
-	if (PORTA.INTFLAGS & (1 << SW2_bp))
+	return edges;
+}
+
+/*
+ * Scheduler task table
+ *  Tasks run in this order on every pass that makes them ready.
+ */
+const task_t tasks[TASK_COUNT] =
+{
+	{ power_task,   IN_IGN_bm | IN_REV_bm | IN_HB_bm | IN_HSW_bm | IN_SW1_bm | IN_SW2_bm },
+	{ gesture_task, IN_GESTURE_gm },
+	{ horn_task,    IN_HSW_bm },
+	{ prog_task,    IN_IGN_bm | IN_SW1_bm | IN_SW2_bm },
+	{ output_task,  IN_IGN_bm | IN_HSW_bm | IN_SW1_bm | IN_SW2_bm },
+	{ animate_task, IN_IGN_bm | IN_HSW_bm | IN_HB_bm },
+#if TELEMETRY
+	{ telemetry_task, IN_PORTA_WAKE_gm | IN_PORTC_WAKE_gm },
+#endif
+};
+
+/*
+ * Run one scheduler pass
+ *  A task is ready when one of its input edges fired, it was signalled or its deadline expired.
+ *  The processor sleeps until the nearest deadline when no task is ready.
+ */
+void scheduler_run(void)
+{
+	uint8_t edges;
+	uint8_t bm;
+	uint32_t ms;
+	uint32_t next = TASK_WAIT;
+	
+	edges = in_events_handle();							// Input edges since the last pass
+	for (uint8_t id = 0; id < TASK_COUNT; id++)
 	{
-		// SW2 input has changed
-		PORTA.INTFLAGS |= (1 << SW2_bp);				// Clear the interrupt flag
-		sw2_db = TRUE;									// We are currently debouncing
-		sw2_dbtime = tick_ms + DEBOUNCE_TIME;			// Reset debounce timer
-		if (!sw2_cur)
+		bm = TASK_bm(id);
+		if ((edges & tasks[id].edges) || (task_signals & bm)
+		 || (!(task_waiting & bm) && deadline_expired(task_deadline[id])))
 		{
-			// This is the input turning on (rising edge)
-			sw2_cur = ON;								// Input is now ON
-			// This is a user requested toggle
-			if (sw2_toggle == TOGGLE_OFF) 
+			task_signals &= ~bm;
+			ms = tasks[id].run();
+			if (ms == TASK_WAIT)
 			{
-				sw2_toggle = TOGGLE_ON_USER;			// User turned ON
+				task_waiting |= bm;
 			}
 			else
 			{
-				sw2_toggle = TOGGLE_OFF;				// User turned OFF
+				task_waiting &= ~bm;
+				deadline_start(&task_deadline[id], ms);
 			}
 		}
-	}
-	if (PORTA.INTFLAGS & (1 << IGN_bp))
-	{
-		// IGN input has changed
-		PORTA.INTFLAGS |= (1 << IGN_bp);				// Clear the interrupt flag
-		ign_db = TRUE;									// We are currently debouncing
-		ign_dbtime = tick_ms + DEBOUNCE_TIME;			// Reset debounce timer
-		if (!ign_cur)
+		if (!(task_waiting & bm))
 		{
-			// This is the input turning on (rising edge)
-			ign_cur = ON;								// Input is now ON
+			ms = deadline_remaining(task_deadline[id]);
+			if (ms < next)
+			{
+				next = ms;
+			}
 		}
 	}
-	if (PORTA.INTFLAGS & (1 << HB_bp))
+	if (!task_signals && next)
+	{
+		sleep_until(next);								// Nothing is ready
+	}
+}
+
+int main(void)
+{
+	// Delay time, output brightness levels and ramp time
+	config_load();
+	// Usage statistics
+	stats_load();
+	// Event log, starting with the cause of this reset
+	log_load();
+	log_event(LOG_RESET, RST.STATUS);
+	RST.STATUS = RST.STATUS;							// Clear the reset flags (written as ones)
+	
+	// Disable the Watchdog timer on start
+	wdt_disable();
+    // main loop forever
+    while (TRUE) 
+    {
+		// Each loop of main reset the Watchdog timer
+		wdt_reset();
+		// Run the Power, Programming, Output and Indicator Animation tasks that are ready
+		scheduler_run();
+		// Write the configuration to EEPROM if it changed
+		config_poll();
+		// Log state changes and write the event log
+		log_poll();
+		// Write the usage statistics if they changed
+		stats_poll();
+    }
+}
+
+/* 
+ * RTC Overflow interrupt.
+ *  RTC is configured to overflow every millisecond.
+ *  Update delay counters and tick count
+ *  Use tick count to handle debouncing inputs
+ */
+ISR(RTC_OVF_vect)
+{
+	uint16_t step = tick_step;							// number of RTC ticks in this RTC period
+	uint32_t elapsed;									// milliseconds in this RTC period (16.16 fixed point)
+	uint8_t sample;										// raw state of all inputs
+	uint8_t delta;										// inputs changing state
+	uint8_t carry;										// debounce counter carry
+	uint8_t count;										// debounce counter bit
+	uint16_t duty;										// output duty cycle
+	uint16_t lim;										// output duty cycle limit
+	uint8_t head;										// next input event slot
+	volatile in_event_t *event;							// new input event
+	ISR_PROFILE_ENTER();
+#if ISR_PROFILE
+	static uint16_t tick_last;							// profiling timer count at the last tick
+	
+	if ((step == 1) && !isr_tick_psave)
+	{
+		isr_profile_record(&isr_tick_period, tick_last - isr_profile_start);
+	}
+	isr_tick_psave = FALSE;
+	tick_last = isr_profile_start;
+#endif
+	
+	if (step != 1)
+	{
+		// End of a stretched tickless period, back to 1ms overflows
+		tick_step = 1;
+		while (RTC.STATUS & RTC_SYNCBUSY_bm);			// wait for RTC sync ready
+		RTC.PER = RTC_TICK_COUNTS - 1;
+	}
+	// Increment uptime milliseconds by the calibrated period length, the fraction is carried to the next tick
+	elapsed = tick_frac + ((step == 1) ? tick_len : step * tick_len);
+	tick_frac = elapsed;
+	uptime_ms += elapsed >> 16;
+	
+	// Handle V1 and V2 output soft start and stop
+	if (out_ramping)
 	{
-		// HB input has changed
-		PORTA.INTFLAGS |= (1 << HB_bp);					// Clear the interrupt flag
-		hb_db = TRUE;									// We are currently debouncing
-		hb_dbtime = tick_ms + DEBOUNCE_TIME;			// Reset debounce timer
-		if (!hb_cur)
+		duty = out_ramp_step(&v1_ramp, step);
+		lim = out_duty_lim_step(&v1_duty_lim, v1_duty_max);
+		if (duty > lim)
+		{
+			duty = lim;									// Current foldback
+		}
+		pwm_set(CH_V1, duty);							// V1 set to next duty cycle
+		v1_current_ma = out_current(duty, OUT_LOAD_SCALE(V1_LOAD_MA));
+		duty = out_ramp_step(&v2_ramp, step);
+		lim = out_duty_lim_step(&v2_duty_lim, v2_duty_max);
+		if (duty > lim)
 		{
-			// This is the input turning on (rising edge)
-			hb_cur = ON;								// Input is now ON
+			duty = lim;									// Current foldback
 		}
+		pwm_set(CH_V2, duty);							// V2 set to next duty cycle
+		v2_current_ma = out_current(duty, OUT_LOAD_SCALE(V2_LOAD_MA));
+		out_ramping = (v1_ramp.level != v1_ramp.target) || (v2_ramp.level != v2_ramp.target)
+		 || (v1_duty_lim != v1_duty_max) || (v2_duty_lim != v2_duty_max);
+#if OUT_PWM_FAST_CLOCK
+		if (!out_ramping && !v1_ramp.level && !v2_ramp.level)
+		{
+			hal_clock_fast(FALSE);						// Outputs are off, back to the 2MHz clock
+		}
+#endif
+	}
+	pwm_commit();										// Write all changed duty cycles
+	out_current_avg(&v1_current_avg, v1_current_ma, step);
+	out_current_avg(&v2_current_avg, v2_current_ma, step);
+	// Count usage statistics
+	stats_on_time(&stats_v1_on, pwm_duty[CH_V1], step);
+	stats_on_time(&stats_v2_on, pwm_duty[CH_V2], step);
+	if (horn_state == HORN_ON)
+	{
+		stats_horn_ticks = stats_add(stats_horn_ticks, step);
 	}
-	if (PORTA.INTFLAGS & (1 << REV_bp))
+
+	// Handle all input debouncing
+	//  All inputs are sampled at once and each input has a 4-bit vertical counter.
+	//  An input must read differently than its debounced state for its debounce ticks (input tables) in a row
+	//   to change state.
+	in_edge = FALSE;									// Edges so far are in this sample
+	sample = hal_inputs();								// Sample all inputs
+	delta = sample ^ in_state;							// Inputs that differ from debounced state
+	if (!delta)
+	{
+		// Nothing differs, reset all counters
+		in_cnt0 = 0;
+		in_cnt1 = 0;
+		in_cnt2 = 0;
+		in_cnt3 = 0;
+	}
+	else
+	{
+		// Count inputs that differ, reset the rest
+		carry = in_cnt0;
+		in_cnt0 = ~carry & delta;
+		count = in_cnt1;
+		in_cnt1 = (count ^ carry) & delta;
+		carry &= count;
+		count = in_cnt2;
+		in_cnt2 = (count ^ carry) & delta;
+		carry &= count;
+		in_cnt3 = (in_cnt3 ^ carry) & delta;
+		// Inputs whose counter reached their debounce ticks have changed
+		delta &= ~((in_cnt0 ^ IN_DEB0_gm) | (in_cnt1 ^ IN_DEB1_gm) | (in_cnt2 ^ IN_DEB2_gm) | (in_cnt3 ^ IN_DEB3_gm));
+		in_cnt0 &= ~delta;
+		in_cnt1 &= ~delta;
+		in_cnt2 &= ~delta;
+		in_cnt3 &= ~delta;
+	}
+	if (delta)
 	{
-		// REV input has changed
-		PORTA.INTFLAGS |= (1 << REV_bp);				// Clear the interrupt flag
-		rev_db = TRUE;									// We are currently debouncing
-		rev_dbtime = tick_ms + DEBOUNCE_TIME;			// Reset debounce timer
-		if (!rev_cur)
+		head = in_event_head;
+		if ((uint8_t) (head - in_event_tail) < IN_EVENT_QUEUE_SIZE)
 		{
-			// This is the input turning on (rising edge)
-			rev_cur = ON;								// Input is now ON
+			in_state ^= delta;							// Update debounced state
+			event = &in_events[head & IN_EVENT_QUEUE_MASK];
+			event->time = uptime_ms;
+			event->changed = delta;
+			event->state = in_state;
+			in_event_head = head + 1;					// Event is now visible to main
 		}
+		// else the queue is full, the change is debounced again and queued once main makes room
+	}
+	if (out_fast_pending)
+	{
+		// Switches that turned an output on early
+		out_fast_check(IN_SW1_bm, &v1_ramp, step);
+		out_fast_check(IN_SW2_bm, &v2_ramp, step);
+	}
+#if ISR_PROFILE
+	if (RTC.INTFLAGS & RTC_OVFIF_bm)
+	{
+		isr_tick_overruns++;							// Next tick is already pending
 	}
+#endif
+	ISR_PROFILE_EXIT(isr_stat_rtc);
 }
 
+/*
+ * PORTA Interrupt. (HSW, SW2, IGN, HB and REV Input Sense Interrupt)
+ *  Used to wake the processor when these inputs change, any edge will cause this interrupt.
+ *  The inputs are sampled and debounced by the RTC Overflow interrupt.
+ */
+ISR(PORTA_INT_vect)
+{
+	ISR_PROFILE_ENTER();
+	out_fast_on(IN_SW2_bm, IN_SW2_DEB, &v2_ramp, CH_V2, v2_level);	// Switch 2 press turns V2 on at once
+#if ISR_PROFILE
+	if (out_fast_pending & IN_SW2_bm)
+	{
+		isr_profile_record(&out_fast_latency, isr_profile_start - isr_profile_now());
+	}
+#endif
+	tick_resume();										// Input changes need the millisecond tick
+	in_woken = TRUE;
+	in_edge = TRUE;
+	PORTA.INTFLAGS = IN_PORTA_gm;						// Clear the interrupt flags
+	ISR_PROFILE_EXIT(isr_stat_porta);
+}
 
 /*
  * PORTC Interrupt. (SW1 Input Sense Interrupt)
- *  Used to detect this input changing, any edge will cause this interrupt.
+ *  Used to wake the processor when this input changes, any edge will cause this interrupt.
+ *  The input is sampled and debounced by the RTC Overflow interrupt.
  */
 ISR(PORTC_INT_vect)
 {
-	if (PORTC.INTFLAGS & (1 << SW1_bp))
+	ISR_PROFILE_ENTER();
+	out_fast_on(IN_SW1_bm, IN_SW1_DEB, &v1_ramp, CH_V1, v1_level);	// Switch 1 press turns V1 on at once
+#if ISR_PROFILE
+	if (out_fast_pending & IN_SW1_bm)
+	{
+		isr_profile_record(&out_fast_latency, isr_profile_start - isr_profile_now());
+	}
+#endif
+	tick_resume();										// Input changes need the millisecond tick
+	in_woken = TRUE;
+	in_edge = TRUE;
+	PORTC.INTFLAGS = IN_PORTC_gm;						// Clear the interrupt flag
+	ISR_PROFILE_EXIT(isr_stat_portc);
+}
+
+/*
+ * NVM EEPROM Ready interrupt
+ *  An EEPROM page write has finished.
+ */
+ISR(NVM_EE_vect)
+{
+	NVM.INTCTRL = NVM_EELVL_OFF_gc;						// EEPROM Ready interrupt disabled
+	eeprom_busy = FALSE;
+}
+
+#if TELEMETRY
+/*
+ * USARTD0 Data Register Empty interrupt. (Telemetry transmit)
+ *  Sends the next telemetry frame byte, the interrupt is disabled after the last byte.
+ */
+ISR(USARTD0_DRE_vect)
+{
+	uint8_t tx = telemetry_tx;
+	
+	USARTD0.DATA = ((const uint8_t *) &telemetry_frame)[tx++];
+	telemetry_tx = tx;
+	if (tx == sizeof(telemetry_frame))
+	{
+		USARTD0.CTRLA = USART_RXCINTLVL_LO_gc;			// Data Register Empty interrupt disabled
+	}
+}
+
+/*
+ * USARTD0 Receive Complete interrupt. (Telemetry configuration write)
+ *  Collects TELEMETRY_SYNC and a config_t record, bytes are dropped until the Telemetry Task took the record.
+ */
+ISR(USARTD0_RXC_vect)
+{
+	uint8_t data = USARTD0.DATA;
+	uint8_t len = telemetry_rx_len;
+	
+	if (len == 0)
 	{
-		// REV input has changed
-		PORTC.INTFLAGS |= (1 << SW1_bp);				// Clear the interrupt flag
-		sw1_db = TRUE;									// We are currently debouncing
-		sw1_dbtime = tick_ms + DEBOUNCE_TIME;			// Reset debounce timer
-		if (!sw1_cur)
+		if (data == TELEMETRY_SYNC)
 		{
-			// This is the input turning on (rising edge)
-			sw1_cur = ON;								// Input is now ON
-			// This is a user requested toggle
-			if (sw1_toggle == TOGGLE_OFF)
-			{
-				sw1_toggle = TOGGLE_ON_USER;			// User turned ON
-			}
-			else
-			{
-				sw1_toggle = TOGGLE_OFF;				// User turned OFF
-			}
+			telemetry_rx_len = 1;						// Start of a record
 		}
 	}
-}
\ No newline at end of file
+	else if (len <= sizeof(config_t))
+	{
+		((uint8_t *) &telemetry_rx)[len - 1] = data;
+		telemetry_rx_len = len + 1;
+	}
+}
+#endif
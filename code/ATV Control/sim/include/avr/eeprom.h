@@ -0,0 +1,15 @@
+/*
+ * Host simulation <avr/eeprom.h>
+ *  EEMEM variables are placed in their own section, an EEPROM address is the offset into that section.
+ */
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EEMEM							__attribute__((section("sim_eemem")))
+
+void eeprom_read_block(void *dst, const void *src, size_t len);
+
+#endif
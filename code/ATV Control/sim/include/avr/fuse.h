@@ -0,0 +1,19 @@
+/*
+ * Host simulation <avr/fuse.h>
+ *  The fuse bytes are kept as an ordinary structure.
+ */
+#ifndef SIM_AVR_FUSE_H
+#define SIM_AVR_FUSE_H
+
+typedef struct
+{
+	unsigned char FUSEBYTE1;
+	unsigned char FUSEBYTE2;
+	unsigned char FUSEBYTE4;
+	unsigned char FUSEBYTE5;
+	unsigned char FUSEBYTE6;
+} __fuse_t;
+
+#define FUSES							__fuse_t __fuse
+
+#endif
@@ -0,0 +1,14 @@
+/*
+ * Host simulation <avr/interrupt.h>
+ *  An ISR is a plain function the simulation calls when its event is due, cli and sei only track the
+ *   global interrupt flag (interrupts are only delivered while the firmware sleeps).
+ */
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#define ISR(vector)						void vector(void); void vector(void)
+
+void cli(void);
+void sei(void);
+
+#endif
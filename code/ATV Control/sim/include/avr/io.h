@@ -0,0 +1,243 @@
+/*
+ * Host simulation <avr/io.h> (ATxmega8E5)
+ *  Registers are plain structures the simulation reads and writes between firmware steps. Only the
+ *   registers and bit values main.c uses are declared.
+ */
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#define _R8 volatile uint8_t
+#define _R16 volatile uint16_t
+typedef struct { _R8 DIR, DIRSET, DIRCLR, DIRTGL, OUT, OUTSET, OUTCLR, OUTTGL, IN, INTCTRL, INTMASK, INTFLAGS, REMAP, PIN0CTRL, PIN1CTRL, PIN2CTRL, PIN3CTRL, PIN4CTRL, PIN5CTRL, PIN6CTRL, PIN7CTRL, EVCTRL; } PORT_t;
+typedef struct { _R8 CTRLA, CTRLB, CTRLC, CTRLD, CTRLE, CTRLF, INTCTRLA, INTCTRLB, CTRLGCLR, CTRLGSET, CTRLHCLR, CTRLHSET, INTFLAGS, TEMP; _R16 CNT, PER, CCA, CCB, CCC, CCD, PERBUF, CCABUF, CCBBUF, CCCBUF, CCDBUF; } TC4_t;
+typedef struct { _R8 CTRLA, CTRLB, CTRLC, CTRLD, CTRLE, CTRLF, INTCTRLA, INTCTRLB, CTRLGCLR, CTRLGSET, CTRLHCLR, CTRLHSET, INTFLAGS, TEMP; _R16 CNT, PER, CCA, CCB, PERBUF, CCABUF, CCBBUF; } TC5_t;
+typedef struct { _R8 CTRL, STATUS, INTCTRL, INTFLAGS, TEMP, CALIB; _R16 CNT, PER, COMP; } RTC_t;
+typedef struct { _R8 CTRL, STATUS, XOSCCTRL, XOSCFAIL, RC32KCAL, PLLCTRL, DFLLCTRL, RC8MCAL; } OSC_t;
+typedef struct { _R8 CTRL, PSCTRL, LOCK, RTCCTRL; } CLK_t;
+typedef struct { _R8 STATUSR, CTRL, INTPRI; } PMIC_t;
+typedef struct { _R8 PRGEN, PRPA, PRPC, PRPD; } PR_t;
+typedef struct { _R8 MPCMASK, CLKOUT, ACEVOUT, SRLCTRL, EVOUTSEL, EVOUTCTRL; } PORTCFG_t;
+typedef struct { _R8 STATUS; } RST_t;
+typedef struct { _R8 ADDR0, ADDR1, ADDR2, DATA0, DATA1, DATA2, CMD, CTRLA, CTRLB, INTCTRL, STATUS, LOCKBITS; } NVM_t;
+typedef struct { _R8 CTRLA, CTRLB, PLC, CTRLC, CTRLD, CTRLE, CTRLF, CTRLG, INTCTRL, INTFLAGS, CNTL, CNTH, CMPL, CMPH, PERCAPTL, PERCAPTH; } XCL_t;
+typedef struct { _R8 DATA, STATUS, CTRLA, CTRLB, CTRLC, CTRLD, BAUDCTRLA, BAUDCTRLB; } USART_t;
+typedef struct { _R8 CTRLA, CTRLB, ADDRCTRL, DESTADDRCTRL, TRIGSRC; _R16 TRFCNT, ADDR, DESTADDR; } EDMA_CH_t;
+typedef struct { _R8 CTRL, INTFLAGS, STATUS, TEMP; EDMA_CH_t CH0, CH1, CH2, CH3; } EDMA_t;
+typedef struct { _R8 CH0MUX, CH1MUX, CH2MUX, CH3MUX, CH0CTRL, CH1CTRL, CH2CTRL, CH3CTRL, STROBE, DATA; } EVSYS_t;
+typedef struct { _R8 CTRL, INTCTRL, INTFLAGS, TEMP, SCAN, MUXCTRL, CORRCTRL; _R16 RES, CMP; } ADC_CH_t;
+typedef struct { _R8 CTRLA, CTRLB, REFCTRL, EVCTRL, PRESCALER, INTFLAGS, TEMP, SAMPCTRL, CALL, CALH; _R16 CH0RES, CMP; ADC_CH_t CH0; } ADC_t;
+extern PORT_t PORTA, PORTC, PORTD, PORTR; extern TC4_t TCC4; extern TC5_t TCC5, TCD5; extern RTC_t RTC; extern OSC_t OSC; extern CLK_t CLK;
+extern PMIC_t PMIC; extern PR_t PR; extern PORTCFG_t PORTCFG; extern RST_t RST; extern NVM_t NVM; extern XCL_t XCL; extern USART_t USARTC0, USARTD0;
+typedef struct { _R8 CTRL, WINCTRL, STATUS; } WDT_t;
+extern EDMA_t EDMA; extern WDT_t WDT; extern EVSYS_t EVSYS; extern ADC_t ADCA; extern _R8 CCP; extern _R8 GPIO0, GPIO1;
+#define PIN0_bp 0
+#define PIN1_bp 1
+#define PIN2_bp 2
+#define PIN3_bp 3
+#define PIN4_bp 4
+#define PIN5_bp 5
+#define PIN6_bp 6
+#define PIN7_bp 7
+#define PORT_OPC_PULLDOWN_gc 0x10
+#define PORT_OPC_TOTEM_gc 0
+#define PORT_ISC_BOTHEDGES_gc 0
+#define PORT_ISC_INPUT_DISABLE_gc 7
+#define PORT_INVEN_bp 6
+#define PORT_INTLVL_HI_gc 3
+#define PORT_INTLVL_OFF_gc 0
+#define TC_CLKSEL_OFF_gc 0
+#define TC_CLKSEL_DIV1_gc 1
+#define TC_CLKSEL_DIV2_gc 2
+#define TC_CLKSEL_DIV4_gc 3
+#define TC_CLKSEL_DIV8_gc 4
+#define TC_CLKSEL_DIV64_gc 5
+#define TC_CLKSEL_DIV256_gc 6
+#define TC_CLKSEL_DIV1024_gc 7
+#define TC_WGMODE_DSTOP_gc 5
+#define TC_WGMODE_DSBOTH_gc 6
+#define TC_WGMODE_DSBOTTOM_gc 7
+#define TC_CIRCEN_DISABLE_gc 0
+#define TC_BYTEM_NORMAL_gc 0
+#define TC4_POLA_bp 0
+#define TC4_POLB_bp 1
+#define TC4_PERBV_bm 0x01
+#define TC4_CCABV_bm 0x02
+#define TC4_CCBBV_bm 0x04
+#define TC4_CCCBV_bm 0x08
+#define TC4_CCDBV_bm 0x10
+#define TC4_POLC_bp 2
+#define TC4_POLD_bp 3
+#define TC4_CMPA_bp 4
+#define TC4_CMPB_bp 5
+#define TC4_CMPC_bp 6
+#define TC4_CMPD_bp 7
+#define TC5_POLA_bp 0
+#define TC5_POLB_bp 1
+#define TC5_PERBV_bm 0x01
+#define TC5_CCABV_bm 0x02
+#define TC5_CCBBV_bm 0x04
+#define TC5_CMPA_bp 4
+#define TC5_CMPB_bp 5
+#define TC_CCAMODE_DISABLE_gc 0
+#define TC_CCAMODE_COMP_gc 1
+#define TC_CCBMODE_COMP_gc 4
+#define TC_CCCMODE_COMP_gc 0x10
+#define TC_CCDMODE_COMP_gc 0x40
+#define TC_CMD_UPDATE_gc 0x04
+#define TC_CMD_RESTART_gc 0x08
+#define TC_CMD_RESET_gc 0x0C
+#define TC4_OVFIF_bm 1
+#define TC5_OVFIF_bm 1
+#define TC_OVFINTLVL_OFF_gc 0
+#define TC_OVFINTLVL_HI_gc 3
+#define OSC_RC32KEN_bp 2
+#define OSC_RC2MEN_bp 0
+#define OSC_RC32MEN_bp 1
+#define OSC_RC32MEN_bm 2
+#define OSC_RC2MEN_bm 1
+#define OSC_RC32KEN_bm 4
+#define OSC_RC2MRDY_bm 1
+#define OSC_RC32MRDY_bm 2
+#define OSC_RC32KRDY_bm 4
+#define OSC_RC32MCREF_RC32K_gc 0
+#define OSC_RC32MCREF_gm 6
+#define CLK_RTCEN_bp 0
+#define CLK_RTCSRC_RCOSC32_gc 0x0C
+#define CLK_SCLKSEL_RC2M_gc 0
+#define CLK_SCLKSEL_RC32M_gc 1
+#define CLK_SCLKSEL_gm 7
+#define CCP_IOREG_gc 0xD8
+#define RTC_SYNCBUSY_bm 1
+#define RTC_PRESCALER_DIV1_gc 1
+#define RTC_CORREN_bp 3
+#define RTC_CORREN_bm 8
+#define RTC_OVFINTLVL_HI_gc 3
+#define RTC_OVFINTLVL_OFF_gc 0
+#define RTC_COMPINTLVL_OFF_gc 0
+#define RTC_COMPINTLVL_HI_gc 0x0C
+#define RTC_OVFIF_bm 1
+#define RTC_COMPIF_bm 2
+#define PMIC_RREN_bp 7
+#define PMIC_IVSEL_bp 6
+#define PMIC_HILVLEN_bp 2
+#define PMIC_MEDLVLEN_bp 1
+#define PMIC_LOLVLEN_bp 0
+#define PR_XCL_bp 7
+#define PR_RTC_bp 2
+#define PR_EVSYS_bp 1
+#define PR_EDMA_bp 0
+#define PR_DAC_bp 2
+#define PR_ADC_bp 1
+#define PR_AC_bp 0
+#define PR_TWI_bp 6
+#define PR_USART0_bp 4
+#define PR_SPI_bp 3
+#define PR_HIRES_bp 2
+#define PR_TC5_bp 1
+#define PR_TC4_bp 0
+#define PR_XCL_bm 0x80
+#define PR_EDMA_bm 1
+#define PR_EVSYS_bm 2
+#define PR_ADC_bm 2
+#define PR_USART0_bm 0x10
+#define SLEEP_SMODE_PSAVE_gc 6
+#define SLEEP_SMODE_IDLE_gc 0
+#define SLEEP_SMODE_PDOWN_gc 4
+#define RST_PORF_bm 1
+#define RST_EXTRF_bm 2
+#define RST_BORF_bm 4
+#define RST_WDRF_bm 8
+#define RST_PDIRF_bm 0x10
+#define RST_SRF_bm 0x20
+#define NVM_CMD_NO_OPERATION_gc 0
+#define NVM_CMD_ERASE_EEPROM_BUFFER_gc 0x36
+#define NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc 0x35
+#define NVM_CMD_LOAD_EEPROM_BUFFER_gc 0x33
+#define NVM_CMDEX_bm 1
+#define NVM_NVMBUSY_bm 0x80
+#define NVM_EELOAD_bm 2
+#define NVM_EELVL_HI_gc 3
+#define NVM_EELVL_OFF_gc 0
+#define EEPROM_PAGE_SIZE 32
+#define EEPROM_SIZE 512
+#define XCL_TCSEL_TC16_gc 0
+#define XCL_CLKSEL_DIV1_gc 1
+#define XCL_CLKSEL_OFF_gc 0
+#define XCL_TCMODE_NORMAL_gc 0
+#define USART_RXCIF_bm 0x80
+#define USART_TXCIF_bm 0x40
+#define USART_DREIF_bm 0x20
+#define USART_RXCINTLVL_HI_gc 0x30
+#define USART_RXCINTLVL_OFF_gc 0
+#define USART_DREINTLVL_HI_gc 0x03
+#define USART_DREINTLVL_OFF_gc 0
+#define USART_TXCINTLVL_HI_gc 0x0C
+#define USART_TXCINTLVL_OFF_gc 0
+#define USART_TXCINTLVL_gm 0x0C
+#define USART_DREINTLVL_gm 0x03
+#define USART_RXEN_bm 0x10
+#define USART_TXEN_bm 0x08
+#define USART_CMODE_ASYNCHRONOUS_gc 0
+#define USART_PMODE_DISABLED_gc 0
+#define USART_CHSIZE_8BIT_gc 3
+#define EDMA_ENABLE_bm 0x80
+#define EDMA_RESET_bm 0x40
+#define EDMA_CHMODE_STD02_gc 0x30
+#define EDMA_DBUFMODE_DISABLE_gc 0
+#define EDMA_PRIMODE_RR0123_gc 0
+#define EDMA_CH_ENABLE_bm 0x80
+#define EDMA_CH_RESET_bm 0x40
+#define EDMA_CH_REPEAT_bm 0x20
+#define EDMA_CH_SINGLE_bm 0x04
+#define EDMA_CH_BURSTLEN_bm 0x01
+#define EDMA_CH_RELOAD_BLOCK_gc 0x10
+#define EDMA_CH_DIR_INC_gc 0x01
+#define EDMA_CH_DESTRELOAD_BURST_gc 0x20
+#define EDMA_CH_DESTDIR_INC_gc 0x01
+#define EDMA_CH_TRIGSRC_TCC5_OVF_gc 0x46
+#define EDMA_CH_TRIGSRC_TCC4_OVF_gc 0x40
+#define EVSYS_CHMUX_TCD5_OVF_gc 0xD8
+#define EVSYS_CHMUX_TCD5_CCA_gc 0xDC
+#define ADC_ENABLE_bm 1
+#define ADC_RESOLUTION_12BIT_gc 0
+#define ADC_REFSEL_INT1V_gc 0
+#define ADC_REFSEL_INTVCC_gc 0x10
+#define ADC_PRESCALER_DIV16_gc 2
+#define ADC_CH_INPUTMODE_SINGLEENDED_gc 1
+#define ADC_CH_INPUTMODE_INTERNAL_gc 0
+#define ADC_CH_MUXINT_SCALEDVCC_gc 0x10
+#define ADC_CH_START_bm 0x80
+#define ADC_CH_IF_bm 1
+#define ADC_BANDGAP_bm 2
+#define CLKSYS_DIV_gc 0
+#define PORT_USART0_bm 0x10
+#define USART_RXEN_bp 4
+#define USART_TXEN_bp 3
+#define USART_CLK2X_bp 2
+#define USART_RXCINTLVL_LO_gc 0x10
+#define USART_DREINTLVL_LO_gc 0x01
+#define WDT_ENABLE_bm 0x02
+#define WDT_CEN_bm 0x01
+// Fuses
+#define WDWPER_1KCLK_gc 0x70
+#define NVM_FUSES_WDWPER_gm 0xF0
+#define WDPER_1KCLK_gc 0x07
+#define NVM_FUSES_WDPER_gm 0x0F
+#define BOOTRST_APPLICATION_gc 0x40
+#define NVM_FUSES_BOOTRST_bm 0x40
+#define BODPD_SAMPLED_gc 1
+#define NVM_FUSES_BODPD_gm 3
+#define STARTUPTIME_0MS_gc 0x0C
+#define NVM_FUSES_STARTUPTIME_gm 0x0C
+#define BODACT_CONTINUOUS_gc 0x20
+#define NVM_FUSES_BODACT_gm 0x30
+#define FUSE_EESAVE 0xF7
+#define BODLEVEL_2V0_gc 6
+#define NVM_FUSES_BODLEVEL_gm 7
+// Memory mapped EEPROM, EEMEM addresses are offsets into the simulation EEPROM section
+extern uintptr_t sim_eeprom_mapped;
+#define MAPPED_EEPROM_START sim_eeprom_mapped
+
+#endif
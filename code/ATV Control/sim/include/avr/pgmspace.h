@@ -0,0 +1,15 @@
+/*
+ * Host simulation <avr/pgmspace.h>
+ *  Program memory is ordinary read only data on the host.
+ */
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(addr)				(*(const uint8_t *) (addr))
+#define pgm_read_word(addr)				(*(const uint16_t *) (addr))
+#define pgm_read_ptr(addr)				(*(const void * const *) (addr))
+
+#endif
@@ -0,0 +1,15 @@
+/*
+ * Host simulation <avr/sleep.h>
+ *  sleep_cpu advances simulated time to the next event and runs its interrupt.
+ */
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+#include <stdint.h>
+
+void set_sleep_mode(uint8_t mode);
+void sleep_enable(void);
+void sleep_disable(void);
+void sleep_cpu(void);
+
+#endif
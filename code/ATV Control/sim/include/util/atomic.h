@@ -0,0 +1,17 @@
+/*
+ * Host simulation <util/atomic.h>
+ *  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) disables interrupts and restores the global interrupt flag after.
+ */
+#ifndef SIM_UTIL_ATOMIC_H
+#define SIM_UTIL_ATOMIC_H
+
+#include <stdint.h>
+
+uint8_t sim_atomic_enter(void);
+uint8_t sim_atomic_exit(uint8_t sreg);
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type)				for (uint8_t sim_sreg = sim_atomic_enter(), sim_once = 1; sim_once; \
+											 sim_once = sim_atomic_exit(sim_sreg))
+
+#endif
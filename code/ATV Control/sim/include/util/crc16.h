@@ -0,0 +1,17 @@
+/*
+ * Host simulation <util/crc16.h>
+ *  Same CRC-CCITT as the avr-libc version so records written by the host build check on the board.
+ */
+#ifndef SIM_UTIL_CRC16_H
+#define SIM_UTIL_CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+	data ^= crc & 0xFF;
+	data ^= data << 4;
+	return (((uint16_t) data << 8) | (crc >> 8)) ^ (uint8_t) (data >> 4) ^ ((uint16_t) data << 3);
+}
+
+#endif
@@ -0,0 +1,1328 @@
+/*
+ * ATV Control host simulation
+ *  Builds main.c for the host against the register stubs in include/ and replays a timestamped input trace.
+ *  Simulated time only moves while the firmware sleeps: sleep_cpu runs the next trace input change, RTC
+ *   overflow or EEPROM write completion as its interrupt, the way the processor wakes up. Between two
+ *   wake-ups the firmware takes no simulated time, so timing is exact to the RTC clock but says nothing
+ *   about the processor cycles a step needs (see the benchmark report for the host cost of each step).
+ *  The power, programming and horn state transitions are compared with the ones recorded in the trace.
+ *   The replay also fails on a watchdog timeout, a missed RTC period, a PWM output frozen part way in
+ *   Power Save or a sleep with interrupts disabled.
+ *  The host has a 32-bit int, an overflow of 16-bit int arithmetic on the processor is not reproduced.
+ *
+ * Usage: atv_sim [-t] [-s] [-b] [-r] trace
+ *  -t prints the state and output timelines, -s the event counts, -b host cycles per scheduler pass and
+ *   per interrupt, -r prints the trace again with the transitions of this run (record a trace).
+ *
+ * Trace lines (times in milliseconds from reset, # starts a comment):
+ *  <ms> IGN|REV|HB|HSW|SW1|SW2 0|1        Input change, 1 is active (switch pressed, harness line on)
+ *  <ms> power|prog|horn <STATE>            Expected state transition (state name without SM_POWER_ etc.)
+ *  <ms> expect <name> =|<|> <value>        Check an output duty cycle in percent (V1, V2, HEN, SWL1, SWL2,
+ *                                           HSWLR, HSWLG, HSWLB) or a count since the last mark (RTC,
+ *                                           PORT, WAKES, STANDBY_WAKES, HORN_COUNT, EEPROM, CONFIG, LOG,
+ *                                           PSAVE_MS, IDLE_MS)
+ *  <ms> mark                               Start counting again for the count checks
+ *  <ms> poke <register> <value>            Write a register (corrupt the configuration standby relies on)
+ *  <ms> end                                End of the replay
+ *  tolerance <ms>                          Timing tolerance of the state transitions (default 1ms)
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if ISR_PROFILE
+#error "ISR_PROFILE needs the XCL timer and the stack symbols of the processor build"
+#endif
+
+#define main atv_main
+#include "../main.c"
+#undef main
+
+/*
+ * Simulation defines
+ */
+// Simulated time is counted in RTC clocks
+#define SIM_CLOCK_HZ					RTC_CLOCK_HZ
+#define SIM_MS(t)						((double) (t) * 1000.0 / SIM_CLOCK_HZ)
+#define SIM_COUNTS(ms)					((sim_time_t) ((ms) * SIM_CLOCK_HZ / 1000.0 + 0.5))
+// Assumed EEPROM page erase and write time in milliseconds
+#define SIM_EEPROM_WRITE_MS				8
+// Scheduler passes without sleeping before the replay fails (time can not move while the firmware runs)
+#define SIM_BUSY_PASSES					100000
+// Replay length after the last trace line when there is no end line
+#define SIM_END_MS						5000
+// Trace limits
+#define SIM_TRACE_LINES					4096
+#define SIM_LINE_LEN					160
+#define SIM_TRANSITIONS					4096
+
+typedef uint64_t sim_time_t;
+
+enum SIM_LINE { LINE_COMMENT = 0, LINE_INPUT, LINE_STATE, LINE_EXPECT, LINE_MARK, LINE_POKE, LINE_END,
+				 EVENT_NVM_DONE, EVENT_NVM_READY, EVENT_RTC };		// Trace lines, then simulated events
+enum SIM_SM   { SIM_POWER = 0, SIM_PROG, SIM_HORN, SIM_SM_COUNT };
+enum SIM_CTX  { CTX_MAIN = 0, CTX_RTC, CTX_PORTA, CTX_PORTC, CTX_NVM, CTX_COUNT };
+enum SIM_COUNT { COUNT_RTC = 0, COUNT_PORT, COUNT_WAKES, COUNT_STANDBY_WAKES, COUNT_HORN, COUNT_EEPROM, COUNT_CONFIG, COUNT_LOG, COUNT_PSAVE, COUNT_IDLE, COUNT_N };
+
+typedef struct
+{
+	const char *name;
+	uint8_t value;
+} sim_name_t;
+
+typedef struct
+{
+	uint8_t type;										// SIM_LINE
+	uint8_t id;											// Input bit, state machine, output or count
+	uint8_t value;										// Input level, state or poke value
+	char op;											// Expect comparison
+	double ms;											// Line time
+	double check;										// Expect value
+	sim_time_t t;										// Line time in RTC clocks
+	volatile uint8_t *reg;								// Poke register
+	int number;											// Line number in the trace file
+	char text[SIM_LINE_LEN];							// Line as read (record mode prints it again)
+} sim_line_t;
+
+typedef struct
+{
+	uint8_t sm;											// SIM_SM
+	uint8_t state;
+	double ms;
+} sim_transition_t;
+
+typedef struct
+{
+	const char *name;
+	volatile uint16_t *cc;
+	volatile uint16_t *buf;
+	volatile uint8_t *ctrlc;
+	volatile uint8_t *ctrle;
+	uint8_t timer;										// Index in sim_timers
+	uint8_t pol_bp;
+	uint8_t mode_gm;
+	uint8_t bv_bm;
+	uint16_t buf_last;									// Compare buffer value last seen
+} sim_pwm_t;
+
+typedef struct
+{
+	volatile uint8_t *ctrla;
+	volatile uint8_t *ctrlgset;
+	volatile uint8_t *ctrlgclr;
+	volatile uint8_t *ctrlhset;
+	volatile uint8_t *ctrlhclr;
+	volatile uint16_t *per;
+	volatile uint16_t *perbuf;
+	uint8_t perbv_bm;
+	uint16_t perbuf_last;
+} sim_timer_t;
+
+/*
+ * Registers
+ */
+PORT_t PORTA, PORTC, PORTD, PORTR;
+TC4_t TCC4;
+TC5_t TCC5, TCD5;
+RTC_t RTC;
+OSC_t OSC;
+CLK_t CLK;
+PMIC_t PMIC;
+PR_t PR;
+PORTCFG_t PORTCFG;
+RST_t RST;
+NVM_t NVM;
+XCL_t XCL;
+USART_t USARTC0, USARTD0;
+EDMA_t EDMA;
+EVSYS_t EVSYS;
+ADC_t ADCA;
+WDT_t WDT;
+volatile uint8_t CCP, GPIO0, GPIO1;
+
+/*
+ * EEPROM
+ *  The section start is aligned so the 16-bit EEMEM addresses of main.c never wrap.
+ */
+extern uint8_t __start_sim_eemem[];
+extern uint8_t __stop_sim_eemem[];
+static uint8_t sim_eeprom_origin[0] __attribute__((section("sim_eemem"), aligned(1024), used));
+uintptr_t sim_eeprom_mapped;							// MAPPED_EEPROM_START
+static uint16_t sim_eeprom_base;						// EEMEM address of EEPROM byte 0
+static uint8_t sim_eeprom[EEPROM_SIZE];					// EEPROM contents
+static uint8_t sim_eeprom_buffer[EEPROM_SIZE];			// Memory mapped EEPROM (page buffer loads)
+static sim_time_t sim_nvm_done;							// End of the page write in progress
+static unsigned long sim_eeprom_writes[3];				// Page writes of the configuration, log and statistics
+// EEPROM offset inside an EEMEM variable
+#define SIM_EEMEM_IN(offset, var)		(((offset) >= (uint16_t) ((uintptr_t) (var) - sim_eeprom_base)) \
+										 && ((offset) < (uint16_t) ((uintptr_t) (var) - sim_eeprom_base) + sizeof(var)))
+
+/*
+ * Tables
+ */
+#define SIM_IN(name, pin, invert, wake, debounce, gesture)	{ #name, IN_##name##_bm },
+static const sim_name_t sim_inputs[] =
+{
+	IN_PORTA_TABLE(SIM_IN) IN_PORTC_TABLE(SIM_IN)
+	{ NULL, 0 }
+};
+
+static const char *const sim_sm_names[SIM_SM_COUNT] = { "power", "prog", "horn" };
+static const sim_name_t sim_states[SIM_SM_COUNT][11] =
+{
+	{
+		{ "RESET", SM_POWER_RESET }, { "DOWN", SM_POWER_DOWN }, { "ON_IGN", SM_POWER_ON_IGN },
+		{ "ON_SW", SM_POWER_ON_SW }, { NULL, 0 }
+	},
+	{
+		{ "RESET", SM_PROG_RESET }, { "ACTIVATE", SM_PROG_ACTIVATE }, { "WAIT", SM_PROG_WAIT },
+		{ "ON_WAIT", SM_PROG_ON_WAIT }, { "OFF_WAIT", SM_PROG_OFF_WAIT }, { "DISPLAY_DWELL", SM_PROG_DISPLAY_DWELL },
+		{ "DISPLAY", SM_PROG_DISPLAY }, { "DIM_WAIT", SM_PROG_DIM_WAIT }, { "DIM_ON_WAIT", SM_PROG_DIM_ON_WAIT },
+		{ "DIM_OFF_WAIT", SM_PROG_DIM_OFF_WAIT }, { NULL, 0 }
+	},
+	{
+		{ "OFF", HORN_OFF }, { "STARTING", HORN_STARTING }, { "ON", HORN_ON }, { NULL, 0 }
+	}
+};
+
+#define SIM_PWM(name, timer, type, cc, invert, shift) \
+	{ #name, &timer.CC##cc, &timer.CC##cc##BUF, &timer.CTRLC, &timer.CTRLE, SIM_TIMER_##timer, type##_POL##cc##_bp, \
+	  TC_CC##cc##MODE_COMP_gc * 3, type##_CC##cc##BV_bm, 0 },
+enum SIM_TIMER { SIM_TIMER_TCC5 = 0, SIM_TIMER_TCC4, SIM_TIMER_TCD5, SIM_TIMER_COUNT };
+static sim_pwm_t sim_pwm[CH_COUNT] =
+{
+	PWM_TABLE(SIM_PWM)
+};
+#define SIM_TC(timer, type) \
+	{ &timer.CTRLA, &timer.CTRLGSET, &timer.CTRLGCLR, &timer.CTRLHSET, &timer.CTRLHCLR, &timer.PER, &timer.PERBUF, \
+	  type##_PERBV_bm, 0 }
+static sim_timer_t sim_timers[SIM_TIMER_COUNT] =
+{
+	SIM_TC(TCC5, TC5), SIM_TC(TCC4, TC4), SIM_TC(TCD5, TC5)
+};
+// Outputs that expect checks and the timeline report: PWM channels, then the Horn
+#define SIM_OUT_HEN						CH_COUNT
+#define SIM_OUT_COUNT					(CH_COUNT + 1)
+
+static const char *const sim_count_names[COUNT_N] = { "RTC", "PORT", "WAKES", "STANDBY_WAKES", "HORN_COUNT", "EEPROM", "CONFIG", "LOG", "PSAVE_MS", "IDLE_MS" };
+
+#define SIM_REG(reg)					{ #reg, &reg }
+static const struct
+{
+	const char *name;
+	volatile uint8_t *reg;
+} sim_regs[] =
+{
+	SIM_REG(PORTA.INTCTRL), SIM_REG(PORTC.INTCTRL), SIM_REG(PORTA.INTMASK), SIM_REG(PORTC.INTMASK),
+	SIM_REG(PORTA.DIR), SIM_REG(PORTC.DIR), SIM_REG(PORTD.DIR), SIM_REG(PORTD.OUT), SIM_REG(RTC.INTCTRL),
+	SIM_REG(RTC.CTRL), SIM_REG(CLK.RTCCTRL), SIM_REG(CLK.CTRL), SIM_REG(OSC.CTRL), SIM_REG(PMIC.CTRL),
+	SIM_REG(PR.PRGEN), SIM_REG(PR.PRPC), SIM_REG(PR.PRPD), SIM_REG(WDT.CTRL), SIM_REG(TCC4.CTRLA),
+	SIM_REG(TCC5.CTRLA), SIM_REG(TCD5.CTRLA), SIM_REG(TCD5.CTRLE),
+	{ NULL, NULL }
+};
+
+/*
+ * Simulation state
+ */
+static const char *sim_trace_name;
+static sim_line_t sim_lines[SIM_TRACE_LINES];
+static int sim_line_count;
+static int sim_line_next;								// Next timed line to run
+static double sim_tolerance = 1.0;
+static sim_time_t sim_end;
+static sim_transition_t sim_seen[SIM_TRANSITIONS];
+static int sim_seen_count;
+static uint8_t sim_last_state[SIM_SM_COUNT];
+static double sim_last_out[SIM_OUT_COUNT];
+static uint8_t opt_timeline, opt_stats, opt_bench, opt_record;
+
+static sim_time_t sim_now;								// Simulated time
+static uint8_t sim_sreg_i;								// Global interrupt flag
+static uint8_t sim_sleep_mode;
+static uint8_t sim_sleep_en;
+static uint8_t sim_in;									// Input levels (IN_xxx_bm)
+static uint8_t sim_rtc_on;								// RTC counting
+static sim_time_t sim_rtc_start;						// Start of the current RTC period
+static uint8_t sim_wdt_on;
+static sim_time_t sim_wdt_timeout;
+static sim_time_t sim_wdt_last;
+static sim_time_t sim_wdt_gap;							// Longest time between watchdog resets
+static unsigned long sim_busy;							// Scheduler passes since the last sleep
+static int sim_errors;
+static uint8_t sim_reported_rtc_miss;
+static uint8_t sim_reported_psave;
+
+// Event counts
+static unsigned long sim_passes;
+static unsigned long sim_cli_count;
+static unsigned long sim_isr_calls[CTX_COUNT];
+static unsigned long sim_rtc_stretched;					// RTC periods longer than one tick
+static unsigned long sim_rtc_by_power[4];
+static unsigned long sim_sleeps_idle, sim_sleeps_psave;
+static sim_time_t sim_time_idle, sim_time_psave;
+static double sim_count_mark[COUNT_N];
+
+// Host cycles
+static uint8_t sim_ctx = CTX_MAIN;
+static uint64_t sim_mark;								// Host cycles when firmware code last resumed
+static uint64_t sim_ctx_cycles[CTX_COUNT];
+static uint64_t sim_ctx_max[CTX_COUNT];
+static uint64_t sim_pass_cycles;						// Main cycles at the start of this scheduler pass
+
+/*
+ * Host cycle counter (TSC on x86, nanoseconds elsewhere)
+ */
+static inline uint64_t sim_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+/*
+ * Firmware code stops running, simulation code starts (its cycles are not counted)
+ */
+static inline void sim_enter(void)
+{
+	sim_ctx_cycles[sim_ctx] += sim_cycles() - sim_mark;
+}
+
+/*
+ * Simulation code ends, firmware code runs again
+ */
+static inline void sim_leave(void)
+{
+	sim_mark = sim_cycles();
+}
+
+/*
+ * Report a replay failure
+ */
+static void sim_error(const char *format, ...)
+{
+	va_list args;
+
+	fprintf(stderr, "%s: %.3f ms: ", sim_trace_name, SIM_MS(sim_now));
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+	sim_errors++;
+}
+
+static void sim_finish(void) __attribute__((noreturn));
+
+/*
+ * Report a failure the replay can not continue from
+ */
+static void sim_fatal(const char *format, ...) __attribute__((noreturn));
+static void sim_fatal(const char *format, ...)
+{
+	va_list args;
+
+	fprintf(stderr, "%s: %.3f ms: ", sim_trace_name, SIM_MS(sim_now));
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+	sim_errors++;
+	sim_finish();
+}
+
+/*
+ * Return the name of an entry of a name table
+ */
+static const char *sim_name(const sim_name_t *names, uint8_t value)
+{
+	for (; names->name; names++)
+	{
+		if (names->value == value)
+		{
+			return names->name;
+		}
+	}
+	return "?";
+}
+
+/*
+ * Find a name in a name table, returns -1 when it is not there
+ */
+static int sim_find(const sim_name_t *names, const char *name)
+{
+	for (; names->name; names++)
+	{
+		if (!strcmp(names->name, name))
+		{
+			return names->value;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Return TRUE when an interrupt level (1 low - 3 high) is enabled in the PMIC
+ */
+static uint8_t sim_level_on(uint8_t level)
+{
+	return level && (PMIC.CTRL & (1 << (level - 1)));
+}
+
+/*
+ * Return TRUE when a timer clock runs (stopped by its prescaler and in Power Save and Power Down)
+ */
+static uint8_t sim_timer_running(const sim_timer_t *tc, uint8_t sleeping)
+{
+	return (*tc->ctrla & 0x0F) && !(sleeping && (sim_sleep_mode != SLEEP_SMODE_IDLE_gc));
+}
+
+/*
+ * Apply the buffered period and compare values of a timer (timer UPDATE)
+ */
+static void sim_timer_update(uint8_t timer)
+{
+	sim_timer_t *tc = &sim_timers[timer];
+	uint8_t ch;
+
+	if (*tc->ctrlhset & tc->perbv_bm)
+	{
+		*tc->per = *tc->perbuf;
+	}
+	for (ch = 0; ch < CH_COUNT; ch++)
+	{
+		if ((sim_pwm[ch].timer == timer) && (*tc->ctrlhset & sim_pwm[ch].bv_bm))
+		{
+			*sim_pwm[ch].cc = *sim_pwm[ch].buf;
+		}
+	}
+	*tc->ctrlhset = 0;
+	*tc->ctrlhclr = 0;
+}
+
+/*
+ * Bring the registers up to date with what the firmware wrote since the last step
+ *  Port set and clear registers, buffered timer writes and commands, NVM commands and RTC enable.
+ */
+static void sim_sync(void)
+{
+	PORT_t *const ports[] = { &PORTA, &PORTC, &PORTD, &PORTR };
+	uint8_t i;
+
+	for (i = 0; i < sizeof(ports) / sizeof(ports[0]); i++)
+	{
+		PORT_t *port = ports[i];
+
+		// Clear before set when both were written since the last step (port init clears all pins first)
+		port->DIR = ((port->DIR & ~port->DIRCLR) | port->DIRSET) ^ port->DIRTGL;
+		port->OUT = ((port->OUT & ~port->OUTCLR) | port->OUTSET) ^ port->OUTTGL;
+		port->DIRSET = port->DIRCLR = port->DIRTGL = 0;
+		port->OUTSET = port->OUTCLR = port->OUTTGL = 0;
+		port->INTFLAGS = 0;								// Interrupt flags are cleared by writing ones
+	}
+	PORTCFG.MPCMASK = 0;
+	// A compare buffer write sets its buffer valid flag until the next timer UPDATE
+	for (i = 0; i < CH_COUNT; i++)
+	{
+		sim_pwm_t *pwm = &sim_pwm[i];
+
+		if (*pwm->buf != pwm->buf_last)
+		{
+			pwm->buf_last = *pwm->buf;
+			*sim_timers[pwm->timer].ctrlhset |= pwm->bv_bm;
+		}
+	}
+	for (i = 0; i < SIM_TIMER_COUNT; i++)
+	{
+		sim_timer_t *tc = &sim_timers[i];
+
+		if (*tc->perbuf != tc->perbuf_last)
+		{
+			tc->perbuf_last = *tc->perbuf;
+			*tc->ctrlhset |= tc->perbv_bm;
+		}
+		if ((*tc->ctrlgset & TC_CMD_RESET_gc) == TC_CMD_UPDATE_gc)
+		{
+			sim_timer_update(i);
+		}
+		*tc->ctrlgset &= ~TC_CMD_RESET_gc;
+		*tc->ctrlgclr = *tc->ctrlgset;
+		*tc->ctrlhclr = *tc->ctrlhset;
+	}
+	// NVM commands
+	if (NVM.CTRLA & NVM_CMDEX_bm)
+	{
+		uint16_t page = (uint16_t) ((NVM.ADDR1 << 8) | NVM.ADDR0) - sim_eeprom_base;
+
+		NVM.CTRLA = 0;
+		if (NVM.CMD == NVM_CMD_ERASE_EEPROM_BUFFER_gc)
+		{
+			memcpy(sim_eeprom_buffer, sim_eeprom, EEPROM_SIZE);
+		}
+		else if (NVM.CMD == NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc)
+		{
+			page &= ~(EEPROM_PAGE_SIZE - 1);
+			if (page >= EEPROM_SIZE)
+			{
+				sim_error("EEPROM page write outside the EEPROM (0x%04X)", page);
+			}
+			else
+			{
+				memcpy(&sim_eeprom[page], &sim_eeprom_buffer[page], EEPROM_PAGE_SIZE);
+				NVM.STATUS |= NVM_NVMBUSY_bm;
+				sim_nvm_done = sim_now + SIM_COUNTS(SIM_EEPROM_WRITE_MS);
+				sim_eeprom_writes[SIM_EEMEM_IN(page, eeprom_log) ? 1 : SIM_EEMEM_IN(page, eeprom_stats) ? 2 : 0]++;
+			}
+		}
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	}
+	// Oscillators start at once, the firmware spins on the ready flags without calling any hook
+	OSC.STATUS = OSC_RC2MRDY_bm | OSC_RC32MRDY_bm | OSC_RC32KRDY_bm;
+	// RTC counts when its clock is enabled and its prescaler is not off
+	if ((CLK.RTCCTRL & (1 << CLK_RTCEN_bp)) && (RTC.CTRL & 0x07))
+	{
+		if (!sim_rtc_on)
+		{
+			sim_rtc_on = TRUE;
+			sim_rtc_start = sim_now;
+		}
+	}
+	else
+	{
+		sim_rtc_on = FALSE;
+	}
+	RTC.CNT = sim_rtc_on ? (uint16_t) (sim_now - sim_rtc_start) : RTC.CNT;
+}
+
+/*
+ * Return an output duty cycle in percent
+ */
+static double sim_output(uint8_t out)
+{
+	const sim_pwm_t *pwm;
+	uint16_t per;
+	uint16_t cc;
+	double on;
+
+	if (out == SIM_OUT_HEN)
+	{
+		return (PORTD.OUT & PORTD.DIR & OUT_HEN_bm) ? 100.0 : 0.0;
+	}
+	pwm = &sim_pwm[out];
+	if (!(*pwm->ctrle & pwm->mode_gm))
+	{
+		return 0.0;										// Compare output disabled, the pin is a low output
+	}
+	per = *sim_timers[pwm->timer].per;
+	cc = (*pwm->cc > per) ? per : *pwm->cc;
+	on = per ? (double) cc / per : 0.0;
+	if (!(*pwm->ctrlc & (1 << pwm->pol_bp)))
+	{
+		on = 1.0 - on;									// High while the counter is above the compare value
+	}
+	return on * 100.0;
+}
+
+/*
+ * Return a count (since reset) for the count checks and statistics
+ */
+static double sim_count(uint8_t count)
+{
+	switch (count)
+	{
+	case COUNT_RTC:
+		return sim_isr_calls[CTX_RTC];
+	case COUNT_PORT:
+		return sim_isr_calls[CTX_PORTA] + sim_isr_calls[CTX_PORTC];
+	case COUNT_WAKES:
+		return sim_sleeps_idle + sim_sleeps_psave;
+	case COUNT_STANDBY_WAKES:
+		return standby_wakes;
+	case COUNT_HORN:
+		return stats.horn_count;
+	case COUNT_EEPROM:
+		return sim_eeprom_writes[0] + sim_eeprom_writes[1] + sim_eeprom_writes[2];
+	case COUNT_CONFIG:
+		return sim_eeprom_writes[0];
+	case COUNT_LOG:
+		return sim_eeprom_writes[1];
+	case COUNT_PSAVE:
+		return SIM_MS(sim_time_psave);
+	default:
+		return SIM_MS(sim_time_idle);
+	}
+}
+
+/*
+ * Record state transitions and output changes since the last step
+ */
+static void sim_observe(void)
+{
+	const uint8_t state[SIM_SM_COUNT] = { power_state, prog_state, horn_state };
+	uint8_t i;
+
+	for (i = 0; i < SIM_SM_COUNT; i++)
+	{
+		if (state[i] != sim_last_state[i])
+		{
+			sim_last_state[i] = state[i];
+			if (sim_seen_count < SIM_TRANSITIONS)
+			{
+				sim_seen[sim_seen_count].sm = i;
+				sim_seen[sim_seen_count].state = state[i];
+				sim_seen[sim_seen_count].ms = SIM_MS(sim_now);
+				sim_seen_count++;
+			}
+			if (opt_timeline)
+			{
+				printf("%10.3f  %s %s\n", SIM_MS(sim_now), sim_sm_names[i], sim_name(sim_states[i], state[i]));
+			}
+		}
+	}
+	if (opt_timeline)
+	{
+		for (i = 0; i < SIM_OUT_COUNT; i++)
+		{
+			double out = sim_output(i);
+
+			if (out != sim_last_out[i])
+			{
+				sim_last_out[i] = out;
+				printf("%10.3f  %-5s %5.1f%%\n", SIM_MS(sim_now), (i == SIM_OUT_HEN) ? "HEN" : sim_pwm[i].name, out);
+			}
+		}
+	}
+}
+
+/*
+ * Simulation step inside firmware code (cli, sei, watchdog reset)
+ */
+static void sim_hook(void)
+{
+	sim_enter();
+	sim_sync();
+	sim_observe();
+	sim_leave();
+}
+
+/*
+ * Run an interrupt handler
+ */
+static void sim_isr(uint8_t ctx, void (*vector)(void))
+{
+	uint8_t saved = sim_ctx;
+	uint64_t before = sim_ctx_cycles[ctx];
+
+	sim_isr_calls[ctx]++;
+	sim_sreg_i = FALSE;									// Interrupts are disabled in a handler
+	sim_ctx = ctx;
+	sim_leave();
+	vector();
+	sim_enter();
+	sim_ctx = saved;
+	sim_sreg_i = TRUE;
+	if (sim_ctx_cycles[ctx] - before > sim_ctx_max[ctx])
+	{
+		sim_ctx_max[ctx] = sim_ctx_cycles[ctx] - before;
+	}
+	sim_sync();
+	sim_observe();
+}
+
+/*
+ * Return the time of the next RTC overflow
+ */
+static sim_time_t sim_rtc_overflow(void)
+{
+	sim_time_t cnt = sim_now - sim_rtc_start;
+
+	if (cnt > (sim_time_t) RTC.PER + 1)
+	{
+		if (!sim_reported_rtc_miss)
+		{
+			sim_reported_rtc_miss = TRUE;
+			sim_error("RTC period %u set below the count %u, the RTC wraps before it overflows", RTC.PER,
+					  (unsigned) cnt);
+		}
+		return sim_rtc_start + 0x10000 + RTC.PER + 1;
+	}
+	return sim_rtc_start + RTC.PER + 1;
+}
+
+/*
+ * Move simulated time forward while sleeping
+ */
+static void sim_advance(sim_time_t t)
+{
+	uint8_t i;
+
+	if (t == sim_now)
+	{
+		return;
+	}
+	// Buffered timer values are applied at the end of the first timer period
+	for (i = 0; i < SIM_TIMER_COUNT; i++)
+	{
+		if (sim_timer_running(&sim_timers[i], TRUE) && (*sim_timers[i].ctrlhset))
+		{
+			sim_timer_update(i);
+		}
+	}
+	if (sim_wdt_on && (t - sim_wdt_last > sim_wdt_timeout))
+	{
+		sim_now = sim_wdt_last + sim_wdt_timeout;
+		sim_fatal("watchdog timeout, last reset at %.3f ms", SIM_MS(sim_wdt_last));
+	}
+	if (sim_sleep_mode == SLEEP_SMODE_IDLE_gc)
+	{
+		sim_time_idle += t - sim_now;
+	}
+	else
+	{
+		sim_time_psave += t - sim_now;
+	}
+	sim_now = t;
+	if (sim_rtc_on)
+	{
+		RTC.CNT = (uint16_t) (sim_now - sim_rtc_start);
+	}
+}
+
+/*
+ * Set the input levels, the port interrupts run for enabled pins that changed
+ */
+static uint8_t sim_inputs_set(uint8_t in)
+{
+	uint8_t changed = in ^ sim_in;
+	uint8_t woken = FALSE;
+
+	sim_in = in;
+	PORTA.IN = (PORTA.IN & ~IN_PORTA_gm) | (in & IN_PORTA_gm);	// Pins read after PORT_INVEN
+	PORTC.IN = (PORTC.IN & ~IN_PORTC_gm) | (in & IN_PORTC_gm);
+	if ((changed & IN_PORTA_gm & PORTA.INTMASK) && sim_level_on(PORTA.INTCTRL & 0x03))
+	{
+		sim_isr(CTX_PORTA, PORTA_INT_vect);
+		woken = TRUE;
+	}
+	if ((changed & IN_PORTC_gm & PORTC.INTMASK) && sim_level_on(PORTC.INTCTRL & 0x03))
+	{
+		sim_isr(CTX_PORTC, PORTC_INT_vect);
+		woken = TRUE;
+	}
+	return woken;
+}
+
+/*
+ * Run a check line
+ */
+static void sim_check(const sim_line_t *line)
+{
+	double value = (line->id < SIM_OUT_COUNT) ? sim_output(line->id)
+				 : sim_count(line->id - SIM_OUT_COUNT) - sim_count_mark[line->id - SIM_OUT_COUNT];
+	uint8_t pass;
+
+	switch (line->op)
+	{
+	case '<':
+		pass = value < line->check;
+		break;
+	case '>':
+		pass = value > line->check;
+		break;
+	default:
+		pass = (value > line->check - 0.5) && (value < line->check + 0.5);
+		break;
+	}
+	if (!pass)
+	{
+		sim_error("line %d: expected %s %c %g, got %g", line->number,
+				  (line->id < SIM_OUT_COUNT) ? ((line->id == SIM_OUT_HEN) ? "HEN" : sim_pwm[line->id].name)
+											 : sim_count_names[line->id - SIM_OUT_COUNT],
+				  line->op, line->check, value);
+	}
+}
+
+/*
+ * Move to the next event and run it, returns TRUE when an interrupt woke the processor
+ */
+static uint8_t sim_step(void)
+{
+	sim_time_t next = sim_end;
+	uint8_t event = LINE_END;
+	const sim_line_t *line = NULL;
+	sim_time_t t;
+	uint8_t i;
+
+	// Timed trace lines (checks before interrupts at the same time)
+	while ((sim_line_next < sim_line_count) && (sim_lines[sim_line_next].type == LINE_COMMENT
+												|| sim_lines[sim_line_next].type == LINE_STATE))
+	{
+		sim_line_next++;
+	}
+	if (sim_line_next < sim_line_count)
+	{
+		line = &sim_lines[sim_line_next];
+		if (line->t <= next)
+		{
+			next = (line->t < sim_now) ? sim_now : line->t;
+			event = line->type;
+		}
+	}
+	// EEPROM Ready is a level interrupt
+	if ((NVM.STATUS & NVM_NVMBUSY_bm) && (sim_nvm_done < next))
+	{
+		next = sim_nvm_done;
+		event = EVENT_NVM_DONE;
+	}
+	else if (!(NVM.STATUS & NVM_NVMBUSY_bm) && sim_level_on(NVM.INTCTRL & 0x03) && (sim_now < next))
+	{
+		next = sim_now;
+		event = EVENT_NVM_READY;
+	}
+	if (sim_rtc_on && (sim_sleep_mode != SLEEP_SMODE_PDOWN_gc))
+	{
+		t = sim_rtc_overflow();
+		if (t < next)
+		{
+			next = t;
+			event = EVENT_RTC;
+		}
+	}
+	if ((event == LINE_END) && (next >= sim_end))
+	{
+		sim_advance(sim_end);
+		sim_finish();
+	}
+	sim_advance(next);
+	switch (event)
+	{
+	case LINE_INPUT:
+		sim_line_next++;
+		return sim_inputs_set(line->value ? (sim_in | line->id) : (sim_in & ~line->id));
+	case LINE_EXPECT:
+		sim_line_next++;
+		sim_check(line);
+		return FALSE;
+	case LINE_MARK:
+		sim_line_next++;
+		for (i = 0; i < COUNT_N; i++)
+		{
+			sim_count_mark[i] = sim_count(i);
+		}
+		return FALSE;
+	case LINE_POKE:
+		sim_line_next++;
+		*line->reg = line->value;
+		sim_sync();
+		return FALSE;
+	case EVENT_NVM_DONE:
+		NVM.STATUS &= ~NVM_NVMBUSY_bm;
+		return FALSE;
+	case EVENT_NVM_READY:
+		sim_isr(CTX_NVM, NVM_EE_vect);
+		return TRUE;
+	case EVENT_RTC:
+		sim_rtc_start = sim_now;
+		RTC.CNT = 0;
+		if (RTC.PER + 1 > RTC_TICK_COUNTS)
+		{
+			sim_rtc_stretched++;
+		}
+		if (sim_level_on(RTC.INTCTRL & 0x03))
+		{
+			sim_rtc_by_power[power_state & 3]++;
+			sim_isr(CTX_RTC, RTC_OVF_vect);
+			return TRUE;
+		}
+		RTC.INTFLAGS |= RTC_OVFIF_bm;
+		return FALSE;
+	default:
+		sim_line_next++;
+		sim_finish();
+	}
+}
+
+/*
+ * Fail a Power Save entry that freezes a PWM output part way through its period
+ */
+static void sim_sleep_check(void)
+{
+	uint8_t ch;
+
+	if ((sim_sleep_mode != SLEEP_SMODE_PSAVE_gc) || sim_reported_psave)
+	{
+		return;
+	}
+	for (ch = 0; ch < CH_COUNT; ch++)
+	{
+		const sim_pwm_t *pwm = &sim_pwm[ch];
+		const sim_timer_t *tc = &sim_timers[pwm->timer];
+
+		if (!(*pwm->ctrle & pwm->mode_gm))
+		{
+			continue;
+		}
+		if ((*tc->ctrlhset & pwm->bv_bm) || ((*pwm->cc != 0) && (*pwm->cc < *tc->per)))
+		{
+			sim_reported_psave = TRUE;
+			sim_error("Power Save with %s at a %.1f%% duty cycle%s", pwm->name, sim_output(ch),
+					  (*tc->ctrlhset & pwm->bv_bm) ? " and a buffered update pending" : "");
+			return;
+		}
+	}
+}
+
+/*
+ * avr-libc replacements
+ */
+void cli(void)
+{
+	sim_cli_count++;
+	sim_sreg_i = FALSE;
+	sim_hook();
+}
+
+void sei(void)
+{
+	sim_sreg_i = TRUE;
+	sim_hook();
+}
+
+uint8_t sim_atomic_enter(void)
+{
+	uint8_t sreg = sim_sreg_i;
+
+	cli();
+	return sreg;
+}
+
+uint8_t sim_atomic_exit(uint8_t sreg)
+{
+	if (sreg)
+	{
+		sei();
+	}
+	return 0;
+}
+
+void set_sleep_mode(uint8_t mode)
+{
+	sim_sleep_mode = mode;
+}
+
+void sleep_enable(void)
+{
+	sim_sleep_en = TRUE;
+}
+
+void sleep_disable(void)
+{
+	sim_sleep_en = FALSE;
+}
+
+void sleep_cpu(void)
+{
+	sim_enter();
+	if (sim_sleep_en)
+	{
+		if (!sim_sreg_i)
+		{
+			sim_fatal("sleep with interrupts disabled never wakes up");
+		}
+		sim_sync();
+		sim_observe();
+		sim_sleep_check();
+		if (sim_sleep_mode == SLEEP_SMODE_IDLE_gc)
+		{
+			sim_sleeps_idle++;
+		}
+		else
+		{
+			sim_sleeps_psave++;
+		}
+		sim_busy = 0;
+		while (!sim_step());
+	}
+	sim_leave();
+}
+
+void wdt_enable(uint8_t timeout)
+{
+	WDT.CTRL = WDT_ENABLE_bm | WDT_CEN_bm | (timeout << 2);
+	sim_wdt_on = TRUE;
+	sim_wdt_timeout = SIM_COUNTS(15 << timeout);
+	sim_wdt_last = sim_now;
+}
+
+void wdt_disable(void)
+{
+	WDT.CTRL = WDT_CEN_bm;
+	sim_wdt_on = FALSE;
+}
+
+void wdt_reset(void)
+{
+	sim_enter();
+	if (sim_now - sim_wdt_last > sim_wdt_gap)
+	{
+		sim_wdt_gap = sim_now - sim_wdt_last;
+	}
+	sim_wdt_last = sim_now;
+	if ((sim_ctx == CTX_MAIN) && sim_sreg_i)
+	{
+		// Start of a main loop pass
+		sim_passes++;
+		if (sim_ctx_cycles[CTX_MAIN] - sim_pass_cycles > sim_ctx_max[CTX_MAIN])
+		{
+			sim_ctx_max[CTX_MAIN] = sim_ctx_cycles[CTX_MAIN] - sim_pass_cycles;
+		}
+		sim_pass_cycles = sim_ctx_cycles[CTX_MAIN];
+		if (++sim_busy > SIM_BUSY_PASSES)
+		{
+			sim_fatal("%d scheduler passes without sleeping", SIM_BUSY_PASSES);
+		}
+	}
+	sim_sync();
+	sim_observe();
+	sim_leave();
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t len)
+{
+	uint16_t addr = (uint16_t) (uintptr_t) src - sim_eeprom_base;
+
+	if (addr + len > EEPROM_SIZE)
+	{
+		sim_fatal("EEPROM read outside the EEPROM (0x%04X)", addr);
+	}
+	memcpy(dst, &sim_eeprom[addr], len);
+}
+
+/*
+ * Read the trace file
+ */
+static void sim_load(const char *name)
+{
+	FILE *file = fopen(name, "r");
+	char text[SIM_LINE_LEN];
+	int number = 0;
+	sim_time_t last = 0;
+	uint8_t ended = FALSE;
+
+	if (!file)
+	{
+		perror(name);
+		exit(2);
+	}
+	while (fgets(text, sizeof(text), file))
+	{
+		sim_line_t *line = &sim_lines[sim_line_count];
+		char word[4][40] = { "", "", "", "" };
+		char *comment;
+		int value;
+		int n;
+
+		number++;
+		if (sim_line_count == SIM_TRACE_LINES)
+		{
+			fprintf(stderr, "%s:%d: too many lines\n", name, number);
+			exit(2);
+		}
+		text[strcspn(text, "\r\n")] = 0;
+		memset(line, 0, sizeof(*line));
+		strcpy(line->text, text);
+		line->number = number;
+		sim_line_count++;
+		if ((comment = strchr(text, '#')))
+		{
+			*comment = 0;
+		}
+		if (sscanf(text, " tolerance %lf", &sim_tolerance) == 1)
+		{
+			continue;
+		}
+		n = sscanf(text, " %lf %39s %39s %39s %39s", &line->ms, word[0], word[1], word[2], word[3]);
+		if (n <= 0)
+		{
+			continue;									// Comment or blank line
+		}
+		line->t = SIM_COUNTS(line->ms);
+		if ((n < 2) || (line->t < last))
+		{
+			fprintf(stderr, "%s:%d: %s\n", name, number, (n < 2) ? "expected a time and a command" : "time goes back");
+			exit(2);
+		}
+		last = line->t;
+		if ((value = sim_find(sim_inputs, word[0])) >= 0)
+		{
+			line->type = LINE_INPUT;
+			line->id = value;
+			line->value = atoi(word[1]) != 0;
+		}
+		else if (!strcmp(word[0], "end"))
+		{
+			line->type = LINE_END;
+			ended = TRUE;
+		}
+		else if (!strcmp(word[0], "mark"))
+		{
+			line->type = LINE_MARK;
+		}
+		else if (!strcmp(word[0], "poke"))
+		{
+			line->type = LINE_POKE;
+			for (value = 0; sim_regs[value].name && strcmp(sim_regs[value].name, word[1]); value++);
+			line->reg = sim_regs[value].reg;
+			line->value = strtol(word[2], NULL, 0);
+			if (!line->reg)
+			{
+				fprintf(stderr, "%s:%d: unknown register %s\n", name, number, word[1]);
+				exit(2);
+			}
+		}
+		else if (!strcmp(word[0], "expect"))
+		{
+			line->type = LINE_EXPECT;
+			line->op = word[2][0];
+			line->check = atof(word[3]);
+			for (value = 0; value < SIM_OUT_COUNT + COUNT_N; value++)
+			{
+				const char *out = (value < CH_COUNT) ? sim_pwm[value].name : (value == SIM_OUT_HEN) ? "HEN"
+								: sim_count_names[value - SIM_OUT_COUNT];
+
+				if (!strcmp(out, word[1]))
+				{
+					break;
+				}
+			}
+			line->id = value;
+			if ((n < 5) || (value == SIM_OUT_COUNT + COUNT_N) || !strchr("=<>", line->op) || word[2][1])
+			{
+				fprintf(stderr, "%s:%d: expected: <ms> expect <output|count> =|<|> <value>\n", name, number);
+				exit(2);
+			}
+		}
+		else
+		{
+			for (value = 0; (value < SIM_SM_COUNT) && strcmp(sim_sm_names[value], word[0]); value++);
+			line->type = LINE_STATE;
+			line->id = value;
+			if ((value == SIM_SM_COUNT) || ((n = sim_find(sim_states[value], word[1])) < 0))
+			{
+				fprintf(stderr, "%s:%d: unknown command %s %s\n", name, number, word[0], word[1]);
+				exit(2);
+			}
+			line->value = n;
+		}
+	}
+	fclose(file);
+	sim_end = ended ? last : last + SIM_COUNTS(SIM_END_MS);
+}
+
+/*
+ * Compare the state transitions of this run with the ones in the trace
+ */
+static int sim_compare(void)
+{
+	int checked = 0;
+	uint8_t sm;
+
+	for (sm = 0; sm < SIM_SM_COUNT; sm++)
+	{
+		int seen = 0;
+		int i;
+
+		for (i = 0; i < sim_line_count; i++)
+		{
+			const sim_line_t *line = &sim_lines[i];
+
+			if ((line->type != LINE_STATE) || (line->id != sm))
+			{
+				continue;
+			}
+			while ((seen < sim_seen_count) && (sim_seen[seen].sm != sm))
+			{
+				seen++;
+			}
+			checked++;
+			if (seen == sim_seen_count)
+			{
+				fprintf(stderr, "%s:%d: expected %s %s at %.1f ms, no more %s transitions\n", sim_trace_name,
+						line->number, sim_sm_names[sm], sim_name(sim_states[sm], line->value), line->ms, sim_sm_names[sm]);
+				sim_errors++;
+				break;
+			}
+			if ((sim_seen[seen].state != line->value) || (sim_seen[seen].ms > line->ms + sim_tolerance)
+			 || (sim_seen[seen].ms < line->ms - sim_tolerance))
+			{
+				fprintf(stderr, "%s:%d: expected %s %s at %.1f ms, got %s at %.1f ms\n", sim_trace_name, line->number,
+						sim_sm_names[sm], sim_name(sim_states[sm], line->value), line->ms,
+						sim_name(sim_states[sm], sim_seen[seen].state), sim_seen[seen].ms);
+				sim_errors++;
+				if (sim_seen[seen].state != line->value)
+				{
+					break;										// Out of step, the rest would only repeat it
+				}
+			}
+			seen++;
+		}
+		for (; seen < sim_seen_count; seen++)
+		{
+			if (sim_seen[seen].sm == sm)
+			{
+				fprintf(stderr, "%s: unexpected %s %s at %.1f ms\n", sim_trace_name, sim_sm_names[sm],
+						sim_name(sim_states[sm], sim_seen[seen].state), sim_seen[seen].ms);
+				sim_errors++;
+				break;
+			}
+		}
+	}
+	return checked;
+}
+
+/*
+ * Print the trace again with the state transitions of this run
+ *  A comment stays with the timed line after it, a transition follows the trace lines at its time.
+ */
+static void sim_record(void)
+{
+	uint8_t timed = FALSE;
+	int seen = 0;
+	int i;
+
+	for (i = 0; i < sim_line_count; i++)
+	{
+		const sim_line_t *line = &sim_lines[i];
+		double ms = line->ms;
+		int j;
+
+		if (line->type == LINE_STATE)
+		{
+			continue;
+		}
+		if (line->type == LINE_COMMENT)
+		{
+			// Time of the next timed line, the file header stays first
+			for (j = i + 1; (j < sim_line_count) && ((sim_lines[j].type == LINE_COMMENT)
+													 || (sim_lines[j].type == LINE_STATE)); j++);
+			ms = !timed ? -1 : (j < sim_line_count) ? sim_lines[j].ms : 1e30;
+		}
+		timed |= line->type != LINE_COMMENT;
+		while ((seen < sim_seen_count) && (sim_seen[seen].ms < ms))
+		{
+			printf("%.1f %s %s\n", sim_seen[seen].ms, sim_sm_names[sim_seen[seen].sm],
+				   sim_name(sim_states[sim_seen[seen].sm], sim_seen[seen].state));
+			seen++;
+		}
+		printf("%s\n", line->text);
+	}
+	for (; seen < sim_seen_count; seen++)
+	{
+		printf("%.1f %s %s\n", sim_seen[seen].ms, sim_sm_names[sim_seen[seen].sm],
+			   sim_name(sim_states[sim_seen[seen].sm], sim_seen[seen].state));
+	}
+}
+
+/*
+ * Report and end the replay
+ */
+static void sim_finish(void)
+{
+	static const char *const ctx_names[CTX_COUNT] = { "main loop pass", "RTC_OVF_vect", "PORTA_INT_vect",
+													  "PORTC_INT_vect", "NVM_EE_vect" };
+	int checked;
+	uint8_t i;
+
+	sim_sync();
+	sim_observe();
+	if (opt_record)
+	{
+		sim_record();
+		exit(sim_errors ? 1 : 0);
+	}
+	checked = sim_compare();
+	if (opt_stats)
+	{
+		printf("%s: %.1f ms simulated\n", sim_trace_name, SIM_MS(sim_now));
+		printf("  main loop passes   %lu (%lu cli)\n", sim_passes, sim_cli_count);
+		printf("  RTC interrupts     %lu (%lu stretched periods; DOWN %lu, ON_IGN %lu, ON_SW %lu)\n",
+			   sim_isr_calls[CTX_RTC], sim_rtc_stretched, sim_rtc_by_power[SM_POWER_DOWN],
+			   sim_rtc_by_power[SM_POWER_ON_IGN], sim_rtc_by_power[SM_POWER_ON_SW]);
+		printf("  port interrupts    %lu\n", sim_isr_calls[CTX_PORTA] + sim_isr_calls[CTX_PORTC]);
+		printf("  sleep              Idle %lu for %.1f ms, Power Save %lu for %.1f ms\n", sim_sleeps_idle,
+			   SIM_MS(sim_time_idle), sim_sleeps_psave, SIM_MS(sim_time_psave));
+		printf("  EEPROM page writes config %lu, log %lu, stats %lu\n", sim_eeprom_writes[0], sim_eeprom_writes[1],
+			   sim_eeprom_writes[2]);
+		printf("  watchdog           longest %.1f ms between resets\n", SIM_MS(sim_wdt_gap));
+	}
+	if (opt_bench)
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		printf("%s: host TSC cycles per step (average / longest)\n", sim_trace_name);
+#else
+		printf("%s: host nanoseconds per step (average / longest)\n", sim_trace_name);
+#endif
+		for (i = 0; i < CTX_COUNT; i++)
+		{
+			unsigned long calls = i ? sim_isr_calls[i] : sim_passes;
+
+			if (calls)
+			{
+				printf("  %-16s %8lu x %8.0f / %8llu\n", ctx_names[i], calls, (double) sim_ctx_cycles[i] / calls,
+					   (unsigned long long) sim_ctx_max[i]);
+			}
+		}
+	}
+	printf("%s: %s (%d transitions checked, %d errors)\n", sim_trace_name, sim_errors ? "FAIL" : "PASS", checked,
+		   sim_errors);
+	exit(sim_errors ? 1 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	int arg;
+
+	for (arg = 1; (arg < argc) && (argv[arg][0] == '-'); arg++)
+	{
+		opt_timeline |= strchr(argv[arg], 't') != NULL;
+		opt_stats |= strchr(argv[arg], 's') != NULL;
+		opt_bench |= strchr(argv[arg], 'b') != NULL;
+		opt_record |= strchr(argv[arg], 'r') != NULL;
+	}
+	if (arg != argc - 1)
+	{
+		fprintf(stderr, "usage: %s [-t] [-s] [-b] [-r] trace\n", argv[0]);
+		return 2;
+	}
+	sim_trace_name = argv[arg];
+	if ((size_t) (__stop_sim_eemem - __start_sim_eemem) > EEPROM_SIZE)
+	{
+		fprintf(stderr, "EEMEM variables need %u bytes, the EEPROM has %u\n",
+				(unsigned) (__stop_sim_eemem - __start_sim_eemem), EEPROM_SIZE);
+		return 2;
+	}
+	(void) sim_eeprom_origin;
+	sim_eeprom_base = (uint16_t) (uintptr_t) __start_sim_eemem;
+	sim_eeprom_mapped = (uintptr_t) sim_eeprom_buffer - sim_eeprom_base;
+	memset(sim_eeprom, 0xFF, EEPROM_SIZE);				// Erased EEPROM
+	memcpy(sim_eeprom_buffer, sim_eeprom, EEPROM_SIZE);
+	sim_load(sim_trace_name);
+	// Reset state
+	RST.STATUS = RST_PORF_bm;
+	OSC.CTRL = OSC_RC2MEN_bm;
+	RTC.PER = 0xFFFF;
+	PORTA.INTCTRL = PORTC.INTCTRL = 0;
+	sim_sreg_i = FALSE;
+	sim_sync();
+	sim_leave();
+	atv_main();
+	return 0;
+}